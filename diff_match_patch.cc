@@ -22,19 +22,196 @@
 
 #include "diff_match_patch.h"
 
+#include <string.h>
 #include <time.h>
 #include <wchar.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <codecvt>
+#include <condition_variable>
 #include <deque>
+#include <exception>
+#include <functional>
 #include <iomanip>
+#include <iterator>
 #include <limits>
 #include <locale>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <type_traits>
 #include <unordered_set>
 
-typedef std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t>
-    UnicodeEncoder;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define DIFF_MATCH_PATCH_MMAP
+#else
+#include <fstream>
+#endif
+
+//////////////////////////
+//
+// DiffStats Class
+//
+//////////////////////////
+
+namespace {
+
+// Phases timed for DiffStats.
+enum StatsPhase {
+  PREFIX_PHASE,
+  HALF_MATCH_PHASE,
+  LINE_HASH_PHASE,
+  BISECT_PHASE,
+  CLEANUP_PHASE,
+  TRANSCODE_PHASE,
+  PHASE_COUNT
+};
+
+#ifdef DIFF_MATCH_PATCH_STATS
+
+const bool kStatsEnabled = true;
+
+// Counters behind diff_match_patch::diff_stats(), shared by every instance
+// and thread.  Static storage starts them at zero.
+struct StatsCounters {
+  std::atomic<uint64_t> calls[PHASE_COUNT];
+  std::atomic<uint64_t> nanoseconds[PHASE_COUNT];
+  std::atomic<uint64_t> bisect_depth;
+  std::atomic<uint64_t> bisect_steps;
+  std::atomic<uint64_t> deadline_hits;
+  std::atomic<uint64_t> bytes_transcoded;
+} stats_counters;
+
+inline void AddStat(std::atomic<uint64_t> &counter, uint64_t value) {
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+// Times a phase while in scope, or until stopped.  A phase started within
+// another one pauses it, so that each phase only counts its own time and
+// the phases add up to the time spent in the library.
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(StatsPhase phase)
+      : phase_(phase), parent_(current_), running_(true) {
+    start_ = Clock::now();
+    if (parent_ != NULL) {
+      parent_->Pause(start_);
+    }
+    current_ = this;
+    AddStat(stats_counters.calls[phase_], 1);
+  }
+
+  ~PhaseTimer() { Stop(); }
+
+  void Stop() {
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+    const Clock::time_point now = Clock::now();
+    Pause(now);
+    current_ = parent_;
+    if (parent_ != NULL) {
+      parent_->start_ = now;
+    }
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  PhaseTimer(const PhaseTimer &);
+  PhaseTimer &operator=(const PhaseTimer &);
+
+  void Pause(Clock::time_point now) {
+    AddStat(stats_counters.nanoseconds[phase_],
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_)
+                .count());
+  }
+
+  // Innermost phase running on this thread.
+  static thread_local PhaseTimer *current_;
+
+  const StatsPhase phase_;
+  PhaseTimer *const parent_;
+  Clock::time_point start_;
+  bool running_;
+};
+
+thread_local PhaseTimer *PhaseTimer::current_ = NULL;
+
+void CountBisect(int64_t depth) {
+  AddStat(stats_counters.bisect_steps, depth);
+  uint64_t deepest =
+      stats_counters.bisect_depth.load(std::memory_order_relaxed);
+  while (static_cast<uint64_t>(depth) > deepest &&
+         !stats_counters.bisect_depth.compare_exchange_weak(
+             deepest, depth, std::memory_order_relaxed)) {
+  }
+}
+
+void CountDeadlineHit() { AddStat(stats_counters.deadline_hits, 1); }
+
+void CountTranscoded(std::size_t bytes) {
+  AddStat(stats_counters.bytes_transcoded, bytes);
+}
+
+#else
+
+const bool kStatsEnabled = false;
+
+// Without DIFF_MATCH_PATCH_STATS, the counting compiles to nothing.
+class PhaseTimer {
+ public:
+  explicit PhaseTimer(StatsPhase /*phase*/) {}
+  void Stop() {}
+};
+
+inline void CountBisect(int64_t /*depth*/) {}
+inline void CountDeadlineHit() {}
+inline void CountTranscoded(std::size_t /*bytes*/) {}
+
+#endif  // DIFF_MATCH_PATCH_STATS
+
+// Conversions between UTF-8 and wide text, counted as transcoding.
+class UnicodeEncoder {
+ public:
+  std::wstring from_bytes(const std::string &bytes) {
+    PhaseTimer timer(TRANSCODE_PHASE);
+    CountTranscoded(bytes.size());
+    return converter_.from_bytes(bytes);
+  }
+
+  std::string to_bytes(const std::wstring &text) {
+    PhaseTimer timer(TRANSCODE_PHASE);
+    std::string bytes = converter_.to_bytes(text);
+    CountTranscoded(bytes.size());
+    return bytes;
+  }
+
+ private:
+  std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t> converter_;
+};
+
+}  // namespace
+
+DiffStats::Phase::Phase() : calls(0), nanoseconds(0) {}
+
+DiffStats::DiffStats()
+    : bisectDepth(0),
+      bisectSteps(0),
+      deadlineHits(0),
+      bytesTranscoded(0),
+      enabled(kStatsEnabled) {}
 
 //////////////////////////
 //
@@ -63,38 +240,1002 @@ std::wstring Diff::strOperation(Operation op) {
     case EQUAL:
       return L"EQUAL";
   }
-  throw "Invalid operation.";
-}
+  throw "Invalid operation.";
+}
+
+/**
+ * Display a human-readable version of this Diff.
+ * @return text version
+ */
+std::wstring Diff::toString() const {
+  std::wstring prettyText = text;
+  // Replace linebreaks with Pilcrow signs.
+  std::replace(prettyText.begin(), prettyText.end(), L'\n', L'\u00b6');
+  return L"Diff(" + strOperation(operation) + L",\"" + prettyText + L"\")";
+}
+
+/**
+ * Is this Diff equivalent to another Diff?
+ * @param d Another Diff to compare against
+ * @return true or false
+ */
+bool Diff::operator==(const Diff &d) const {
+  return (d.operation == this->operation) && (d.text == this->text);
+}
+
+bool Diff::operator!=(const Diff &d) const { return !(operator==(d)); }
+
+//////////////////////////
+//
+// FlatDiffs Class
+//
+//////////////////////////
+
+/**
+ * Constructor.  Initializes the operation with the provided values.
+ * @param operation One of INSERT, DELETE or EQUAL
+ * @param source Buffer holding the text
+ * @param offset Start of the text within the buffer
+ * @param length Size of the text
+ */
+DiffOp::DiffOp(Operation _operation, Source _source, std::size_t _offset,
+               std::size_t _length)
+    : operation(_operation),
+      source(_source),
+      offset(_offset),
+      length(_length) {}
+
+DiffOp::DiffOp() : operation(EQUAL), source(ARENA), offset(0), length(0) {}
+
+/**
+ * Constructor.  Initializes the region with the provided values.
+ * @param start1 Start of the region in the old text
+ * @param size1 Size of the region in the old text
+ * @param start2 Start of the region in the new text
+ * @param size2 Size of the region in the new text
+ */
+DiffRegion::DiffRegion(std::size_t _start1, std::size_t _size1,
+                       std::size_t _start2, std::size_t _size2)
+    : start1(_start1), size1(_size1), start2(_start2), size2(_size2) {}
+
+DiffRegion::DiffRegion() : start1(0), size1(0), start2(0), size2(0) {}
+
+bool DiffRegion::operator==(const DiffRegion &d) const {
+  return d.start1 == start1 && d.size1 == size1 && d.start2 == start2 &&
+         d.size2 == size2;
+}
+
+bool DiffRegion::operator!=(const DiffRegion &d) const {
+  return !(operator==(d));
+}
+
+namespace {
+
+// Text of a Diff from text of a diff's own code units, and back.
+std::wstring Widen(const std::wstring &text) { return text; }
+std::wstring Widen(const std::string &text) {
+  UnicodeEncoder unicode_encoder;
+  return unicode_encoder.from_bytes(text);
+}
+void Narrow(const std::wstring &text, std::wstring &out) { out = text; }
+void Narrow(const std::wstring &text, std::string &out) {
+  UnicodeEncoder unicode_encoder;
+  out = unicode_encoder.to_bytes(text);
+}
+
+}  // namespace
+
+template <class Char>
+BasicFlatDiffs<Char>::BasicFlatDiffs()
+    : text1_(NULL), text1_size_(0), text2_(NULL), text2_size_(0) {}
+
+template <class Char>
+BasicFlatDiffs<Char>::BasicFlatDiffs(const String &text1, const String &text2)
+    : text1_(text1.data()),
+      text1_size_(text1.size()),
+      text2_(text2.data()),
+      text2_size_(text2.size()) {}
+
+template <class Char>
+BasicFlatDiffs<Char>::BasicFlatDiffs(const Char *text1, std::size_t text1_size,
+                                     const Char *text2, std::size_t text2_size)
+    : text1_(text1),
+      text1_size_(text1_size),
+      text2_(text2),
+      text2_size_(text2_size) {}
+
+template <class Char>
+const Char *BasicFlatDiffs<Char>::base(DiffOp::Source source) const {
+  switch (source) {
+    case DiffOp::TEXT1:
+      return text1_ != NULL ? text1_ : owned_text1_.data();
+    case DiffOp::TEXT2:
+      return text2_ != NULL ? text2_ : owned_text2_.data();
+    case DiffOp::ARENA:
+      return arena_.data();
+  }
+  throw "Invalid source.";
+}
+
+template <class Char>
+const Char *BasicFlatDiffs<Char>::data(const DiffOp &op) const {
+  return base(op.source) + op.offset;
+}
+
+template <class Char>
+typename BasicFlatDiffs<Char>::String BasicFlatDiffs<Char>::text(
+    const DiffOp &op) const {
+  return String(data(op), op.length);
+}
+
+template <class Char>
+void BasicFlatDiffs<Char>::appendText(Operation operation,
+                                      const String &text) {
+  ops.push_back(DiffOp(operation, DiffOp::ARENA, arena_.size(), text.size()));
+  arena_ += text;
+}
+
+template <class Char>
+std::list<Diff> BasicFlatDiffs<Char>::toList() const {
+  std::list<Diff> diffs;
+  for (const auto &op : ops) {
+    diffs.push_back(Diff(op.operation, Widen(text(op))));
+  }
+  return diffs;
+}
+
+template <class Char>
+BasicFlatDiffs<Char> BasicFlatDiffs<Char>::fromList(
+    const std::list<Diff> &diffs) {
+  BasicFlatDiffs flat;
+  flat.ops.reserve(diffs.size());
+  String text;
+  for (const auto &aDiff : diffs) {
+    Narrow(aDiff.text, text);
+    flat.appendText(aDiff.operation, text);
+  }
+  return flat;
+}
+
+template <class Char>
+void BasicFlatDiffs<Char>::anchor() {
+  bool has_arena = false;
+  for (const auto &op : ops) {
+    has_arena = has_arena || op.source == DiffOp::ARENA;
+  }
+  if (has_arena && (text1_ == NULL || text2_ == NULL)) {
+    // Rebuild the missing texts, which are the only copy this diff makes.
+    String text1, text2;
+    for (const auto &op : ops) {
+      if (op.operation != INSERT) {
+        text1.append(data(op), op.length);
+      }
+      if (op.operation != DELETE) {
+        text2.append(data(op), op.length);
+      }
+    }
+    if (text1_ == NULL) {
+      owned_text1_.swap(text1);
+    }
+    if (text2_ == NULL) {
+      owned_text2_.swap(text2);
+    }
+  }
+  std::size_t char_count1 = 0;
+  std::size_t char_count2 = 0;
+  for (auto &op : ops) {
+    if (op.operation == INSERT) {
+      op.source = DiffOp::TEXT2;
+      op.offset = char_count2;
+    } else {
+      op.source = DiffOp::TEXT1;
+      op.offset = char_count1;
+    }
+    if (op.operation != INSERT) {
+      char_count1 += op.length;
+    }
+    if (op.operation != DELETE) {
+      char_count2 += op.length;
+    }
+  }
+  if (has_arena) {
+    arena_.clear();
+  }
+}
+
+template <class Char>
+void BasicFlatDiffs<Char>::append(const BasicFlatDiffs &diffs) {
+  const std::size_t shift1 = diffs.base(DiffOp::TEXT1) - base(DiffOp::TEXT1);
+  const std::size_t shift2 = diffs.base(DiffOp::TEXT2) - base(DiffOp::TEXT2);
+  ops.reserve(ops.size() + diffs.ops.size());
+  for (DiffOp op : diffs.ops) {
+    op.offset += op.source == DiffOp::TEXT1 ? shift1 : shift2;
+    ops.push_back(op);
+  }
+  for (const auto &region : diffs.approximate) {
+    markApproximate(DiffRegion(region.start1 + shift1, region.size1,
+                               region.start2 + shift2, region.size2));
+  }
+}
+
+template <class Char>
+void BasicFlatDiffs<Char>::markApproximate(const DiffRegion &region) {
+  std::size_t start1 = region.start1;
+  std::size_t start2 = region.start2;
+  std::size_t end1 = region.start1 + region.size1;
+  std::size_t end2 = region.start2 + region.size2;
+  // Regions are in the same order in both texts, and new ones usually come
+  // last: skip back over those after this one, then over those touching it.
+  auto last = approximate.end();
+  while (last != approximate.begin() &&
+         ((last - 1)->start1 > end1 || (last - 1)->start2 > end2)) {
+    --last;
+  }
+  auto first = last;
+  while (first != approximate.begin() &&
+         (first - 1)->start1 + (first - 1)->size1 >= start1 &&
+         (first - 1)->start2 + (first - 1)->size2 >= start2) {
+    --first;
+  }
+  for (auto it = first; it != last; ++it) {
+    start1 = std::min(start1, it->start1);
+    start2 = std::min(start2, it->start2);
+    end1 = std::max(end1, it->start1 + it->size1);
+    end2 = std::max(end2, it->start2 + it->size2);
+  }
+  approximate.insert(approximate.erase(first, last),
+                     DiffRegion(start1, end1 - start1, start2, end2 - start2));
+}
+
+template class BasicFlatDiffs<wchar_t>;
+template class BasicFlatDiffs<char>;
+
+/////////////////////////////////////////////
+//
+// Patch Class
+//
+/////////////////////////////////////////////
+
+namespace {
+
+// Character spans are compared in place, without building substrings.
+template <class Char>
+bool SpanEquals(const Char *text1, const Char *text2, std::size_t size) {
+  return size == 0 || memcmp(text1, text2, size * sizeof(Char)) == 0;
+}
+
+// Common prefix and suffix kernels.  Each compares n bytes of two spans, from
+// the start for a prefix and from the end for a suffix, and returns the number
+// of equal bytes.  Working on bytes lets one set of kernels serve wchar_t and
+// UTF-8 text alike.  The vector versions finish with the scalar loop on the
+// last partial block.
+
+std::size_t CommonPrefixScalar(const char *text1, const char *text2,
+                               std::size_t n) {
+  // Performance analysis: http://neil.fraser.name/news/2007/10/09/
+  std::size_t i = 0;
+  for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+    uint64_t x, y;
+    memcpy(&x, text1 + i, sizeof(x));
+    memcpy(&y, text2 + i, sizeof(y));
+    if (x != y) {
+      break;
+    }
+  }
+  for (; i < n; i++) {
+    if (text1[i] != text2[i]) {
+      return i;
+    }
+  }
+  return n;
+}
+
+std::size_t CommonSuffixScalar(const char *text1, const char *text2,
+                               std::size_t n) {
+  std::size_t i = 0;
+  for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+    uint64_t x, y;
+    memcpy(&x, text1 + n - i - sizeof(x), sizeof(x));
+    memcpy(&y, text2 + n - i - sizeof(y), sizeof(y));
+    if (x != y) {
+      break;
+    }
+  }
+  for (; i < n; i++) {
+    if (text1[n - i - 1] != text2[n - i - 1]) {
+      return i;
+    }
+  }
+  return n;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIFF_MATCH_PATCH_X86_KERNELS
+
+// Bytes common to the start of a block, given its byte mismatch mask.
+inline std::size_t PrefixInBlock(uint64_t mismatch) {
+  return __builtin_ctzll(mismatch);
+}
+
+// Bytes common to the end of a block of 'block' bytes.
+inline std::size_t SuffixInBlock(uint64_t mismatch, std::size_t block) {
+  return block - 1 - (63 - __builtin_clzll(mismatch));
+}
+
+__attribute__((target("sse2"))) std::size_t CommonPrefixSse2(
+    const char *text1, const char *text2, std::size_t n) {
+  const std::size_t block = sizeof(__m128i);
+  std::size_t i = 0;
+  for (; i + block <= n; i += block) {
+    const __m128i x =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(text1 + i));
+    const __m128i y =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(text2 + i));
+    const uint64_t mismatch =
+        ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+    if (mismatch != 0) {
+      return i + PrefixInBlock(mismatch);
+    }
+  }
+  return i + CommonPrefixScalar(text1 + i, text2 + i, n - i);
+}
+
+__attribute__((target("sse2"))) std::size_t CommonSuffixSse2(
+    const char *text1, const char *text2, std::size_t n) {
+  const std::size_t block = sizeof(__m128i);
+  std::size_t i = 0;
+  for (; i + block <= n; i += block) {
+    const std::size_t start = n - i - block;
+    const __m128i x =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(text1 + start));
+    const __m128i y =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(text2 + start));
+    const uint64_t mismatch =
+        ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+    if (mismatch != 0) {
+      return i + SuffixInBlock(mismatch, block);
+    }
+  }
+  return i + CommonSuffixScalar(text1, text2, n - i);
+}
+
+__attribute__((target("avx2"))) std::size_t CommonPrefixAvx2(
+    const char *text1, const char *text2, std::size_t n) {
+  const std::size_t block = sizeof(__m256i);
+  std::size_t i = 0;
+  for (; i + block <= n; i += block) {
+    const __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text1 + i));
+    const __m256i y =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text2 + i));
+    const uint64_t mismatch = static_cast<uint32_t>(
+        ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+    if (mismatch != 0) {
+      return i + PrefixInBlock(mismatch);
+    }
+  }
+  return i + CommonPrefixScalar(text1 + i, text2 + i, n - i);
+}
+
+__attribute__((target("avx2"))) std::size_t CommonSuffixAvx2(
+    const char *text1, const char *text2, std::size_t n) {
+  const std::size_t block = sizeof(__m256i);
+  std::size_t i = 0;
+  for (; i + block <= n; i += block) {
+    const std::size_t start = n - i - block;
+    const __m256i x =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text1 + start));
+    const __m256i y =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text2 + start));
+    const uint64_t mismatch = static_cast<uint32_t>(
+        ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+    if (mismatch != 0) {
+      return i + SuffixInBlock(mismatch, block);
+    }
+  }
+  return i + CommonSuffixScalar(text1, text2, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) std::size_t CommonPrefixAvx512(
+    const char *text1, const char *text2, std::size_t n) {
+  const std::size_t block = sizeof(__m512i);
+  std::size_t i = 0;
+  for (; i + block <= n; i += block) {
+    const __m512i x = _mm512_loadu_si512(text1 + i);
+    const __m512i y = _mm512_loadu_si512(text2 + i);
+    const uint64_t mismatch = _mm512_cmpneq_epi8_mask(x, y);
+    if (mismatch != 0) {
+      return i + PrefixInBlock(mismatch);
+    }
+  }
+  return i + CommonPrefixScalar(text1 + i, text2 + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) std::size_t CommonSuffixAvx512(
+    const char *text1, const char *text2, std::size_t n) {
+  const std::size_t block = sizeof(__m512i);
+  std::size_t i = 0;
+  for (; i + block <= n; i += block) {
+    const std::size_t start = n - i - block;
+    const __m512i x = _mm512_loadu_si512(text1 + start);
+    const __m512i y = _mm512_loadu_si512(text2 + start);
+    const uint64_t mismatch = _mm512_cmpneq_epi8_mask(x, y);
+    if (mismatch != 0) {
+      return i + SuffixInBlock(mismatch, block);
+    }
+  }
+  return i + CommonSuffixScalar(text1, text2, n - i);
+}
+
+#endif  // x86 kernels
+
+typedef std::size_t (*CommonRunKernel)(const char *, const char *,
+                                       std::size_t);
+
+// The widest kernels this CPU supports, chosen once.
+struct CommonRunKernels {
+  CommonRunKernel prefix;
+  CommonRunKernel suffix;
+
+  CommonRunKernels()
+      : prefix(&CommonPrefixScalar), suffix(&CommonSuffixScalar) {
+#ifdef DIFF_MATCH_PATCH_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+      prefix = &CommonPrefixAvx512;
+      suffix = &CommonSuffixAvx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+      prefix = &CommonPrefixAvx2;
+      suffix = &CommonSuffixAvx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+      prefix = &CommonPrefixSse2;
+      suffix = &CommonSuffixSse2;
+    }
+#endif
+  }
+
+  static const CommonRunKernels &Get() {
+    static const CommonRunKernels kernels;
+    return kernels;
+  }
+};
+
+// Characters common to the start of two spans.
+template <class Char>
+std::size_t CommonPrefix(const Char *text1, std::size_t text1_size,
+                         const Char *text2, std::size_t text2_size) {
+  return CommonRunKernels::Get().prefix(
+             reinterpret_cast<const char *>(text1),
+             reinterpret_cast<const char *>(text2),
+             std::min(text1_size, text2_size) * sizeof(Char)) /
+         sizeof(Char);
+}
+
+// Characters common to the end of two spans.
+template <class Char>
+std::size_t CommonSuffix(const Char *text1, std::size_t text1_size,
+                         const Char *text2, std::size_t text2_size) {
+  const std::size_t n = std::min(text1_size, text2_size);
+  return CommonRunKernels::Get().suffix(
+             reinterpret_cast<const char *>(text1 + text1_size - n),
+             reinterpret_cast<const char *>(text2 + text2_size - n),
+             n * sizeof(Char)) /
+         sizeof(Char);
+}
+
+// Length of the snake starting at text1[x], text2[y]: the characters common
+// to the start of text1[x:] and text2[y:].  Most snakes end at once, so the
+// first character is checked before handing the run to a vector kernel.
+template <class Char>
+inline int64_t ForwardSnake(const Char *text1, int64_t text1_size,
+                            const Char *text2, int64_t text2_size, int64_t x,
+                            int64_t y) {
+  if (x >= text1_size || y >= text2_size || text1[x] != text2[y]) {
+    return 0;
+  }
+  return 1 + CommonPrefix(text1 + x + 1, text1_size - x - 1, text2 + y + 1,
+                          text2_size - y - 1);
+}
+
+// Length of the snake ending x characters before the end of text1 and y
+// before the end of text2: the characters common to the end of
+// text1[:-x] and text2[:-y].
+template <class Char>
+inline int64_t ReverseSnake(const Char *text1, int64_t text1_size,
+                            const Char *text2, int64_t text2_size, int64_t x,
+                            int64_t y) {
+  if (x >= text1_size || y >= text2_size ||
+      text1[text1_size - x - 1] != text2[text2_size - y - 1]) {
+    return 0;
+  }
+  return 1 + CommonSuffix(text1, text1_size - x - 1, text2,
+                          text2_size - y - 1);
+}
+
+template <class Char>
+std::size_t CommonOverlap(const Char *text1, std::size_t text1_size,
+                          const Char *text2, std::size_t text2_size) {
+  // Eliminate the null case.
+  if (text1_size == 0 || text2_size == 0) {
+    return 0;
+  }
+  // Truncate the longer string.
+  const std::size_t text_size = std::min(text1_size, text2_size);
+  const Char *text1_trunc = text1 + (text1_size - text_size);
+  const Char *text2_trunc = text2;
+  // Quick check for the worst case.
+  if (SpanEquals(text1_trunc, text2_trunc, text_size)) {
+    return text_size;
+  }
+
+  // Start by looking for a single character match
+  // and increase size until no match is found.
+  // Performance analysis: http://neil.fraser.name/news/2010/11/04/
+  std::size_t best = 0;
+  std::size_t size = 1;
+  while (true) {
+    const Char *pattern = text1_trunc + text_size - size;
+    const Char *found_at = std::search(text2_trunc, text2_trunc + text_size,
+                                       pattern, pattern + size);
+    if (found_at == text2_trunc + text_size) {
+      return best;
+    }
+    const std::size_t found = found_at - text2_trunc;
+    size += found;
+    if (found == 0 ||
+        SpanEquals(text1_trunc + text_size - size, text2_trunc, size)) {
+      best = size;
+      size++;
+    }
+  }
+}
+
+// Index of the first occurrence of needle in text at or after 'from', or
+// std::wstring::npos.  Same contract as std::wstring::find.
+template <class Char>
+std::size_t FindSpan(const Char *text, std::size_t text_size,
+                     const Char *needle, std::size_t needle_size,
+                     std::size_t from = 0) {
+  if (from > text_size || needle_size > text_size - from) {
+    return std::wstring::npos;
+  }
+  const Char *found =
+      std::search(text + from, text + text_size, needle, needle + needle_size);
+  return found == text + text_size && needle_size != 0
+             ? std::wstring::npos
+             : found - text;
+}
+
+// Index of the last occurrence of needle in text starting at or before
+// 'from', or std::wstring::npos.  Same contract as std::wstring::rfind.
+template <class Char>
+std::size_t RFindSpan(const Char *text, std::size_t text_size,
+                      const Char *needle, std::size_t needle_size,
+                      std::size_t from) {
+  if (needle_size > text_size) {
+    return std::wstring::npos;
+  }
+  const std::size_t last = std::min(from, text_size - needle_size);
+  const Char *found = std::find_end(text, text + last + needle_size, needle,
+                                    needle + needle_size);
+  return found == text + last + needle_size && needle_size != 0
+             ? std::wstring::npos
+             : found - text;
+}
+
+// Does the text end with a blank line?  Matches "\n\r?\n$".
+template <class Char>
+bool EndsWithBlankLine(const Char *text, std::size_t size) {
+  if (size < 2 || text[size - 1] != '\n') {
+    return false;
+  }
+  return text[size - 2] == '\n' ||
+         (size >= 3 && text[size - 2] == '\r' && text[size - 3] == '\n');
+}
+
+// Does the text start with a blank line?  Matches "^\r?\n\r?\n".
+template <class Char>
+bool StartsWithBlankLine(const Char *text, std::size_t size) {
+  std::size_t pos = 0;
+  for (int line = 0; line < 2; line++) {
+    if (pos < size && text[pos] == '\r') {
+      pos++;
+    }
+    if (pos >= size || text[pos] != '\n') {
+      return false;
+    }
+    pos++;
+  }
+  return true;
+}
+
+// Does a code point of the UTF-8 text start at pos?  The end of the text
+// counts as a boundary.
+inline bool IsUtf8Boundary(const char *text, std::size_t size,
+                           std::size_t pos) {
+  return pos == size || (static_cast<unsigned char>(text[pos]) & 0xC0) != 0x80;
+}
+
+// Character seen by diff_cleanupSemanticScore on one side of a boundary.
+// The bytes of a multi-byte UTF-8 sequence are all seen as letters, so that a
+// boundary inside a code point scores no better than one inside a word.
+inline wint_t ScoreClass(wchar_t c) { return c; }
+inline wint_t ScoreClass(char32_t c) { return c; }
+inline wint_t ScoreClass(char c) {
+  return static_cast<unsigned char>(c) < 0x80 ? static_cast<wint_t>(c) : L'a';
+}
+
+// Does a code point start at this code unit?
+inline bool IsCodePointStart(wchar_t /*c*/) { return true; }
+inline bool IsCodePointStart(char c) {
+  return (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+}
+
+// Number of code points in a span, which is its size for wide text.
+inline std::size_t CodePointCount(const wchar_t * /*text*/, std::size_t size) {
+  return size;
+}
+inline std::size_t CodePointCount(const char *text, std::size_t size) {
+  std::size_t count = 0;
+  for (std::size_t i = 0; i < size; i++) {
+    count += IsCodePointStart(text[i]);
+  }
+  return count;
+}
+
+// Bucket of the q-gram starting at gram, out of 2^(64 - shift) buckets.
+template <class Char>
+std::size_t GramBucket(const Char *gram, std::size_t q, int shift) {
+  // Fibonacci hashing, keeping the top bits.
+  uint64_t hash = 0;
+  for (std::size_t k = 0; k < q; k++) {
+    hash = (hash ^ static_cast<uint32_t>(gram[k])) * 0x9E3779B97F4A7C15ull;
+  }
+  return hash >> shift;
+}
+
+// Buckets the q-grams of text[0, size) by their hash, with about as many
+// buckets as grams, and returns the shift which GramBucket takes.  The grams
+// of bucket b start at positions[starts[b]] up to positions[starts[b + 1]],
+// in increasing order.
+template <class Char>
+int BucketGrams(const Char *text, std::size_t size, std::size_t q,
+                std::vector<uint32_t> &starts,
+                std::vector<uint32_t> &positions) {
+  const std::size_t grams = size < q ? 0 : size - q + 1;
+  int shift = 63;
+  while (shift > 32 && (std::size_t(1) << (64 - shift)) < grams) {
+    shift--;
+  }
+  starts.assign((std::size_t(1) << (64 - shift)) + 1, 0);
+  for (std::size_t i = 0; i < grams; i++) {
+    starts[GramBucket(text + i, q, shift) + 1]++;
+  }
+  for (std::size_t b = 1; b < starts.size(); b++) {
+    starts[b] += starts[b - 1];
+  }
+  std::vector<uint32_t> next(starts.begin(), starts.end() - 1);
+  positions.resize(grams);
+  for (std::size_t i = 0; i < grams; i++) {
+    positions[next[GramBucket(text + i, q, shift)]++] =
+        static_cast<uint32_t>(i);
+  }
+  return shift;
+}
+
+// Positions of the q-grams of a text, bucketed by their hash as in
+// MatchIndex, so that a pattern is looked for among the positions of its
+// rarest gram rather than all over the text.
+template <class Char>
+class GramIndex {
+ public:
+  GramIndex(const Char *text, std::size_t size, std::size_t q)
+      : text_(text),
+        q_(q),
+        shift_(BucketGrams(text, size, q, starts_, positions_)) {}
+
+  const Char *text() const { return text_; }
+  std::size_t q() const { return q_; }
+
+  // Occurrences of a pattern at least q long starting in text[from, to],
+  // counting no further than 'limit'.  The pattern must fit in the text
+  // wherever it starts there.
+  std::size_t Count(const Char *pattern, std::size_t len, std::size_t from,
+                    std::size_t to, std::size_t limit) const {
+    std::size_t offset = 0;
+    std::size_t bucket = Bucket(pattern);
+    for (std::size_t i = 1; i + q_ <= len; i++) {
+      const std::size_t b = Bucket(pattern + i);
+      if (starts_[b + 1] - starts_[b] < starts_[bucket + 1] - starts_[bucket]) {
+        offset = i;
+        bucket = b;
+      }
+    }
+    const uint32_t *position = std::lower_bound(
+        positions_.data() + starts_[bucket],
+        positions_.data() + starts_[bucket + 1], from + offset);
+    const uint32_t *last = positions_.data() + starts_[bucket + 1];
+    std::size_t count = 0;
+    for (; position != last && *position <= to + offset && count < limit;
+         ++position) {
+      count += SpanEquals(text_ + *position - offset, pattern, len);
+    }
+    return count;
+  }
+
+ private:
+  std::size_t Bucket(const Char *gram) const {
+    return GramBucket(gram, q_, shift_);
+  }
+
+  const Char *text_;
+  std::size_t q_;
+  std::vector<uint32_t> starts_;
+  std::vector<uint32_t> positions_;
+  int shift_;
+};
+
+// Text that patch_make works against: the new text up to where the previous
+// patch ended, followed by the old text after it.  This is the old text with
+// the patches made so far applied, read from both texts rather than rebuilt.
+template <class Char>
+class RollingText {
+ public:
+  RollingText(const Char *head, std::size_t head_size, const Char *tail,
+              std::size_t tail_size)
+      : head_(head),
+        head_size_(head_size),
+        tail_(tail),
+        tail_size_(tail_size),
+        head_index_(NULL),
+        tail_index_(NULL) {}
+
+  std::size_t size() const { return head_size_ + tail_size_; }
+
+  // Looks for repeats among the grams of the texts which the head starts and
+  // the tail ends, rather than all over them.
+  void Index(const GramIndex<Char> *head_index,
+             const GramIndex<Char> *tail_index) {
+    head_index_ = head_index;
+    tail_index_ = tail_index;
+  }
+
+  Char at(std::size_t pos) const {
+    return pos < head_size_ ? head_[pos] : tail_[pos - head_size_];
+  }
+
+  std::basic_string<Char> substr(std::size_t pos, std::size_t len) const {
+    std::basic_string<Char> text;
+    text.reserve(len);
+    if (pos < head_size_) {
+      const std::size_t from_head = std::min(len, head_size_ - pos);
+      text.append(head_ + pos, from_head);
+      pos += from_head;
+      len -= from_head;
+    }
+    if (len > 0) {
+      text.append(tail_ + (pos - head_size_), len);
+    }
+    return text;
+  }
+
+  // Position 'count' code points before pos, or the start of the text.
+  std::size_t Back(std::size_t pos, std::size_t count) const {
+    while (pos > 0 && count > 0) {
+      pos--;
+      count -= IsCodePointStart(at(pos));
+    }
+    while (pos > 0 && !IsCodePointStart(at(pos))) {
+      pos--;
+    }
+    return pos;
+  }
+
+  // Position 'count' code points after pos, or the end of the text.
+  std::size_t Forward(std::size_t pos, std::size_t count) const {
+    while (pos < size() && count > 0) {
+      pos++;
+      count -= pos == size() || IsCodePointStart(at(pos));
+    }
+    return pos;
+  }
+
+  // Number of code points in text[pos, pos + len), counting no further than
+  // 'limit'.
+  std::size_t CodePoints(std::size_t pos, std::size_t len,
+                         std::size_t limit) const {
+    std::size_t count = 0;
+    for (std::size_t i = pos; i < pos + len && count < limit; i++) {
+      count += IsCodePointStart(at(i));
+    }
+    return count;
+  }
+
+  // Does text[pos, pos + len) occur more than once in the text?
+  bool Repeats(std::size_t pos, std::size_t len) const {
+    if (len == 0) {
+      return size() != 0;
+    }
+    const std::basic_string<Char> pattern = substr(pos, len);
+    std::size_t found = 0;
+    // Occurrences within the head, then across the join, then in the tail.
+    if (head_index_ == NULL || len < head_index_->q()) {
+      found += Count(head_, head_size_, pattern, 2);
+    } else if (len <= head_size_) {
+      found += head_index_->Count(pattern.data(), len, 0, head_size_ - len, 2);
+    }
+    if (found < 2 && head_size_ != 0 && tail_size_ != 0) {
+      const std::size_t before = std::min(head_size_, len - 1);
+      std::basic_string<Char> join(head_ + head_size_ - before, before);
+      join.append(tail_, std::min(tail_size_, len - 1));
+      // Only occurrences starting before the join are not in the tail.
+      std::size_t from = 0;
+      while (found < 2 && from < before) {
+        from = FindSpan(join.data(), join.size(), pattern.data(), len, from);
+        if (from == std::wstring::npos || from >= before) {
+          break;
+        }
+        found++;
+        from++;
+      }
+    }
+    if (found < 2 && (tail_index_ == NULL || len < tail_index_->q())) {
+      found += Count(tail_, tail_size_, pattern, 2 - found);
+    } else if (found < 2 && len <= tail_size_) {
+      const std::size_t from = tail_ - tail_index_->text();
+      found += tail_index_->Count(pattern.data(), len, from,
+                                  from + tail_size_ - len, 2 - found);
+    }
+    return found >= 2;
+  }
+
+ private:
+  // Occurrences of pattern in text, counting no further than 'limit'.
+  static std::size_t Count(const Char *text, std::size_t text_size,
+                           const std::basic_string<Char> &pattern,
+                           std::size_t limit) {
+    std::size_t count = 0;
+    std::size_t from = 0;
+    while (count < limit) {
+      from = FindSpan(text, text_size, pattern.data(), pattern.size(), from);
+      if (from == std::wstring::npos) {
+        break;
+      }
+      count++;
+      from++;
+    }
+    return count;
+  }
+
+  const Char *head_;
+  std::size_t head_size_;
+  const Char *tail_;
+  std::size_t tail_size_;
+  const GramIndex<Char> *head_index_;
+  const GramIndex<Char> *tail_index_;
+};
+
+// Patches patch_make makes before indexing the texts it takes context from.
+// Until then, looking for repeats all over the texts costs less.
+const std::size_t kContextIndexPatches = 16;
+
+// Gram indexes of the old and new texts which patch_make takes context from,
+// built once it has made enough patches.  With them, making each patch
+// costs time in its size rather than in the size of the texts.
+template <class Char>
+class ContextIndexes {
+ public:
+  ContextIndexes(const Char *text1, std::size_t text1_size, const Char *text2,
+                 std::size_t text2_size)
+      : text1_(text1),
+        text1_size_(text1_size),
+        text2_(text2),
+        text2_size_(text2_size) {}
+
+  // Lets text, made of the new text up to some point and the old text after
+  // it, look for repeats in the indexes if 'patches' patches warrant them.
+  void Use(RollingText<Char> &text, std::size_t patches) {
+    if (patches < kContextIndexPatches || text1_size_ > UINT32_MAX ||
+        text2_size_ > UINT32_MAX) {
+      return;
+    }
+    if (index1_ == NULL) {
+      index1_.reset(new GramIndex<Char>(text1_, text1_size_, 4));
+      index2_.reset(new GramIndex<Char>(text2_, text2_size_, 4));
+    }
+    text.Index(index2_.get(), index1_.get());
+  }
+
+ private:
+  const Char *text1_;
+  std::size_t text1_size_;
+  const Char *text2_;
+  std::size_t text2_size_;
+  std::unique_ptr<GramIndex<Char> > index1_;
+  std::unique_ptr<GramIndex<Char> > index2_;
+};
+
+// Increases the context of a patch starting at text[start] until it is
+// unique, but doesn't let the pattern expand beyond max_bits code points (0 for
+// no limit), then adds one more margin on each side.
+template <class Char>
+void AddContext(Patch &patch, const RollingText<Char> &text,
+                std::size_t start, std::size_t margin, std::size_t max_bits) {
+  if (text.size() == 0) {
+    return;
+  }
+  start = std::min(start, text.size());
+  // The pattern covers patch.size1 code points of the text.
+  const std::size_t size = text.Forward(start, patch.size1) - start;
+  // Bounds of the pattern within text, grown by whole code points.
+  std::size_t begin = start;
+  std::size_t end = start + size;
+  std::size_t padding = 0;
+  const std::size_t max_size =
+      max_bits == 0 ? std::string::npos
+                    : max_bits > 2 * margin ? max_bits - 2 * margin : 0;
+
+  // Look for the first and last matches of pattern in text.  If two different
+  // matches are found, increase the pattern size.
+  while (text.CodePoints(begin, end - begin, max_size) < max_size &&
+         text.Repeats(begin, end - begin)) {
+    padding += margin;
+    begin = text.Back(start, padding);
+    end = text.Forward(start + size, padding);
+  }
+  // Add one chunk for good luck.
+  padding += margin;
+
+  // Add the prefix.
+  begin = text.Back(start, padding);
+  const std::wstring prefix = Widen(text.substr(begin, start - begin));
+  if (!prefix.empty()) {
+    patch.diffs.push_front(Diff(EQUAL, prefix));
+  }
+  // Add the suffix.
+  end = text.Forward(start + size, padding);
+  const std::wstring suffix =
+      Widen(text.substr(start + size, end - start - size));
+  if (!suffix.empty()) {
+    patch.diffs.push_back(Diff(EQUAL, suffix));
+  }
 
-/**
- * Display a human-readable version of this Diff.
- * @return text version
- */
-std::wstring Diff::toString() const {
-  std::wstring prettyText = text;
-  // Replace linebreaks with Pilcrow signs.
-  std::replace(prettyText.begin(), prettyText.end(), L'\n', L'\u00b6');
-  return L"Diff(" + strOperation(operation) + L",\"" + prettyText + L"\")";
+  // Roll back the start points.
+  patch.start1 -= prefix.size();
+  patch.start2 -= prefix.size();
+  // Extend the sizes.
+  patch.size1 += prefix.size() + suffix.size();
+  patch.size2 += prefix.size() + suffix.size();
 }
 
-/**
- * Is this Diff equivalent to another Diff?
- * @param d Another Diff to compare against
- * @return true or false
- */
-bool Diff::operator==(const Diff &d) const {
-  return (d.operation == this->operation) && (d.text == this->text);
+// Replaces the equalities flagged in 'split' by a deletion followed by an
+// insertion of the same text.  Offsets are fixed up by FlatDiffs::anchor().
+void ExpandSplitEqualities(std::vector<DiffOp> &ops,
+                           const std::vector<bool> &split) {
+  std::vector<DiffOp> expanded;
+  expanded.reserve(ops.size() + ops.size() / 4);
+  for (std::size_t i = 0; i < ops.size(); i++) {
+    if (split[i]) {
+      expanded.push_back(
+          DiffOp(DELETE, DiffOp::TEXT1, ops[i].offset, ops[i].length));
+      expanded.push_back(DiffOp(INSERT, DiffOp::TEXT2, 0, ops[i].length));
+    } else {
+      expanded.push_back(ops[i]);
+    }
+  }
+  ops.swap(expanded);
 }
 
-bool Diff::operator!=(const Diff &d) const { return !(operator==(d)); }
-
-/////////////////////////////////////////////
-//
-// Patch Class
-//
-/////////////////////////////////////////////
-
-namespace {
+// Drops the operations flagged in 'erased'.
+void EraseFlagged(std::vector<DiffOp> &ops, const std::vector<bool> &erased) {
+  std::size_t kept = 0;
+  for (std::size_t i = 0; i < ops.size(); i++) {
+    if (!erased[i]) {
+      ops[kept++] = ops[i];
+    }
+  }
+  ops.resize(kept);
+}
 
 int64_t AsInt64(const std::wstring &str) {
   int64_t res;
@@ -209,6 +1350,771 @@ std::wstring URLEncode(const std::wstring &text, const std::wstring &exclude) {
   return unicode_encoder.from_bytes(res.str());
 }
 
+// Longest sequence of pairs increasing in both members, by patience sorting.
+// The pairs are given in increasing order of their first member, and the
+// indices of those in the sequence are returned in order.
+std::vector<std::size_t> PatienceChain(
+    const std::vector<std::pair<std::size_t, std::size_t> > &pairs) {
+  // piles[k] is the pair ending the best sequence of size k + 1 found so far,
+  // and previous links each one to the pair before it in that sequence.
+  std::vector<std::size_t> piles;
+  std::vector<std::size_t> previous(pairs.size());
+  for (std::size_t u = 0; u < pairs.size(); u++) {
+    std::size_t low = 0, high = piles.size();
+    while (low < high) {
+      const std::size_t mid = (low + high) / 2;
+      if (pairs[piles[mid]].second < pairs[u].second) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    previous[u] = low == 0 ? std::wstring::npos : piles[low - 1];
+    if (low == piles.size()) {
+      piles.push_back(u);
+    } else {
+      piles[low] = u;
+    }
+  }
+  std::vector<std::size_t> chain;
+  for (std::size_t u = piles.empty() ? std::wstring::npos : piles.back();
+       u != std::wstring::npos; u = previous[u]) {
+    chain.push_back(u);
+  }
+  std::reverse(chain.begin(), chain.end());
+  return chain;
+}
+
+// Common run of text1 and text2 which histogram diff splits around: the one
+// whose rarest character occurs the fewest times in text1, the longest one
+// for equally rare ones, and the one nearest the middle of text2 for equally
+// long ones.  Returns its size, 0 if there is none, and sets best1 and best2
+// to its start in each text.  The tables are freed on return, before the
+// diff recurses on the parts.
+template <class Char>
+std::size_t HistogramAnchor(const Char *text1, std::size_t text1_size,
+                            const Char *text2, std::size_t text2_size,
+                            std::size_t &best1, std::size_t &best2) {
+  // Characters occurring more often than this in text1 are not anchors.
+  const std::size_t max_chain = 64;
+
+  // Chain the occurrences of each character of text1, last one first.
+  struct Chain {
+    std::size_t count;
+    std::size_t last;
+  };
+  std::unordered_map<Char, Chain> chains;
+  std::vector<std::size_t> previous(text1_size);
+  for (std::size_t i = 0; i < text1_size; i++) {
+    Chain &chain = chains.emplace(text1[i], Chain{0, std::wstring::npos})
+                       .first->second;
+    chain.count++;
+    previous[i] = chain.last;
+    chain.last = i;
+  }
+  // Number of occurrences in text1 of each of its characters.
+  std::vector<uint32_t> counts(text1_size);
+  for (std::size_t i = 0; i < text1_size; i++) {
+    counts[i] = static_cast<uint32_t>(
+        std::min(chains.find(text1[i])->second.count, max_chain + 1));
+  }
+
+  // For each character of text2 which is rare enough, extend each of its
+  // occurrences in text1 into a common run and keep the best run.
+  std::size_t best_count = max_chain;
+  std::size_t best_size = 0;
+  std::size_t best_distance = std::wstring::npos;
+  best1 = best2 = 0;
+  for (std::size_t j = 0; j < text2_size;) {
+    const auto it = chains.find(text2[j]);
+    if (it == chains.end() || it->second.count > best_count) {
+      j++;
+      continue;
+    }
+    std::size_t next = j + 1;
+    for (std::size_t i = it->second.last; i != std::wstring::npos;
+         i = previous[i]) {
+      std::size_t count = counts[i];
+      std::size_t start1 = i, start2 = j;
+      while (start1 > 0 && start2 > 0 &&
+             text1[start1 - 1] == text2[start2 - 1]) {
+        start1--;
+        start2--;
+        count = std::min<std::size_t>(count, counts[start1]);
+      }
+      std::size_t end1 = i + 1, end2 = j + 1;
+      while (end1 < text1_size && end2 < text2_size &&
+             text1[end1] == text2[end2]) {
+        count = std::min<std::size_t>(count, counts[end1]);
+        end1++;
+        end2++;
+      }
+      // Runs starting within this one are not worth trying again.
+      next = std::max(next, end2);
+      // Of equal runs, the one nearest the middle of text2 splits the diff
+      // most evenly.  This is twice the distance of its middle from there.
+      const std::size_t distance = start2 + end2 > text2_size
+                                       ? start2 + end2 - text2_size
+                                       : text2_size - start2 - end2;
+      if (count < best_count ||
+          (count == best_count &&
+           (end1 - start1 > best_size ||
+            (end1 - start1 == best_size && distance < best_distance)))) {
+        best1 = start1;
+        best2 = start2;
+        best_size = end1 - start1;
+        best_count = count;
+        best_distance = distance;
+      }
+    }
+    j = next;
+  }
+  return best_size;
+}
+
+// Longest runs of characters an approximate diff anchors on.
+const std::size_t kAnchorWindow = 32;
+
+// Polynomial hash of each run of 'window' characters of a text, by start.
+template <class Char>
+std::vector<uint64_t> WindowHashes(const Char *text, std::size_t text_size,
+                                   std::size_t window) {
+  typedef typename std::make_unsigned<Char>::type Unit;
+  const uint64_t base = 1099511628211ull;
+  uint64_t power = 1;
+  for (std::size_t i = 0; i < window; i++) {
+    power *= base;
+  }
+  std::vector<uint64_t> hashes;
+  hashes.reserve(text_size - window + 1);
+  uint64_t hash = 0;
+  for (std::size_t i = 0; i < text_size; i++) {
+    hash = hash * base + static_cast<Unit>(text[i]) + 1;
+    if (i >= window) {
+      hash -= power * (static_cast<Unit>(text[i - window]) + 1);
+    }
+    if (i + 1 >= window) {
+      hashes.push_back(hash);
+    }
+  }
+  return hashes;
+}
+
+// Runs of 'window' characters occurring once in each text, as (start in
+// text1, start in text2), in the order of text1.  Runs are told apart by
+// their hash, so the two runs of a pair may still differ.
+template <class Char>
+std::vector<std::pair<std::size_t, std::size_t> > UniqueWindows(
+    const Char *text1, std::size_t text1_size, const Char *text2,
+    std::size_t text2_size, std::size_t window) {
+  std::vector<std::pair<std::size_t, std::size_t> > unique;
+  if (window > text1_size || window > text2_size) {
+    return unique;
+  }
+  struct Occurrences {
+    std::size_t count1, count2;
+    std::size_t last2;
+  };
+  const std::vector<uint64_t> hashes1 =
+      WindowHashes(text1, text1_size, window);
+  std::unordered_map<uint64_t, Occurrences> occurrences;
+  occurrences.reserve(hashes1.size());
+  for (const uint64_t hash : hashes1) {
+    occurrences.emplace(hash, Occurrences{0, 0, 0}).first->second.count1++;
+  }
+  {
+    const std::vector<uint64_t> hashes2 =
+        WindowHashes(text2, text2_size, window);
+    for (std::size_t j = 0; j < hashes2.size(); j++) {
+      const auto it = occurrences.find(hashes2[j]);
+      if (it != occurrences.end()) {
+        it->second.count2++;
+        it->second.last2 = j;
+      }
+    }
+  }
+  for (std::size_t i = 0; i < hashes1.size(); i++) {
+    const Occurrences &occurrence = occurrences.find(hashes1[i])->second;
+    if (occurrence.count1 == 1 && occurrence.count2 == 1) {
+      unique.push_back(std::make_pair(i, occurrence.last2));
+    }
+  }
+  return unique;
+}
+
+// Appends to ops a diff of text1[start1:end1] and text2[start2:end2] which
+// needs no deadline.  Equalities are grown from the runs of 'window'
+// characters occurring once in each part, in the same order in both; the
+// parts between them are diffed likewise with runs half as long.  Without
+// any such run, shorter runs are tried, and once none is left the parts are
+// replaced wholesale.
+template <class Char>
+void AnchorDiff(const Char *text1, std::size_t start1, std::size_t end1,
+                const Char *text2, std::size_t start2, std::size_t end2,
+                std::size_t window, std::vector<DiffOp> &ops) {
+  // Trim off common prefix and suffix.
+  const std::size_t prefix_size = CommonPrefix(
+      text1 + start1, end1 - start1, text2 + start2, end2 - start2);
+  if (prefix_size != 0) {
+    ops.push_back(DiffOp(EQUAL, DiffOp::TEXT1, start1, prefix_size));
+    start1 += prefix_size;
+    start2 += prefix_size;
+  }
+  const std::size_t suffix_size = CommonSuffix(
+      text1 + start1, end1 - start1, text2 + start2, end2 - start2);
+  end1 -= suffix_size;
+  end2 -= suffix_size;
+
+  std::vector<std::pair<std::size_t, std::size_t> > unique;
+  for (; window > 0; window /= 2) {
+    unique = UniqueWindows(text1 + start1, end1 - start1, text2 + start2,
+                           end2 - start2, window);
+    if (!unique.empty()) {
+      break;
+    }
+  }
+  if (!unique.empty()) {
+    std::size_t x = start1, y = start2;
+    for (const std::size_t u : PatienceChain(unique)) {
+      const std::size_t i = start1 + unique[u].first;
+      const std::size_t j = start2 + unique[u].second;
+      if (i < x || j < y || !SpanEquals(text1 + i, text2 + j, window)) {
+        // Within the last equality, or a hash collision.
+        continue;
+      }
+      // Grow the run into an equality as long as the texts agree.
+      std::size_t equal_start1 = i, equal_start2 = j;
+      while (equal_start1 > x && equal_start2 > y &&
+             text1[equal_start1 - 1] == text2[equal_start2 - 1]) {
+        equal_start1--;
+        equal_start2--;
+      }
+      const std::size_t equal_end1 =
+          i + window + CommonPrefix(text1 + i + window, end1 - i - window,
+                                    text2 + j + window, end2 - j - window);
+      AnchorDiff(text1, x, equal_start1, text2, y, equal_start2, window / 2,
+                 ops);
+      ops.push_back(DiffOp(EQUAL, DiffOp::TEXT1, equal_start1,
+                           equal_end1 - equal_start1));
+      y = equal_start2 + (equal_end1 - equal_start1);
+      x = equal_end1;
+    }
+    AnchorDiff(text1, x, end1, text2, y, end2, window / 2, ops);
+  } else {
+    if (end1 != start1) {
+      ops.push_back(DiffOp(DELETE, DiffOp::TEXT1, start1, end1 - start1));
+    }
+    if (end2 != start2) {
+      ops.push_back(DiffOp(INSERT, DiffOp::TEXT2, start2, end2 - start2));
+    }
+  }
+
+  if (suffix_size != 0) {
+    ops.push_back(DiffOp(EQUAL, DiffOp::TEXT1, end1, suffix_size));
+  }
+}
+
+// Bit-parallel kernels.  Each character of a pattern is one bit of a vector
+// of 64-bit words, so that a step over one character of the other text
+// updates a whole column of the dynamic programming matrix, 64 cells per
+// word operation.
+
+// Positions of each character in a pattern, as bit vectors.  Lookups are
+// on the hot path of every bit-parallel scan, so they are kept flat: ASCII
+// and Latin-1 characters index a table of masks directly, and the other
+// characters of the pattern, which are few, go in an open addressing table
+// at most half full.  A character which is not in the pattern finds an
+// empty mask, and is not added.
+template <class Char>
+class PatternMasks {
+ public:
+  PatternMasks(const Char *pattern, std::size_t size)
+      : words_((size + 63) / 64), latin1_(256 * words_, 0), shift_(32) {
+    std::vector<uint32_t> others;
+    for (std::size_t i = 0; i < size; i++) {
+      if (Code(pattern[i]) >= 256) {
+        others.push_back(Code(pattern[i]));
+      }
+    }
+    std::sort(others.begin(), others.end());
+    others.erase(std::unique(others.begin(), others.end()), others.end());
+    if (!others.empty()) {
+      std::size_t capacity = 2;
+      for (shift_ = 31; capacity < 2 * others.size(); shift_--) {
+        capacity *= 2;
+      }
+      codes_.resize(capacity, 0);
+      // The mask of slot i is at (i + 1) * words_; the first one is empty.
+      masks_.resize((capacity + 1) * words_, 0);
+      for (const uint32_t code : others) {
+        std::size_t slot = Hash(code);
+        while (codes_[slot] != 0) {
+          slot = (slot + 1) & (capacity - 1);
+        }
+        codes_[slot] = code;
+      }
+    } else {
+      masks_.resize(words_, 0);
+    }
+    for (std::size_t i = 0; i < size; i++) {
+      const uint64_t bit = uint64_t(1) << (i % 64);
+      const_cast<uint64_t *>(Find(pattern[i]))[i / 64] |= bit;
+    }
+  }
+
+  std::size_t words() const { return words_; }
+
+  // Bits set at the positions holding c.
+  const uint64_t *Find(Char c) const {
+    const uint32_t code = Code(c);
+    if (code < 256) {
+      return &latin1_[code * words_];
+    }
+    if (!codes_.empty()) {
+      const std::size_t last = codes_.size() - 1;
+      for (std::size_t slot = Hash(code); codes_[slot] != 0;
+           slot = (slot + 1) & last) {
+        if (codes_[slot] == code) {
+          return &masks_[(slot + 1) * words_];
+        }
+      }
+    }
+    return &masks_[0];
+  }
+
+ private:
+  // Code point of a character; bytes of UTF-8 text count from 0 to 255.
+  static uint32_t Code(Char c) {
+    return static_cast<uint32_t>(
+        static_cast<typename std::make_unsigned<Char>::type>(c));
+  }
+
+  // Fibonacci hashing: the top bits of the code times 2^32 / phi.
+  std::size_t Hash(uint32_t code) const {
+    return (code * 2654435769u) >> shift_;
+  }
+
+  std::size_t words_;
+  // Masks of the characters below 256, 'words_' words each.
+  std::vector<uint64_t> latin1_;
+  // Other characters of the pattern by slot, 0 for a free slot.
+  std::vector<uint32_t> codes_;
+  int shift_;
+  // The empty mask, then the masks of the slots of codes_.
+  std::vector<uint64_t> masks_;
+};
+
+// Largest number of words of bit vectors BitParallelDiff may keep: 8 MB.
+const std::size_t kBitParallelMaxWords = std::size_t(1) << 20;
+
+// Minimal diff of two texts from their longest common subsequence (Hyyrö,
+// "Bit-Parallel LCS-length Computation Revisited", 2004).  Bit i of the
+// vector after j characters of text2 is clear where the LCS of text1[0, i]
+// and text2[0, j) is one longer than that of text1[0, i) and text2[0, j).
+// All the vectors are kept, (size2 + 1) * ceil(size1 / 64) words, to trace
+// the subsequence back from the end.
+template <class Char>
+void BitParallelDiff(const Char *text1, std::size_t size1, const Char *text2,
+                     std::size_t size2, std::vector<DiffOp> &ops) {
+  const PatternMasks<Char> masks(text1, size1);
+  const std::size_t words = masks.words();
+  std::vector<uint64_t> rows((size2 + 1) * words, ~uint64_t(0));
+  if (words == 1) {
+    uint64_t v = ~uint64_t(0);
+    for (std::size_t j = 0; j < size2; j++) {
+      const uint64_t u = v & *masks.Find(text2[j]);
+      v = (v + u) | (v & ~u);
+      rows[j + 1] = v;
+    }
+  } else {
+    for (std::size_t j = 0; j < size2; j++) {
+      const uint64_t *eq = masks.Find(text2[j]);
+      const uint64_t *v = &rows[j * words];
+      uint64_t *next = &rows[(j + 1) * words];
+      // The addition carries from each word into the next.
+      uint64_t carry = 0;
+      for (std::size_t w = 0; w < words; w++) {
+        const uint64_t u = v[w] & eq[w];
+        const uint64_t x = v[w] + carry;
+        carry = x < carry;
+        const uint64_t sum = x + u;
+        carry |= sum < u;
+        next[w] = sum | (v[w] & ~u);
+      }
+    }
+  }
+
+  // Walk back from the end, matching equal characters, which is always
+  // optimal, else deleting from text1 where that keeps the LCS length.
+  std::vector<DiffOp> reversed;
+  auto add = [&reversed](Operation op, DiffOp::Source source,
+                         std::size_t offset) {
+    if (!reversed.empty() && reversed.back().operation == op) {
+      reversed.back().offset = offset;
+      reversed.back().length++;
+    } else {
+      reversed.push_back(DiffOp(op, source, offset, 1));
+    }
+  };
+  std::size_t i = size1, j = size2;
+  while (i != 0 && j != 0) {
+    if (text1[i - 1] == text2[j - 1]) {
+      i--;
+      j--;
+      add(EQUAL, DiffOp::TEXT1, i);
+    } else if ((rows[j * words + (i - 1) / 64] >> ((i - 1) % 64)) & 1) {
+      i--;
+      add(DELETE, DiffOp::TEXT1, i);
+    } else {
+      j--;
+      add(INSERT, DiffOp::TEXT2, j);
+    }
+  }
+  if (i != 0) {
+    add(DELETE, DiffOp::TEXT1, 0);
+    reversed.back().length += i - 1;
+  }
+  if (j != 0) {
+    add(INSERT, DiffOp::TEXT2, 0);
+    reversed.back().length += j - 1;
+  }
+  ops.insert(ops.end(), reversed.rbegin(), reversed.rend());
+}
+
+// One step of Myers' edit distance algorithm ("A Fast Bit-Vector Algorithm
+// for Approximate String Matching Based on Dynamic Programming", 1999) over
+// a block of 64 rows of a column.  vp and vn hold the rows whose vertical
+// delta is +1 and -1; h is the horizontal delta entering the bottom row of
+// the block.  Returns the horizontal delta leaving its row 'top'.
+inline int MyersStep(uint64_t eq, uint64_t &vp, uint64_t &vn, int h,
+                     uint64_t top) {
+  const uint64_t xv = eq | vn;
+  if (h < 0) {
+    eq |= 1;
+  }
+  const uint64_t xh = (((eq & vp) + vp) ^ vp) | eq;
+  uint64_t hp = vn | ~(xh | vp);
+  uint64_t hn = vp & xh;
+  const int h_out = (hp & top) != 0 ? 1 : (hn & top) != 0 ? -1 : 0;
+  hp <<= 1;
+  hn <<= 1;
+  if (h < 0) {
+    hn |= 1;
+  } else if (h > 0) {
+    hp |= 1;
+  }
+  vp = hn | ~(xv | hp);
+  vn = hp & xv;
+  return h_out;
+}
+
+// Levenshtein distance between a pattern and a text, in
+// O(pattern_size * text_size / 64) time and O(pattern_size / 64) space.
+// The top row of the matrix goes up by one at each column, which enters
+// every step as a horizontal delta of +1.
+template <class Char>
+std::size_t BitParallelLevenshtein(const Char *pattern,
+                                   std::size_t pattern_size, const Char *text,
+                                   std::size_t text_size) {
+  if (pattern_size == 0) {
+    return text_size;
+  }
+  const PatternMasks<Char> masks(pattern, pattern_size);
+  const std::size_t words = masks.words();
+  const uint64_t last = uint64_t(1) << ((pattern_size - 1) % 64);
+  std::size_t distance = pattern_size;
+  if (words == 1) {
+    uint64_t vp = ~uint64_t(0), vn = 0;
+    for (std::size_t j = 0; j < text_size; j++) {
+      distance += MyersStep(*masks.Find(text[j]), vp, vn, 1, last);
+    }
+    return distance;
+  }
+  std::vector<uint64_t> vp(words, ~uint64_t(0)), vn(words, 0);
+  const uint64_t high = uint64_t(1) << 63;
+  for (std::size_t j = 0; j < text_size; j++) {
+    const uint64_t *eq = masks.Find(text[j]);
+    int h = 1;
+    for (std::size_t w = 0; w < words; w++) {
+      h = MyersStep(eq[w], vp[w], vn[w], h, w + 1 == words ? last : high);
+    }
+    distance += h;
+  }
+  return distance;
+}
+
+// Steps of diff_bisect between two checks of the deadline, of the order of
+// ten microseconds.
+const int64_t kBisectStepsPerCheck = 4096;
+
+// Scratch V arrays for diff_bisect, kept per thread so that repeated diffs
+// do not allocate.  Between uses every entry is -1: a bisect only dirties the
+// diagonals it reached, so only those are cleared when it is done.
+class BisectWorkspace {
+ public:
+  // Arrays larger than this are freed after use rather than kept around.
+  static const std::size_t kMaxRetainedSize = 1 << 20;
+
+  static BisectWorkspace &ForThisThread() {
+    static thread_local BisectWorkspace workspace;
+    return workspace;
+  }
+
+  // Makes both arrays hold at least size entries.
+  void Reserve(std::size_t size) {
+    if (v1_.size() < size) {
+      v1_.resize(size, -1);
+      v2_.resize(size, -1);
+    }
+  }
+
+  int64_t *v1() { return v1_.data(); }
+  int64_t *v2() { return v2_.data(); }
+
+  // Restores the -1 entries over [begin, end) once the arrays are unused.
+  void Release(std::size_t begin, std::size_t end) {
+    if (v1_.size() > kMaxRetainedSize) {
+      std::vector<int64_t>().swap(v1_);
+      std::vector<int64_t>().swap(v2_);
+      return;
+    }
+    end = std::min(end, v1_.size());
+    if (begin < end) {
+      std::fill(v1_.begin() + begin, v1_.begin() + end, -1);
+      std::fill(v2_.begin() + begin, v2_.begin() + end, -1);
+    }
+  }
+
+ private:
+  std::vector<int64_t> v1_;
+  std::vector<int64_t> v2_;
+};
+
+// Two Bitap rows for match_bitap, the current error level and the previous
+// one, kept per thread so that repeated matches, such as the one per patch
+// of patch_apply, do not allocate.  The rows only cover the window of the
+// text within reach of the expected location.
+class BitapWorkspace {
+ public:
+  // Rows larger than this are freed after use rather than kept around.
+  static const std::size_t kMaxRetainedSize = 1 << 20;
+
+  static BitapWorkspace &ForThisThread() {
+    static thread_local BitapWorkspace workspace;
+    return workspace;
+  }
+
+  // Makes both rows hold at least size words.
+  void Reserve(std::size_t size) {
+    if (row1_.size() < size) {
+      row1_.resize(size);
+      row2_.resize(size);
+    }
+  }
+
+  uint64_t *row1() { return row1_.data(); }
+  uint64_t *row2() { return row2_.data(); }
+
+  void Release() {
+    if (row1_.size() > kMaxRetainedSize) {
+      std::vector<uint64_t>().swap(row1_);
+      std::vector<uint64_t>().swap(row2_);
+    }
+  }
+
+ private:
+  std::vector<uint64_t> row1_;
+  std::vector<uint64_t> row2_;
+};
+
+// Fork/join pool with work stealing.  Every thread taking part in a diff owns
+// a slot: it pushes and pops its own tasks at the back of its queue, while
+// idle threads steal from the front of the other queues.  A thread waiting
+// for a task runs other tasks meanwhile, so a join never idles a core that
+// has work to do.  Slot 0 belongs to the thread which started the diff.
+class TaskPool {
+ public:
+  explicit TaskPool(std::size_t threads)
+      : queues_(new Queue[threads]),
+        threads_(threads),
+        outer_slot_(current_slot_),
+        pending_(0),
+        stop_(false) {
+    current_slot_ = 0;
+    for (std::size_t slot = 1; slot < threads; slot++) {
+      workers_.push_back(std::thread(&TaskPool::Work, this, slot));
+    }
+  }
+
+  ~TaskPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+    current_slot_ = outer_slot_;
+  }
+
+  // Runs both functions, possibly in parallel, and returns once both are done.
+  // If either throws, the exception is rethrown here once the second function
+  // has finished or been taken off the queue, the first one taking precedence.
+  void Invoke(const std::function<void()> &first,
+              const std::function<void()> &second) {
+    Task task(second);
+    Push(&task);
+    std::exception_ptr error;
+    try {
+      first();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    // Run the second function here unless another thread took it.
+    if (PopBack(&task)) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+      task.Run();
+    }
+    while (!task.done.load(std::memory_order_acquire)) {
+      Task *other = Take();
+      if (other != NULL) {
+        Finish(other);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [&] {
+        return task.done.load(std::memory_order_acquire) || pending_ > 0;
+      });
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    if (task.error) {
+      std::rethrow_exception(task.error);
+    }
+  }
+
+ private:
+  struct Task {
+    explicit Task(const std::function<void()> &_function)
+        : function(_function), done(false) {}
+    // Keeps any exception for Invoke to rethrow, as the thread running the
+    // task may not be the one waiting for it.
+    void Run() {
+      try {
+        function();
+      } catch (...) {
+        error = std::current_exception();
+      }
+      done.store(true, std::memory_order_release);
+    }
+    const std::function<void()> &function;
+    std::exception_ptr error;
+    std::atomic<bool> done;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task *> tasks;
+  };
+
+  // Slot of the calling thread.
+  static thread_local std::size_t current_slot_;
+
+  void Push(Task *task) {
+    Queue &queue = queues_[current_slot_];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(task);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_++;
+    }
+    wake_.notify_one();
+  }
+
+  // Removes the task from the back of this thread's queue, if still there.
+  bool PopBack(Task *task) {
+    Queue &queue = queues_[current_slot_];
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty() || queue.tasks.back() != task) {
+        return false;
+      }
+      queue.tasks.pop_back();
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_--;
+    return true;
+  }
+
+  // Takes the newest task of this thread, or steals the oldest of another.
+  Task *Take() {
+    for (std::size_t i = 0; i < threads_; i++) {
+      Queue &queue = queues_[(current_slot_ + i) % threads_];
+      Task *task = NULL;
+      {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+          continue;
+        }
+        if (i == 0) {
+          task = queue.tasks.back();
+          queue.tasks.pop_back();
+        } else {
+          task = queue.tasks.front();
+          queue.tasks.pop_front();
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_--;
+      return task;
+    }
+    return NULL;
+  }
+
+  // Runs a task taken from a queue and wakes up whoever waits for it.
+  void Finish(Task *task) {
+    task->Run();
+    { std::lock_guard<std::mutex> lock(mutex_); }
+    wake_.notify_all();
+  }
+
+  void Work(std::size_t slot) {
+    current_slot_ = slot;
+    while (true) {
+      Task *task = Take();
+      if (task != NULL) {
+        Finish(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      wake_.wait(lock, [this] { return stop_ || pending_ > 0; });
+      if (stop_) {
+        return;
+      }
+    }
+  }
+
+  std::unique_ptr<Queue[]> queues_;
+  const std::size_t threads_;
+  // Slot of the creating thread in an enclosing pool, such as when a task
+  // of one pool diffs with a pool of its own.
+  const std::size_t outer_slot_;
+  std::vector<std::thread> workers_;
+  // Guards pending_ and stop_, and backs wake_.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::size_t pending_;  // Tasks sitting in the queues.
+  bool stop_;
+};
+
+thread_local std::size_t TaskPool::current_slot_ = 0;
+
 }  // namespace
 
 /**
@@ -246,25 +2152,121 @@ std::wstring Patch::toString() const {
   } else {
     coords2 << start2 + 1 << L',' << size2;
   }
-  std::wstringstream text;
-  text << L"@@ -" << coords1.str() << L" +" << coords2.str() << L" @@\n";
-  // Escape the body of the patch with %xx notation.
-  for (const auto &aDiff : diffs) {
-    switch (aDiff.operation) {
-      case INSERT:
-        text << L'+';
-        break;
-      case DELETE:
-        text << L'-';
-        break;
-      case EQUAL:
-        text << L' ';
-        break;
-    }
-    text << URLEncode(aDiff.text, L" !~*'();/?:@&=+$,#") + L'\n';
+  std::wstringstream text;
+  text << L"@@ -" << coords1.str() << L" +" << coords2.str() << L" @@\n";
+  // Escape the body of the patch with %xx notation.
+  for (const auto &aDiff : diffs) {
+    switch (aDiff.operation) {
+      case INSERT:
+        text << L'+';
+        break;
+      case DELETE:
+        text << L'-';
+        break;
+      case EQUAL:
+        text << L' ';
+        break;
+    }
+    text << URLEncode(aDiff.text, L" !~*'();/?:@&=+$,#") + L'\n';
+  }
+
+  return text.str();
+}
+
+/////////////////////////////////////////////
+//
+// MappedFile Class
+//
+/////////////////////////////////////////////
+
+#ifdef DIFF_MATCH_PATCH_MMAP
+
+MappedFile::MappedFile(const std::string &path) : data_(NULL), size_(0) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw "Cannot open file: " + path;
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    close(fd);
+    throw "Cannot stat file: " + path;
+  }
+  size_ = status.st_size;
+  if (size_ != 0) {
+    void *data = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      throw "Cannot map file: " + path;
+    }
+    // The diff walks both files mostly front to back.
+    madvise(data, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const char *>(data);
+  }
+  // The mapping stays valid once the descriptor is closed.
+  close(fd);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != NULL) {
+    munmap(const_cast<char *>(data_), size_);
+  }
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &path) : data_(NULL), size_(0) {
+  // No mmap on this platform, read the file instead.
+  std::ifstream file(path.c_str(), std::ios::binary);
+  if (!file) {
+    throw "Cannot open file: " + path;
+  }
+  std::stringstream contents;
+  contents << file.rdbuf();
+  contents_ = contents.str();
+  data_ = contents_.data();
+  size_ = contents_.size();
+}
+
+MappedFile::~MappedFile() {}
+
+#endif  // DIFF_MATCH_PATCH_MMAP
+
+/////////////////////////////////////////////
+//
+// DiffBatchStats Class
+//
+/////////////////////////////////////////////
+
+DiffBatchStats::DiffBatchStats()
+    : pairs(0), characters(0), timeouts(0), seconds(0) {}
+
+double DiffBatchStats::pairsPerSecond() const {
+  return seconds > 0 ? pairs / seconds : 0;
+}
+
+double DiffBatchStats::charactersPerSecond() const {
+  return seconds > 0 ? characters / seconds : 0;
+}
+
+/////////////////////////////////////////////
+//
+// MatchIndex Class
+//
+/////////////////////////////////////////////
+
+MatchIndex::MatchIndex(const std::wstring &text, std::size_t q)
+    : text_(&text), q_(q), shift_(63) {
+  if (q == 0) {
+    throw std::string("Gram length must be positive.");
+  }
+  if (text.size() > UINT32_MAX) {
+    throw std::string("Text too long to index.");
   }
+  shift_ = BucketGrams(text.data(), text.size(), q, starts_, positions_);
+}
 
-  return text.str();
+std::size_t MatchIndex::Bucket(const wchar_t *gram) const {
+  return GramBucket(gram, q_, shift_);
 }
 
 /////////////////////////////////////////////
@@ -273,15 +2275,189 @@ std::wstring Patch::toString() const {
 //
 /////////////////////////////////////////////
 
+struct diff_match_patch::DiffContext {
+  typedef std::chrono::steady_clock Clock;
+
+  // Time when the diff should be complete by, Clock::time_point::max() for
+  // none.
+  Clock::time_point deadline;
+  // Token stopping the diff from another thread, NULL for none.
+  const CancellationToken *cancellation;
+  // Threads for the independent parts of the diff, NULL to run serially.
+  TaskPool *pool;
+  // Smallest part worth handing to another thread.
+  std::size_t grain;
+  // Algorithm for the parts which cannot be trimmed or split.
+  DiffAlgorithm algorithm;
+  // Approximate the parts left when the deadline passes?
+  bool anytime;
+
+  // Takes the settings of a diff from dmp and starts its deadline.  The diff
+  // runs serially until given a pool.
+  void Start(const diff_match_patch &dmp) {
+    if (dmp.Diff_Timeout <= 0) {
+      deadline = Clock::time_point::max();
+    } else {
+      deadline = Clock::now() +
+                 std::chrono::duration_cast<Clock::duration>(
+                     std::chrono::duration<float>(dmp.Diff_Timeout));
+    }
+    cancellation = dmp.Diff_CancellationToken;
+    pool = NULL;
+    // Only start threads when the texts are large enough to be split.
+    grain = std::max<std::size_t>(dmp.Diff_ParallelGrain, 2);
+    algorithm = dmp.Diff_Algorithm;
+    anytime = dmp.Diff_Anytime;
+  }
+
+  // Has the diff been cancelled?
+  bool Cancelled() const {
+    return cancellation != NULL && cancellation->cancelled();
+  }
+
+  // Has the deadline passed or the diff been cancelled?
+  bool Expired() const {
+    return Cancelled() ||
+           (deadline != Clock::time_point::max() && Clock::now() > deadline);
+  }
+
+  // Runs both parts of a diff split in two, in parallel if worthwhile.
+  // size is the number of characters in both texts of the split diff.
+  void Fork(std::size_t size, const std::function<void()> &first,
+            const std::function<void()> &second) const {
+    if (pool != NULL && size >= grain) {
+      pool->Invoke(first, second);
+    } else {
+      first();
+      second();
+    }
+  }
+};
+
+template <class Char>
+struct diff_match_patch::LineTable {
+  // A line of one of the texts, with its hash.
+  struct Line {
+    const Char *text;
+    std::size_t size;
+    uint64_t hash;
+  };
+
+  // e.g. lines[4] is "Hello\n".
+  // "\x00" is a valid character, but various debuggers don't like it.
+  // So the zeroth line is a junk entry to avoid generating a null character.
+  std::vector<Line> lines;
+  // Open addressing table of indices into lines, 0 marking an empty slot.
+  // Its size is a power of two, at least twice the number of lines.
+  std::vector<uint32_t> slots;
+
+  LineTable() : slots(64, 0) {
+    const Line blank = {NULL, 0, 0};
+    lines.push_back(blank);
+  }
+
+  // FNV-1a over the code units of a line.
+  static uint64_t Hash(const Char *text, std::size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (std::size_t i = 0; i < size; i++) {
+      hash ^= static_cast<typename std::make_unsigned<Char>::type>(text[i]);
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  // Index of the line, added to the table if it is new.
+  char32_t Intern(const Char *text, std::size_t size) {
+    const uint64_t hash = Hash(text, size);
+    const std::size_t mask = slots.size() - 1;
+    for (std::size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+      const uint32_t index = slots[slot];
+      if (index == 0) {
+        break;
+      }
+      const Line &line = lines[index];
+      if (line.hash == hash && line.size == size &&
+          SpanEquals(line.text, text, size)) {
+        return index;
+      }
+    }
+    const Line line = {text, size, hash};
+    lines.push_back(line);
+    const uint32_t index = static_cast<uint32_t>(lines.size() - 1);
+    if (2 * lines.size() > slots.size()) {
+      // Grow, placing the lines again from their stored hashes.
+      slots.assign(2 * slots.size(), 0);
+      for (uint32_t i = 1; i <= index; i++) {
+        Place(i);
+      }
+    } else {
+      Place(index);
+    }
+    return index;
+  }
+
+  void Place(uint32_t index) {
+    const std::size_t mask = slots.size() - 1;
+    std::size_t slot = lines[index].hash & mask;
+    while (slots[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    slots[slot] = index;
+  }
+};
+
 diff_match_patch::diff_match_patch()
     : Diff_Timeout(1.0f),
+      Diff_Anytime(false),
+      Diff_CancellationToken(NULL),
       Diff_EditCost(4),
+      Diff_Algorithm(MYERS),
+      Diff_Threads(1),
+      Diff_ParallelGrain(1 << 16),
       Match_Threshold(0.5f),
       Match_Distance(1000),
       Patch_DeleteThreshold(0.5f),
       Patch_Margin(4),
+      Patch_Threads(1),
       Match_MaxBits(32) {}
 
+DiffStats diff_match_patch::diff_stats() {
+  DiffStats stats;
+#ifdef DIFF_MATCH_PATCH_STATS
+  DiffStats::Phase *const phases[PHASE_COUNT] = {
+      &stats.prefix,  &stats.halfMatch, &stats.lineHash,
+      &stats.bisect,  &stats.cleanup,   &stats.transcode};
+  for (int phase = 0; phase < PHASE_COUNT; phase++) {
+    phases[phase]->calls =
+        stats_counters.calls[phase].load(std::memory_order_relaxed);
+    phases[phase]->nanoseconds =
+        stats_counters.nanoseconds[phase].load(std::memory_order_relaxed);
+  }
+  stats.bisectDepth =
+      stats_counters.bisect_depth.load(std::memory_order_relaxed);
+  stats.bisectSteps =
+      stats_counters.bisect_steps.load(std::memory_order_relaxed);
+  stats.deadlineHits =
+      stats_counters.deadline_hits.load(std::memory_order_relaxed);
+  stats.bytesTranscoded =
+      stats_counters.bytes_transcoded.load(std::memory_order_relaxed);
+#endif
+  return stats;
+}
+
+void diff_match_patch::diff_resetStats() {
+#ifdef DIFF_MATCH_PATCH_STATS
+  for (int phase = 0; phase < PHASE_COUNT; phase++) {
+    stats_counters.calls[phase].store(0, std::memory_order_relaxed);
+    stats_counters.nanoseconds[phase].store(0, std::memory_order_relaxed);
+  }
+  stats_counters.bisect_depth.store(0, std::memory_order_relaxed);
+  stats_counters.bisect_steps.store(0, std::memory_order_relaxed);
+  stats_counters.deadline_hits.store(0, std::memory_order_relaxed);
+  stats_counters.bytes_transcoded.store(0, std::memory_order_relaxed);
+#endif
+}
+
 std::list<Diff> diff_match_patch::diff_main(const std::wstring &text1,
                                             const std::wstring &text2) {
   return diff_main(text1, text2, true);
@@ -290,204 +2466,420 @@ std::list<Diff> diff_match_patch::diff_main(const std::wstring &text1,
 std::list<Diff> diff_match_patch::diff_main(const std::wstring &text1,
                                             const std::wstring &text2,
                                             bool checklines) {
+  return diff_mainFlat(text1, text2, checklines).toList();
+}
+
+FlatDiffs diff_match_patch::diff_mainFlat(const std::wstring &text1,
+                                          const std::wstring &text2) {
+  return diff_mainFlat(text1, text2, true);
+}
+
+FlatDiffs diff_match_patch::diff_mainFlat(const std::wstring &text1,
+                                          const std::wstring &text2,
+                                          bool checklines) {
+  return diff_mainFlat(text1.data(), text1.size(), text2.data(), text2.size(),
+                       checklines);
+}
+
+Utf8Diffs diff_match_patch::diff_mainUtf8(const std::string &text1,
+                                          const std::string &text2) {
+  return diff_mainUtf8(text1, text2, true);
+}
+
+Utf8Diffs diff_match_patch::diff_mainUtf8(const std::string &text1,
+                                          const std::string &text2,
+                                          bool checklines) {
+  Utf8Diffs diffs = diff_mainFlat(text1.data(), text1.size(), text2.data(),
+                                  text2.size(), checklines);
+  diff_alignUtf8(diffs);
+  return diffs;
+}
+
+Utf8Diffs diff_match_patch::diff_mainFiles(const MappedFile &file1,
+                                           const MappedFile &file2) {
+  return diff_mainFiles(file1, file2, true);
+}
+
+Utf8Diffs diff_match_patch::diff_mainFiles(const MappedFile &file1,
+                                           const MappedFile &file2,
+                                           bool checklines) {
+  Utf8Diffs diffs = diff_mainFlat(file1.data(), file1.size(), file2.data(),
+                                  file2.size(), checklines);
+  diff_alignUtf8(diffs);
+  return diffs;
+}
+
+std::vector<FlatDiffs> diff_match_patch::diff_mainBatch(
+    const std::vector<std::pair<std::wstring, std::wstring> > &pairs) {
+  return diff_mainBatch(pairs, true, NULL);
+}
+
+std::vector<FlatDiffs> diff_match_patch::diff_mainBatch(
+    const std::vector<std::pair<std::wstring, std::wstring> > &pairs,
+    bool checklines, DiffBatchStats *stats) {
+  return diff_mainBatch<wchar_t>(
+      pairs, checklines, [](FlatDiffs & /*diffs*/) {}, stats);
+}
+
+std::vector<Utf8Diffs> diff_match_patch::diff_mainUtf8Batch(
+    const std::vector<std::pair<std::string, std::string> > &pairs) {
+  return diff_mainUtf8Batch(pairs, true, NULL);
+}
+
+std::vector<Utf8Diffs> diff_match_patch::diff_mainUtf8Batch(
+    const std::vector<std::pair<std::string, std::string> > &pairs,
+    bool checklines, DiffBatchStats *stats) {
+  return diff_mainBatch<char>(
+      pairs, checklines, [this](Utf8Diffs &diffs) { diff_alignUtf8(diffs); },
+      stats);
+}
+
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_mainFlat(const Char *text1,
+                                                     std::size_t text1_size,
+                                                     const Char *text2,
+                                                     std::size_t text2_size,
+                                                     bool checklines) {
+  DiffContext context;
   // Set a deadline by which time the diff must be complete.
-  clock_t deadline;
-  if (Diff_Timeout <= 0) {
-    deadline = std::numeric_limits<clock_t>::max();
-  } else {
-    deadline = clock() + (clock_t)(Diff_Timeout * CLOCKS_PER_SEC);
+  context.Start(*this);
+  std::unique_ptr<TaskPool> pool;
+  if (Diff_Threads > 1 && text1_size + text2_size >= context.grain) {
+    pool.reset(new TaskPool(Diff_Threads));
   }
-  return diff_main(text1, text2, checklines, deadline);
+  context.pool = pool.get();
+  return diff_main(text1, text1_size, text2, text2_size, checklines, context);
 }
 
-std::list<Diff> diff_match_patch::diff_main(const std::wstring &text1,
-                                            const std::wstring &text2,
-                                            bool checklines, clock_t deadline) {
+template <class Char>
+std::vector<BasicFlatDiffs<Char> > diff_match_patch::diff_mainBatch(
+    const std::vector<std::pair<std::basic_string<Char>,
+                                std::basic_string<Char> > > &pairs,
+    bool checklines, const std::function<void(BasicFlatDiffs<Char> &)> &finish,
+    DiffBatchStats *stats) {
+  const DiffContext::Clock::time_point start = DiffContext::Clock::now();
+  std::vector<BasicFlatDiffs<Char> > results(pairs.size());
+  std::unique_ptr<TaskPool> pool;
+  if (Diff_Threads > 1 && !pairs.empty()) {
+    pool.reset(new TaskPool(Diff_Threads));
+  }
+
+  // Each pair gets its own deadline, from when it starts.
+  const auto diff_pair = [&](std::size_t index) {
+    const auto &pair = pairs[index];
+    DiffContext context;
+    context.Start(*this);
+    context.pool = pool.get();
+    results[index] =
+        diff_main(pair.first.data(), pair.first.size(), pair.second.data(),
+                  pair.second.size(), checklines, context);
+    finish(results[index]);
+  };
+  if (pool == NULL) {
+    for (std::size_t index = 0; index < pairs.size(); index++) {
+      diff_pair(index);
+    }
+  } else if (!pairs.empty()) {
+    // Halve the range of pairs until one is left, leaving the other halves
+    // for idle threads to steal.
+    std::function<void(std::size_t, std::size_t)> diff_range =
+        [&](std::size_t begin, std::size_t end) {
+          if (end - begin == 1) {
+            diff_pair(begin);
+            return;
+          }
+          const std::size_t middle = begin + (end - begin) / 2;
+          pool->Invoke([&] { diff_range(begin, middle); },
+                       [&] { diff_range(middle, end); });
+        };
+    diff_range(0, pairs.size());
+  }
+
+  if (stats != NULL) {
+    *stats = DiffBatchStats();
+    stats->pairs = pairs.size();
+    for (std::size_t index = 0; index < pairs.size(); index++) {
+      stats->characters += pairs[index].first.size() +
+                           pairs[index].second.size();
+      stats->timeouts += results[index].approximate.empty() ? 0 : 1;
+    }
+    stats->seconds = std::chrono::duration<double>(
+                         DiffContext::Clock::now() - start)
+                         .count();
+  }
+  return results;
+}
+
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_main(
+    const Char *text1, std::size_t text1_size, const Char *text2,
+    std::size_t text2_size, bool checklines, const DiffContext &context) {
+  BasicFlatDiffs<Char> diffs(text1, text1_size, text2, text2_size);
   // Check for equality (speedup).
-  std::list<Diff> diffs;
-  if (text1 == text2) {
-    if (!text1.empty()) {
-      diffs.push_back(Diff(EQUAL, text1));
+  if (text1_size == text2_size && SpanEquals(text1, text2, text1_size)) {
+    if (text1_size != 0) {
+      diffs.ops.push_back(DiffOp(EQUAL, DiffOp::TEXT1, 0, text1_size));
     }
     return diffs;
   }
 
+  PhaseTimer trim_timer(PREFIX_PHASE);
   // Trim off common prefix (speedup).
-  std::size_t commonsize = diff_commonPrefix(text1, text2);
-  const std::wstring &commonprefix = text1.substr(0, commonsize);
-  std::wstring textChopped1 = text1.substr(commonsize);
-  std::wstring textChopped2 = text2.substr(commonsize);
+  const std::size_t prefix_size =
+      CommonPrefix(text1, text1_size, text2, text2_size);
 
   // Trim off common suffix (speedup).
-  commonsize = diff_commonSuffix(textChopped1, textChopped2);
-  const std::wstring &commonsuffix =
-      textChopped1.substr(textChopped1.size() - commonsize);
-  textChopped1 = textChopped1.substr(0, textChopped1.size() - commonsize);
-  textChopped2 = textChopped2.substr(0, textChopped2.size() - commonsize);
-
-  // Compute the diff on the middle block.
-  diffs = diff_compute(textChopped1, textChopped2, checklines, deadline);
-
-  // Restore the prefix and suffix.
-  if (!commonprefix.empty()) {
-    diffs.push_front(Diff(EQUAL, commonprefix));
+  const std::size_t suffix_size =
+      CommonSuffix(text1 + prefix_size, text1_size - prefix_size,
+                   text2 + prefix_size, text2_size - prefix_size);
+  trim_timer.Stop();
+
+  // Restore the prefix, compute the diff on the middle block and restore the
+  // suffix.
+  if (prefix_size != 0) {
+    diffs.ops.push_back(DiffOp(EQUAL, DiffOp::TEXT1, 0, prefix_size));
   }
-  if (!commonsuffix.empty()) {
-    diffs.push_back(Diff(EQUAL, commonsuffix));
+  diffs.append(diff_compute(
+      text1 + prefix_size, text1_size - prefix_size - suffix_size,
+      text2 + prefix_size, text2_size - prefix_size - suffix_size, checklines,
+      context));
+  if (suffix_size != 0) {
+    diffs.ops.push_back(DiffOp(EQUAL, DiffOp::TEXT1, text1_size - suffix_size,
+                               suffix_size));
   }
 
-  diff_cleanupMerge(diffs);
+  diff_cleanupMergeFlat(diffs);
 
   return diffs;
 }
 
-std::list<Diff> diff_match_patch::diff_compute(std::wstring text1,
-                                               std::wstring text2,
-                                               bool checklines,
-                                               clock_t deadline) {
-  std::list<Diff> diffs;
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_compute(
+    const Char *text1, std::size_t text1_size, const Char *text2,
+    std::size_t text2_size, bool checklines, const DiffContext &context) {
+  BasicFlatDiffs<Char> diffs(text1, text1_size, text2, text2_size);
 
-  if (text1.empty()) {
+  if (text1_size == 0) {
     // Just add some text (speedup).
-    diffs.push_back(Diff(INSERT, text2));
+    diffs.ops.push_back(DiffOp(INSERT, DiffOp::TEXT2, 0, text2_size));
     return diffs;
   }
 
-  if (text2.empty()) {
+  if (text2_size == 0) {
     // Just delete some text (speedup).
-    diffs.push_back(Diff(DELETE, text1));
+    diffs.ops.push_back(DiffOp(DELETE, DiffOp::TEXT1, 0, text1_size));
     return diffs;
   }
 
   {
-    const std::wstring longtext = text1.size() > text2.size() ? text1 : text2;
-    const std::wstring shorttext = text1.size() > text2.size() ? text2 : text1;
-    const std::size_t i = longtext.find(shorttext);
+    const bool text1_longer = text1_size > text2_size;
+    const Char *longtext = text1_longer ? text1 : text2;
+    const std::size_t longtext_size = text1_longer ? text1_size : text2_size;
+    const Char *shorttext = text1_longer ? text2 : text1;
+    const std::size_t shorttext_size = text1_longer ? text2_size : text1_size;
+    const std::size_t i =
+        FindSpan(longtext, longtext_size, shorttext, shorttext_size);
     if (i != std::wstring::npos) {
       // Shorter text is inside the longer text (speedup).
-      const Operation op = (text1.size() > text2.size()) ? DELETE : INSERT;
-      diffs.push_back(Diff(op, longtext.substr(0, i)));
-      diffs.push_back(Diff(EQUAL, shorttext));
-      diffs.push_back(Diff(op, safeSubStr(longtext, i + shorttext.size())));
+      const Operation op = text1_longer ? DELETE : INSERT;
+      const DiffOp::Source source =
+          text1_longer ? DiffOp::TEXT1 : DiffOp::TEXT2;
+      diffs.ops.push_back(DiffOp(op, source, 0, i));
+      diffs.ops.push_back(
+          DiffOp(EQUAL, DiffOp::TEXT1, text1_longer ? i : 0, shorttext_size));
+      diffs.ops.push_back(DiffOp(op, source, i + shorttext_size,
+                                 longtext_size - i - shorttext_size));
       return diffs;
     }
 
-    if (shorttext.size() == 1) {
+    if (shorttext_size == 1) {
       // Single character string.
       // After the previous speedup, the character can't be an equality.
-      diffs.push_back(Diff(DELETE, text1));
-      diffs.push_back(Diff(INSERT, text2));
+      diffs.ops.push_back(DiffOp(DELETE, DiffOp::TEXT1, 0, text1_size));
+      diffs.ops.push_back(DiffOp(INSERT, DiffOp::TEXT2, 0, text2_size));
       return diffs;
     }
-    // Garbage collect longtext and shorttext by scoping out.
   }
 
   // Check to see if the problem can be split in two.
-  const std::vector<std::wstring> hm = diff_halfMatch(text1, text2);
-  if (hm.size() > 0) {
-    // A half-match was found, sort out the return data.
-    const std::wstring text1_a = hm[0];
-    const std::wstring text1_b = hm[1];
-    const std::wstring text2_a = hm[2];
-    const std::wstring text2_b = hm[3];
-    const std::wstring mid_common = hm[4];
-    // Send both pairs off for separate processing.
-    std::list<Diff> diffs_a = diff_main(text1_a, text2_a, checklines, deadline);
-    std::list<Diff> diffs_b = diff_main(text1_b, text2_b, checklines, deadline);
+  HalfMatch hm;
+  PhaseTimer half_match_timer(HALF_MATCH_PHASE);
+  const bool half_match =
+      diff_halfMatch(text1, text1_size, text2, text2_size, hm);
+  half_match_timer.Stop();
+  if (half_match) {
+    // A half-match was found, send both pairs off for separate processing.
+    const std::size_t end1 = hm.start1 + hm.size;
+    const std::size_t end2 = hm.start2 + hm.size;
+    BasicFlatDiffs<Char> diffs_a, diffs_b;
+    context.Fork(
+        text1_size + text2_size,
+        [&] {
+          diffs_a = diff_main(text1, hm.start1, text2, hm.start2, checklines,
+                              context);
+        },
+        [&] {
+          diffs_b = diff_main(text1 + end1, text1_size - end1, text2 + end2,
+                              text2_size - end2, checklines, context);
+        });
     // Merge the results.
-    diffs.splice(diffs.end(), diffs_a);
-    diffs.push_back(Diff(EQUAL, mid_common));
-    diffs.splice(diffs.end(), diffs_b);
+    diffs.append(diffs_a);
+    diffs.ops.push_back(DiffOp(EQUAL, DiffOp::TEXT1, hm.start1, hm.size));
+    diffs.append(diffs_b);
     return diffs;
   }
 
   // Perform a real diff.
-  if (checklines && text1.size() > 100 && text2.size() > 100) {
-    return diff_lineMode(text1, text2, deadline);
+  if (checklines && text1_size > 100 && text2_size > 100) {
+    return diff_lineMode(text1, text1_size, text2, text2_size, context);
   }
 
-  return diff_bisect(text1, text2, deadline);
+  switch (context.algorithm) {
+    case PATIENCE:
+      return diff_patience(text1, text1_size, text2, text2_size, context);
+    case HISTOGRAM:
+      return diff_histogram(text1, text1_size, text2, text2_size, context);
+    case BIT_PARALLEL:
+      return diff_bitParallel(text1, text1_size, text2, text2_size, context);
+    default:
+      return diff_bisect(text1, text1_size, text2, text2_size, context);
+  }
 }
 
-std::list<Diff> diff_match_patch::diff_lineMode(std::wstring text1,
-                                                std::wstring text2,
-                                                clock_t deadline) {
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_lineMode(
+    const Char *text1, std::size_t text1_size, const Char *text2,
+    std::size_t text2_size, const DiffContext &context) {
   // Scan the text on a line-by-line basis first.
-  const auto &b = diff_linesToChars(text1, text2);
-  text1 = std::get<0>(b);
-  text2 = std::get<1>(b);
-  const auto &line_array = std::get<2>(b);
+  std::vector<std::size_t> line_starts1, line_starts2;
+  std::u32string chars1, chars2;
+  {
+    PhaseTimer timer(LINE_HASH_PHASE);
+    LineTable<Char> line_table;
+    chars1 = diff_linesToCharsMunge(text1, text1_size, line_table,
+                                    line_starts1);
+    chars2 = diff_linesToCharsMunge(text2, text2_size, line_table,
+                                    line_starts2);
+  }
 
-  std::list<Diff> diffs = diff_main(text1, text2, false, deadline);
+  const BasicFlatDiffs<char32_t> line_diffs =
+      diff_main(chars1.data(), chars1.size(), chars2.data(), chars2.size(),
+                false, context);
 
   // Convert the diff back to original text.
-  diff_charsToLines(diffs, line_array);
+  BasicFlatDiffs<Char> diffs(text1, text1_size, text2, text2_size);
+  diffs.ops.reserve(line_diffs.ops.size());
+  for (const auto &op : line_diffs.ops) {
+    const std::vector<std::size_t> &line_starts =
+        op.source == DiffOp::TEXT1 ? line_starts1 : line_starts2;
+    const std::size_t start = line_starts[op.offset];
+    diffs.ops.push_back(DiffOp(op.operation, op.source, start,
+                               line_starts[op.offset + op.length] - start));
+  }
   // Eliminate freak matches (e.g. blank lines)
-  diff_cleanupSemantic(diffs);
+  diff_cleanupSemanticFlat(diffs);
 
   // Rediff any replacement blocks, this time character-by-character.
-  // Add a dummy entry at the end.
-  diffs.push_back(Diff(EQUAL, L""));
+  // The edits between two equalities are contiguous in each text.
+  BasicFlatDiffs<Char> rediffed(text1, text1_size, text2, text2_size);
+  rediffed.ops.reserve(diffs.ops.size());
   std::size_t count_delete = 0;
   std::size_t count_insert = 0;
-  std::wstring text_delete = L"";
-  std::wstring text_insert = L"";
-
-  for (auto thisDiff = diffs.begin(); thisDiff != diffs.end();) {
-    switch (thisDiff->operation) {
-      case INSERT:
-        count_insert++;
-        text_insert += thisDiff->text;
-        ++thisDiff;
-        break;
-      case DELETE:
-        count_delete++;
-        text_delete += thisDiff->text;
-        ++thisDiff;
-        break;
-      case EQUAL:
-        // Upon reaching an equality, check for prior redundancies.
-        if (count_delete >= 1 && count_insert >= 1) {
-          // Delete the offending records and add the merged ones.
-          auto it = thisDiff;
-          for (std::size_t j = 0; j < count_delete + count_insert; j++) {
-            --it;
-            it = diffs.erase(it);
-          }
-          auto new_diffs = diff_main(text_delete, text_insert, false, deadline);
-          for (const auto &new_diff : new_diffs) {
-            diffs.insert(it, new_diff);
-          }
-        } else {
-          ++thisDiff;
+  std::size_t delete_start = 0, delete_size = 0;
+  std::size_t insert_start = 0, insert_size = 0;
+  std::size_t edits_start = 0;
+  for (std::size_t pointer = 0; pointer <= diffs.ops.size(); pointer++) {
+    if (pointer < diffs.ops.size() && diffs.ops[pointer].operation != EQUAL) {
+      const DiffOp &op = diffs.ops[pointer];
+      if (op.operation == INSERT) {
+        if (count_insert++ == 0) {
+          insert_start = op.offset;
         }
-        count_insert = 0;
-        count_delete = 0;
-        text_delete = L"";
-        text_insert = L"";
-        break;
+        insert_size += op.length;
+      } else {
+        if (count_delete++ == 0) {
+          delete_start = op.offset;
+        }
+        delete_size += op.length;
+      }
+      continue;
+    }
+    // Upon reaching an equality (or the end), check for prior redundancies.
+    if (count_delete >= 1 && count_insert >= 1) {
+      rediffed.append(diff_main(text1 + delete_start, delete_size,
+                                text2 + insert_start, insert_size, false,
+                                context));
+    } else {
+      rediffed.ops.insert(rediffed.ops.end(), diffs.ops.begin() + edits_start,
+                          diffs.ops.begin() + pointer);
+    }
+    if (pointer < diffs.ops.size()) {
+      rediffed.ops.push_back(diffs.ops[pointer]);
     }
+    count_insert = 0;
+    count_delete = 0;
+    delete_size = 0;
+    insert_size = 0;
+    edits_start = pointer + 1;
+  }
+  for (const auto &region : line_diffs.approximate) {
+    const std::size_t start1 = line_starts1[region.start1];
+    const std::size_t start2 = line_starts2[region.start2];
+    rediffed.markApproximate(DiffRegion(
+        start1, line_starts1[region.start1 + region.size1] - start1, start2,
+        line_starts2[region.start2 + region.size2] - start2));
   }
-  diffs.pop_back();  // Remove the dummy entry at the end.
 
-  return diffs;
+  return rediffed;
 }
 
 std::list<Diff> diff_match_patch::diff_bisect(const std::wstring &text1,
                                               const std::wstring &text2,
                                               clock_t deadline) {
-  // Cache the text sizes to prevent multiple calls.
-  const int64_t text1_size = text1.size();
-  const int64_t text2_size = text2.size();
+  DiffContext context;
+  // Convert the processor time deadline to the same distance in wall-clock
+  // time.
+  if (deadline == std::numeric_limits<clock_t>::max()) {
+    context.deadline = DiffContext::Clock::time_point::max();
+  } else {
+    context.deadline =
+        DiffContext::Clock::now() +
+        std::chrono::duration_cast<DiffContext::Clock::duration>(
+            std::chrono::duration<double>(double(deadline) - double(clock())) /
+            CLOCKS_PER_SEC);
+  }
+  context.cancellation = NULL;
+  context.pool = NULL;
+  context.grain = 0;
+  context.algorithm = MYERS;
+  context.anytime = false;
+  return diff_bisect(text1.data(), text1.size(), text2.data(), text2.size(),
+                     context)
+      .toList();
+}
+
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_bisect(
+    const Char *text1, std::size_t size1, const Char *text2,
+    std::size_t size2, const DiffContext &context) {
+  PhaseTimer timer(BISECT_PHASE);
+  // Signed copies of the sizes, as the diagonals below go negative.
+  const int64_t text1_size = size1;
+  const int64_t text2_size = size2;
   const int64_t max_d = (text1_size + text2_size + 1) / 2;
   const int64_t v_offset = max_d;
   const int64_t v_size = 2 * max_d;
-  std::unique_ptr<int64_t[]> v1(new int64_t[v_size]);
-  std::unique_ptr<int64_t[]> v2(new int64_t[v_size]);
-  for (std::size_t x = 0; x < v_size; x++) {
-    v1[x] = -1;
-    v2[x] = -1;
-  }
+  BisectWorkspace &workspace = BisectWorkspace::ForThisThread();
+  workspace.Reserve(v_size + 2);
+  int64_t *v1 = workspace.v1();
+  int64_t *v2 = workspace.v2();
+  // Diagonals are only written within d of v_offset, and read one further.
+  int64_t d = 0;
+  auto release = [&] {
+    workspace.Release(v_offset - d, v_offset + d + 2);
+    CountBisect(d);
+    timer.Stop();
+  };
   v1[v_offset + 1] = 0;
   v2[v_offset + 1] = 0;
   const int64_t delta = text1_size - text2_size;
@@ -500,10 +2892,17 @@ std::list<Diff> diff_match_patch::diff_bisect(const std::wstring &text1,
   int64_t k1end = 0;
   int64_t k2start = 0;
   int64_t k2end = 0;
-  for (int64_t d = 0; d < max_d; d++) {
+  // Steps of the k loops since the deadline was last checked.  Reading the
+  // clock is only worth it once enough work has been done since.
+  int64_t unchecked = 0;
+  for (; d < max_d; d++) {
     // Bail out if deadline is reached.
-    if (clock() > deadline) {
-      break;
+    unchecked += d + 1;
+    if (d == 0 || unchecked >= kBisectStepsPerCheck) {
+      unchecked = 0;
+      if (context.Expired()) {
+        break;
+      }
     }
 
     // Walk the front path one step.
@@ -516,10 +2915,10 @@ std::list<Diff> diff_match_patch::diff_bisect(const std::wstring &text1,
         x1 = v1[k1_offset - 1] + 1;
       }
       int64_t y1 = x1 - k1;
-      while (x1 < text1_size && y1 < text2_size && text1[x1] == text2[y1]) {
-        x1++;
-        y1++;
-      }
+      const int64_t snake1 =
+          ForwardSnake(text1, text1_size, text2, text2_size, x1, y1);
+      x1 += snake1;
+      y1 += snake1;
       v1[k1_offset] = x1;
       if (x1 > text1_size) {
         // Ran off the right of the graph.
@@ -534,7 +2933,9 @@ std::list<Diff> diff_match_patch::diff_bisect(const std::wstring &text1,
           int64_t x2 = text1_size - v2[k2_offset];
           if (x1 >= x2) {
             // Overlap detected.
-            return diff_bisectSplit(text1, text2, x1, y1, deadline);
+            release();
+            return diff_bisectSplit(text1, size1, text2, size2, x1, y1,
+                                    context);
           }
         }
       }
@@ -550,11 +2951,10 @@ std::list<Diff> diff_match_patch::diff_bisect(const std::wstring &text1,
         x2 = v2[k2_offset - 1] + 1;
       }
       int64_t y2 = x2 - k2;
-      while (x2 < text1_size && y2 < text2_size &&
-             text1[text1_size - x2 - 1] == text2[text2_size - y2 - 1]) {
-        x2++;
-        y2++;
-      }
+      const int64_t snake2 =
+          ReverseSnake(text1, text1_size, text2, text2_size, x2, y2);
+      x2 += snake2;
+      y2 += snake2;
       v2[k2_offset] = x2;
       if (x2 > text1_size) {
         // Ran off the left of the graph.
@@ -571,240 +2971,411 @@ std::list<Diff> diff_match_patch::diff_bisect(const std::wstring &text1,
           x2 = text1_size - x2;
           if (x1 >= x2) {
             // Overlap detected.
-            return diff_bisectSplit(text1, text2, x1, y1, deadline);
+            release();
+            return diff_bisectSplit(text1, size1, text2, size2, x1, y1,
+                                    context);
           }
         }
       }
     }
   }
-  // Diff took too long and hit the deadline or
+  release();
+  const bool expired = d < max_d;
+  if (expired) {
+    CountDeadlineHit();
+  }
+  if (expired && context.anytime && !context.Cancelled()) {
+    return diff_approximate(text1, size1, text2, size2);
+  }
+  // Diff took too long and hit the deadline, was cancelled, or
   // number of diffs equals number of characters, no commonality at all.
-  std::list<Diff> diffs;
-  diffs.push_back(Diff(DELETE, text1));
-  diffs.push_back(Diff(INSERT, text2));
+  BasicFlatDiffs<Char> diffs(text1, size1, text2, size2);
+  diffs.ops.push_back(DiffOp(DELETE, DiffOp::TEXT1, 0, size1));
+  diffs.ops.push_back(DiffOp(INSERT, DiffOp::TEXT2, 0, size2));
+  if (expired) {
+    diffs.markApproximate(DiffRegion(0, size1, 0, size2));
+  }
   return diffs;
 }
 
-std::list<Diff> diff_match_patch::diff_bisectSplit(const std::wstring &text1,
-                                                   const std::wstring &text2,
-                                                   std::size_t x, std::size_t y,
-                                                   clock_t deadline) {
-  std::wstring text1a = text1.substr(0, x);
-  std::wstring text2a = text2.substr(0, y);
-  std::wstring text1b = safeSubStr(text1, x);
-  std::wstring text2b = safeSubStr(text2, y);
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_approximate(
+    const Char *text1, std::size_t text1_size, const Char *text2,
+    std::size_t text2_size) const {
+  BasicFlatDiffs<Char> diffs(text1, text1_size, text2, text2_size);
+  diffs.markApproximate(DiffRegion(0, text1_size, 0, text2_size));
+
+  // Split the texts into lines, unless they already are.
+  std::vector<std::size_t> line_starts1, line_starts2;
+  std::u32string chars1, chars2;
+  if (!std::is_same<Char, char32_t>::value) {
+    LineTable<Char> line_table;
+    chars1 = diff_linesToCharsMunge(text1, text1_size, line_table,
+                                    line_starts1);
+    chars2 = diff_linesToCharsMunge(text2, text2_size, line_table,
+                                    line_starts2);
+  }
+  if (chars1.size() < 2 && chars2.size() < 2) {
+    AnchorDiff(text1, 0, text1_size, text2, 0, text2_size, kAnchorWindow,
+               diffs.ops);
+    return diffs;
+  }
 
-  // Compute both diffs serially.
-  std::list<Diff> diffs = diff_main(text1a, text2a, false, deadline);
-  std::list<Diff> diffsb = diff_main(text1b, text2b, false, deadline);
-  diffs.splice(diffs.end(), diffsb);
+  // Keep the lines unique in both texts, then align the characters of the
+  // edits between the equal lines.
+  std::vector<DiffOp> line_ops;
+  AnchorDiff(chars1.data(), 0, chars1.size(), chars2.data(), 0, chars2.size(),
+             1, line_ops);
+  std::size_t line1 = 0, line2 = 0;
+  std::size_t delete_lines = 0, insert_lines = 0;
+  // Visit a dummy entry at the end.
+  for (std::size_t pointer = 0; pointer <= line_ops.size(); pointer++) {
+    if (pointer < line_ops.size() && line_ops[pointer].operation != EQUAL) {
+      if (line_ops[pointer].operation == DELETE) {
+        delete_lines += line_ops[pointer].length;
+      } else {
+        insert_lines += line_ops[pointer].length;
+      }
+      continue;
+    }
+    AnchorDiff(text1, line_starts1[line1],
+               line_starts1[line1 + delete_lines], text2,
+               line_starts2[line2], line_starts2[line2 + insert_lines],
+               kAnchorWindow, diffs.ops);
+    line1 += delete_lines;
+    line2 += insert_lines;
+    delete_lines = 0;
+    insert_lines = 0;
+    if (pointer < line_ops.size()) {
+      const std::size_t length = line_ops[pointer].length;
+      diffs.ops.push_back(
+          DiffOp(EQUAL, DiffOp::TEXT1, line_starts1[line1],
+                 line_starts1[line1 + length] - line_starts1[line1]));
+      line1 += length;
+      line2 += length;
+    }
+  }
   return diffs;
 }
 
-std::tuple<std::wstring, std::wstring, std::vector<std::wstring> >
-diff_match_patch::diff_linesToChars(const std::wstring &text1,
-                                    const std::wstring &text2) const {
-  std::vector<std::wstring> line_array;
-  std::unordered_map<std::wstring, std::size_t> lineHash;
-  // e.g. line_array[4] == "Hello\n"
-  // e.g. linehash.get("Hello\n") == 4
-
-  // "\x00" is a valid character, but various debuggers don't like it.
-  // So we'll insert a junk entry to avoid generating a null character.
-  line_array.push_back(L"");
-
-  const std::wstring chars1 =
-      diff_linesToCharsMunge(text1, line_array, lineHash);
-  const std::wstring chars2 =
-      diff_linesToCharsMunge(text2, line_array, lineHash);
-
-  return std::make_tuple(chars1, chars2, line_array);
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_bisectSplit(
+    const Char *text1, std::size_t text1_size, const Char *text2,
+    std::size_t text2_size, std::size_t x, std::size_t y,
+    const DiffContext &context) {
+  // Compute both diffs, in parallel when they are large enough.
+  BasicFlatDiffs<Char> diffs_a, diffs_b;
+  context.Fork(
+      text1_size + text2_size,
+      [&] { diffs_a = diff_main(text1, x, text2, y, false, context); },
+      [&] {
+        diffs_b = diff_main(text1 + x, text1_size - x, text2 + y,
+                            text2_size - y, false, context);
+      });
+  BasicFlatDiffs<Char> diffs(text1, text1_size, text2, text2_size);
+  diffs.ops.swap(diffs_a.ops);
+  diffs.approximate.swap(diffs_a.approximate);
+  diffs.append(diffs_b);
+  return diffs;
 }
 
-std::wstring diff_match_patch::diff_linesToCharsMunge(
-    const std::wstring &text, std::vector<std::wstring> &line_array,
-    std::unordered_map<std::wstring, std::size_t> &lineHash) const {
-  std::size_t lineStart = 0;
-  bool has_line_end = false;
-  std::size_t lineEnd = std::wstring::npos;
-  std::wstring line;
-  std::wstring chars;
-
-  if (text.size() == 0) return chars;
-
-  // Walk the text, pulling out a substring for each line.
-  // text.split('\n') would would temporarily double our memory footprint.
-  // Modifying text would create many large strings to garbage collect.
-  while (!has_line_end || lineEnd < text.size() - 1) {
-    lineEnd = text.find('\n', lineStart);
-    has_line_end = true;
-    if (lineEnd == std::wstring::npos) {
-      lineEnd = text.size() - 1;
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_patience(
+    const Char *text1, std::size_t text1_size, const Char *text2,
+    std::size_t text2_size, const DiffContext &context) {
+  // Count each character in both texts, with where it was last seen.
+  struct Occurrences {
+    std::size_t count1, count2;
+    std::size_t last1, last2;
+  };
+  std::unordered_map<Char, Occurrences> occurrences;
+  for (std::size_t i = 0; i < text1_size; i++) {
+    Occurrences &occurrence = occurrences[text1[i]];
+    occurrence.count1++;
+    occurrence.last1 = i;
+  }
+  for (std::size_t j = 0; j < text2_size; j++) {
+    const auto it = occurrences.find(text2[j]);
+    if (it != occurrences.end()) {
+      it->second.count2++;
+      it->second.last2 = j;
     }
-    line = safeSubStr(text, lineStart, lineEnd + 1 - lineStart);
-    lineStart = lineEnd + 1;
+  }
 
-    if (lineHash.find(line) != lineHash.end()) {
-      chars += wchar_t(static_cast<ushort>(lineHash[line]));
-    } else {
-      line_array.push_back(line);
-      lineHash.emplace(line, line_array.size() - 1);
-      chars += wchar_t(static_cast<ushort>(line_array.size() - 1));
+  // Characters unique in both texts, as (index in text1, index in text2), in
+  // the order of text1.
+  std::vector<std::pair<std::size_t, std::size_t> > unique;
+  for (std::size_t i = 0; i < text1_size; i++) {
+    const Occurrences &occurrence = occurrences.find(text1[i])->second;
+    if (occurrence.count1 == 1 && occurrence.count2 == 1) {
+      unique.push_back(std::make_pair(i, occurrence.last2));
     }
   }
-  return chars;
-}
+  occurrences.clear();
+  if (unique.empty()) {
+    return diff_bisect(text1, text1_size, text2, text2_size, context);
+  }
 
-void diff_match_patch::diff_charsToLines(
-    std::list<Diff> &diffs, const std::vector<std::wstring> &line_array) {
-  for (auto &diff : diffs) {
-    std::wstring text;
-    for (std::size_t y = 0; y < diff.text.size(); y++) {
-      text += line_array[static_cast<ushort>(diff.text[y])];
-    }
-    diff.text = text;
+  // Longest sequence of them in the same order in both texts.
+  const std::vector<std::size_t> anchors = PatienceChain(unique);
+
+  // Diff the parts between the anchors, which are equalities.
+  BasicFlatDiffs<Char> diffs(text1, text1_size, text2, text2_size);
+  std::size_t x = 0, y = 0;
+  for (const std::size_t anchor : anchors) {
+    const std::size_t i = unique[anchor].first;
+    const std::size_t j = unique[anchor].second;
+    diffs.append(diff_main(text1 + x, i - x, text2 + y, j - y, false, context));
+    diffs.ops.push_back(DiffOp(EQUAL, DiffOp::TEXT1, i, 1));
+    x = i + 1;
+    y = j + 1;
   }
+  diffs.append(diff_main(text1 + x, text1_size - x, text2 + y, text2_size - y,
+                         false, context));
+  return diffs;
 }
 
-std::size_t diff_match_patch::diff_commonPrefix(const std::wstring &text1,
-                                                const std::wstring &text2) {
-  // Performance analysis: http://neil.fraser.name/news/2007/10/09/
-  const std::size_t n = std::min(text1.size(), text2.size());
-  for (std::size_t i = 0; i < n; i++) {
-    if (text1[i] != text2[i]) {
-      return i;
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_histogram(
+    const Char *text1, std::size_t text1_size, const Char *text2,
+    std::size_t text2_size, const DiffContext &context) {
+  // Each anchor splits the part of the texts left to diff in two.  Parts of
+  // comparable size are diffed in parallel, otherwise the smaller one is
+  // diffed right away and the larger one split again here, so that the
+  // recursion stays shallow however many anchors there are.
+  BasicFlatDiffs<Char> diffs(text1, text1_size, text2, text2_size);
+  // Diffs of the parts split off to the right, each with the anchor before
+  // it, in reverse order.
+  std::vector<BasicFlatDiffs<Char> > tails;
+  const Char *part1 = text1;
+  const Char *part2 = text2;
+  std::size_t size1 = text1_size;
+  std::size_t size2 = text2_size;
+  while (true) {
+    if (size1 == 0 || size2 == 0) {
+      diffs.append(diff_main(part1, size1, part2, size2, false, context));
+      break;
+    }
+    std::size_t best1, best2;
+    const std::size_t best_size =
+        HistogramAnchor(part1, size1, part2, size2, best1, best2);
+    if (best_size == 0) {
+      diffs.append(diff_bisect(part1, size1, part2, size2, context));
+      break;
+    }
+    const std::size_t end1 = best1 + best_size;
+    const std::size_t end2 = best2 + best_size;
+    const DiffOp equality(EQUAL, DiffOp::TEXT1, part1 - text1 + best1,
+                          best_size);
+    const std::size_t left_size = best1 + best2;
+    const std::size_t right_size = size1 - end1 + size2 - end2;
+    if (std::min(left_size, right_size) * 4 >= size1 + size2) {
+      // Send the parts on each side of the run off for separate processing.
+      BasicFlatDiffs<Char> diffs_a, diffs_b;
+      context.Fork(
+          size1 + size2,
+          [&] {
+            diffs_a = diff_main(part1, best1, part2, best2, false, context);
+          },
+          [&] {
+            diffs_b = diff_main(part1 + end1, size1 - end1, part2 + end2,
+                                size2 - end2, false, context);
+          });
+      diffs.append(diffs_a);
+      diffs.ops.push_back(equality);
+      diffs.append(diffs_b);
+      break;
+    }
+    if (left_size <= right_size) {
+      diffs.append(diff_main(part1, best1, part2, best2, false, context));
+      diffs.ops.push_back(equality);
+      part1 += end1;
+      part2 += end2;
+      size1 -= end1;
+      size2 -= end2;
+    } else {
+      tails.push_back(
+          BasicFlatDiffs<Char>(text1, text1_size, text2, text2_size));
+      tails.back().ops.push_back(equality);
+      tails.back().append(diff_main(part1 + end1, size1 - end1, part2 + end2,
+                                    size2 - end2, false, context));
+      size1 = best1;
+      size2 = best2;
     }
   }
-  return n;
+  for (auto tail = tails.rbegin(); tail != tails.rend(); ++tail) {
+    diffs.append(*tail);
+  }
+  return diffs;
 }
 
-std::size_t diff_match_patch::diff_commonSuffix(const std::wstring &text1,
-                                                const std::wstring &text2) {
-  // Performance analysis: http://neil.fraser.name/news/2007/10/09/
-  const std::size_t text1_size = text1.size();
-  const std::size_t text2_size = text2.size();
-  const std::size_t n = std::min(text1_size, text2_size);
-  for (std::size_t i = 1; i <= n; i++) {
-    if (text1[text1_size - i] != text2[text2_size - i]) {
-      return i - 1;
-    }
+template <class Char>
+BasicFlatDiffs<Char> diff_match_patch::diff_bitParallel(
+    const Char *text1, std::size_t text1_size, const Char *text2,
+    std::size_t text2_size, const DiffContext &context) {
+  if ((text1_size + 63) / 64 * (text2_size + 1) > kBitParallelMaxWords) {
+    return diff_bisect(text1, text1_size, text2, text2_size, context);
   }
-  return n;
+  BasicFlatDiffs<Char> diffs(text1, text1_size, text2, text2_size);
+  BitParallelDiff(text1, text1_size, text2, text2_size, diffs.ops);
+  return diffs;
 }
 
-std::size_t diff_match_patch::diff_commonOverlap(const std::wstring &text1,
-                                                 const std::wstring &text2) {
-  // Cache the text sizes to prevent multiple calls.
-  const std::size_t text1_size = text1.size();
-  const std::size_t text2_size = text2.size();
-  // Eliminate the null case.
-  if (text1_size == 0 || text2_size == 0) {
-    return 0;
-  }
-  // Truncate the longer string.
-  std::wstring text1_trunc = text1;
-  std::wstring text2_trunc = text2;
-  if (text1_size > text2_size) {
-    text1_trunc = text1.substr(text1.size() - text2_size);
-  } else if (text1_size < text2_size) {
-    text2_trunc = text2.substr(0, text1_size);
+std::tuple<std::wstring, std::wstring, std::vector<std::wstring> >
+diff_match_patch::diff_linesToChars(const std::wstring &text1,
+                                    const std::wstring &text2) const {
+  LineTable<wchar_t> line_table;
+  std::vector<std::size_t> line_starts;
+  const std::u32string chars1 = diff_linesToCharsMunge(
+      text1.data(), text1.size(), line_table, line_starts);
+  const std::u32string chars2 = diff_linesToCharsMunge(
+      text2.data(), text2.size(), line_table, line_starts);
+
+  std::vector<std::wstring> line_array;
+  line_array.reserve(line_table.lines.size());
+  for (const auto &line : line_table.lines) {
+    line_array.push_back(std::wstring(line.text, line.size));
   }
-  const std::size_t text_size = std::min(text1_size, text2_size);
-  // Quick check for the worst case.
-  if (text1_trunc == text2_trunc) {
-    return text_size;
+  // Where wchar_t has 16 bits, lines past the 65535th do not fit.
+  return std::make_tuple(std::wstring(chars1.begin(), chars1.end()),
+                         std::wstring(chars2.begin(), chars2.end()),
+                         line_array);
+}
+
+template <class Char>
+std::u32string diff_match_patch::diff_linesToCharsMunge(
+    const Char *text, std::size_t text_size, LineTable<Char> &line_table,
+    std::vector<std::size_t> &line_starts) const {
+  std::size_t lineStart = 0;
+  std::u32string chars;
+
+  line_starts.clear();
+  // Walk the text, interning each line where it lies.
+  while (lineStart < text_size) {
+    const Char *newline = std::find(text + lineStart, text + text_size, '\n');
+    const std::size_t lineEnd =
+        newline == text + text_size ? text_size : newline - text + 1;
+    line_starts.push_back(lineStart);
+    chars += line_table.Intern(text + lineStart, lineEnd - lineStart);
+    lineStart = lineEnd;
   }
+  line_starts.push_back(text_size);
+  return chars;
+}
 
-  // Start by looking for a single character match
-  // and increase size until no match is found.
-  // Performance analysis: http://neil.fraser.name/news/2010/11/04/
-  std::size_t best = 0;
-  std::size_t size = 1;
-  while (true) {
-    std::wstring pattern = text1_trunc.substr(text1_trunc.size() - size);
-    std::size_t found = text2_trunc.find(pattern);
-    if (found == std::wstring::npos) {
-      return best;
-    }
-    size += found;
-    if (found == 0 || text1_trunc.substr(text1_trunc.size() - size) ==
-                          text2_trunc.substr(0, size)) {
-      best = size;
-      size++;
+void diff_match_patch::diff_charsToLines(
+    std::list<Diff> &diffs, const std::vector<std::wstring> &line_array) {
+  for (auto &diff : diffs) {
+    std::wstring text;
+    for (std::size_t y = 0; y < diff.text.size(); y++) {
+      text += line_array[static_cast<std::make_unsigned<wchar_t>::type>(
+          diff.text[y])];
     }
+    diff.text = text;
   }
 }
 
+std::size_t diff_match_patch::diff_commonPrefix(const std::wstring &text1,
+                                                const std::wstring &text2) {
+  return CommonPrefix(text1.data(), text1.size(), text2.data(), text2.size());
+}
+
+std::size_t diff_match_patch::diff_commonSuffix(const std::wstring &text1,
+                                                const std::wstring &text2) {
+  return CommonSuffix(text1.data(), text1.size(), text2.data(), text2.size());
+}
+
+std::size_t diff_match_patch::diff_commonOverlap(const std::wstring &text1,
+                                                 const std::wstring &text2) {
+  return CommonOverlap(text1.data(), text1.size(), text2.data(), text2.size());
+}
+
 std::vector<std::wstring> diff_match_patch::diff_halfMatch(
     const std::wstring &text1, const std::wstring &text2) {
+  HalfMatch hm;
+  if (!diff_halfMatch(text1.data(), text1.size(), text2.data(), text2.size(),
+                      hm)) {
+    return std::vector<std::wstring>();
+  }
+  return {text1.substr(0, hm.start1), text1.substr(hm.start1 + hm.size),
+          text2.substr(0, hm.start2), text2.substr(hm.start2 + hm.size),
+          text1.substr(hm.start1, hm.size)};
+}
+
+template <class Char>
+bool diff_match_patch::diff_halfMatch(const Char *text1,
+                                      std::size_t text1_size,
+                                      const Char *text2,
+                                      std::size_t text2_size, HalfMatch &hm) {
   if (Diff_Timeout <= 0) {
     // Don't risk returning a non-optimal diff if we have unlimited time.
-    return std::vector<std::wstring>();
+    return false;
   }
-  const std::wstring longtext = text1.size() > text2.size() ? text1 : text2;
-  const std::wstring shorttext = text1.size() > text2.size() ? text2 : text1;
-  if (longtext.size() < 4 || shorttext.size() * 2 < longtext.size()) {
-    return std::vector<std::wstring>();  // Pointless.
+  const bool text1_longer = text1_size > text2_size;
+  const Char *longtext = text1_longer ? text1 : text2;
+  const std::size_t longtext_size = text1_longer ? text1_size : text2_size;
+  const Char *shorttext = text1_longer ? text2 : text1;
+  const std::size_t shorttext_size = text1_longer ? text2_size : text1_size;
+  if (longtext_size < 4 || shorttext_size * 2 < longtext_size) {
+    return false;  // Pointless.
   }
 
   // First check if the second quarter is the seed for a half-match.
-  const std::vector<std::wstring> hm1 =
-      diff_halfMatchI(longtext, shorttext, (longtext.size() + 3) / 4);
+  HalfMatch hm1;
+  const bool found1 = diff_halfMatchI(longtext, longtext_size, shorttext,
+                                      shorttext_size, (longtext_size + 3) / 4,
+                                      hm1);
   // Check again based on the third quarter.
-  const std::vector<std::wstring> hm2 =
-      diff_halfMatchI(longtext, shorttext, (longtext.size() + 1) / 2);
-  std::vector<std::wstring> hm;
-  if (hm1.empty() && hm2.empty()) {
-    return std::vector<std::wstring>();
-  } else if (hm2.empty()) {
+  HalfMatch hm2;
+  const bool found2 = diff_halfMatchI(longtext, longtext_size, shorttext,
+                                      shorttext_size, (longtext_size + 1) / 2,
+                                      hm2);
+  if (!found1 && !found2) {
+    return false;
+  } else if (!found2) {
     hm = hm1;
-  } else if (hm1.empty()) {
+  } else if (!found1) {
     hm = hm2;
   } else {
     // Both matched.  Select the longest.
-    hm = hm1[4].size() > hm2[4].size() ? hm1 : hm2;
+    hm = hm1.size > hm2.size ? hm1 : hm2;
   }
 
   // A half-match was found, sort out the return data.
-  if (text1.size() > text2.size()) {
-    return hm;
-  } else {
-    return {hm[2], hm[3], hm[0], hm[1], hm[4]};
+  if (!text1_longer) {
+    std::swap(hm.start1, hm.start2);
   }
+  return true;
 }
 
-std::vector<std::wstring> diff_match_patch::diff_halfMatchI(
-    const std::wstring &longtext, const std::wstring &shorttext,
-    std::size_t i) {
+template <class Char>
+bool diff_match_patch::diff_halfMatchI(const Char *longtext,
+                                       std::size_t longtext_size,
+                                       const Char *shorttext,
+                                       std::size_t shorttext_size,
+                                       std::size_t i, HalfMatch &hm) {
   // Start with a 1/4 size substring at position i as a seed.
-  const std::wstring seed = safeSubStr(longtext, i, longtext.size() / 4);
-  std::size_t j;
-  std::wstring best_common;
-  std::wstring best_longtext_a, best_longtext_b;
-  std::wstring best_shorttext_a, best_shorttext_b;
-  while ((j = shorttext.find(seed, j + 1)) != std::wstring::npos) {
-    const std::size_t prefixLength =
-        diff_commonPrefix(safeSubStr(longtext, i), safeSubStr(shorttext, j));
-    const std::size_t suffixLength =
-        diff_commonSuffix(longtext.substr(0, i), shorttext.substr(0, j));
-    if (best_common.size() < suffixLength + prefixLength) {
-      best_common = safeSubStr(shorttext, j - suffixLength, suffixLength) +
-                    safeSubStr(shorttext, j, prefixLength);
-      best_longtext_a = longtext.substr(0, i - suffixLength);
-      best_longtext_b = safeSubStr(longtext, i + prefixLength);
-      best_shorttext_a = shorttext.substr(0, j - suffixLength);
-      best_shorttext_b = safeSubStr(shorttext, j + prefixLength);
-    }
-  }
-  if (best_common.size() * 2 >= longtext.size()) {
-    return {best_longtext_a, best_longtext_b, best_shorttext_a,
-            best_shorttext_b, best_common};
-  } else {
-    return std::vector<std::wstring>();
+  const Char *seed = longtext + i;
+  const std::size_t seed_size = std::min(longtext_size / 4, longtext_size - i);
+  std::size_t j = std::wstring::npos;
+  std::size_t best_common = 0;
+  while ((j = FindSpan(shorttext, shorttext_size, seed, seed_size, j + 1)) !=
+         std::wstring::npos) {
+    const std::size_t prefixLength = CommonPrefix(
+        longtext + i, longtext_size - i, shorttext + j, shorttext_size - j);
+    const std::size_t suffixLength = CommonSuffix(longtext, i, shorttext, j);
+    if (best_common < suffixLength + prefixLength) {
+      best_common = suffixLength + prefixLength;
+      hm.start1 = i - suffixLength;
+      hm.start2 = j - suffixLength;
+      hm.size = best_common;
+    }
   }
+  return best_common * 2 >= longtext_size;
 }
 
 void diff_match_patch::diff_cleanupSemantic(std::list<Diff> &diffs) {
+  PhaseTimer timer(CLEANUP_PHASE);
   if (diffs.empty()) {
     return;
   }
@@ -931,7 +3502,166 @@ void diff_match_patch::diff_cleanupSemantic(std::list<Diff> &diffs) {
   }
 }
 
+void diff_match_patch::diff_cleanupSemantic(FlatDiffs &diffs) {
+  diff_cleanupSemanticFlat(diffs);
+}
+
+void diff_match_patch::diff_cleanupSemantic(Utf8Diffs &diffs) {
+  diff_cleanupSemanticFlat(diffs);
+  diff_alignUtf8(diffs);
+}
+
+template <class Char>
+void diff_match_patch::diff_cleanupSemanticFlat(BasicFlatDiffs<Char> &diffs) {
+  PhaseTimer timer(CLEANUP_PHASE);
+  if (diffs.empty()) {
+    return;
+  }
+  diffs.anchor();
+  std::vector<DiffOp> &ops = diffs.ops;
+  bool changes = false;
+  std::vector<std::size_t> equalities;  // Stack of equalities.
+  bool has_last_equality = false;
+  std::size_t last_equality = 0;  // Always equal to equalities.back().length
+  // Number of characters that changed prior to the equality.
+  std::size_t size_insertions1 = 0;
+  std::size_t size_deletions1 = 0;
+  // Number of characters that changed after the equality.
+  std::size_t size_insertions2 = 0;
+  std::size_t size_deletions2 = 0;
+  // Equalities to be replaced with a deletion and an insertion.  They are
+  // expanded once the pass is over so that indices stay valid; until then
+  // the walk visits them twice, as the deletion and then as the insertion.
+  std::vector<bool> split(ops.size(), false);
+  bool insertion_half = false;
+
+  std::size_t pointer = 0;
+  while (pointer < ops.size()) {
+    const DiffOp &thisOp = ops[pointer];
+    if (thisOp.operation == EQUAL && !split[pointer]) {
+      // Equality found.
+      equalities.push_back(pointer);
+      size_insertions1 = size_insertions2;
+      size_deletions1 = size_deletions2;
+      size_insertions2 = 0;
+      size_deletions2 = 0;
+      last_equality = thisOp.length;
+      has_last_equality = true;
+      pointer++;
+    } else {
+      // An insertion or deletion.
+      Operation operation = thisOp.operation;
+      if (split[pointer]) {
+        operation = insertion_half ? INSERT : DELETE;
+      }
+      if (operation == INSERT) {
+        size_insertions2 += thisOp.length;
+      } else {
+        size_deletions2 += thisOp.length;
+      }
+      // Eliminate an equality that is smaller or equal to the edits on both
+      // sides of it.
+      if (has_last_equality &&
+          (last_equality <= std::max(size_insertions1, size_deletions1)) &&
+          (last_equality <= std::max(size_insertions2, size_deletions2))) {
+        // Replace equality with a delete and an insert.
+        split[equalities.back()] = true;
+
+        equalities.pop_back();  // Throw away the equality we just deleted.
+        if (!equalities.empty()) {
+          // Throw away the previous equality (it needs to be reevaluated).
+          equalities.pop_back();
+        }
+        // Walk back to the start or to a safe equality we can fall back to.
+        pointer = equalities.empty() ? 0 : equalities.back();
+        insertion_half = false;
+
+        size_insertions1 = 0;  // Reset the counters.
+        size_deletions1 = 0;
+        size_insertions2 = 0;
+        size_deletions2 = 0;
+        has_last_equality = false;
+        changes = true;
+      } else if (split[pointer] && !insertion_half) {
+        insertion_half = true;
+      } else {
+        pointer++;
+        insertion_half = false;
+      }
+    }
+  }
+
+  // Normalize the diff.
+  if (changes) {
+    ExpandSplitEqualities(ops, split);
+    diffs.anchor();
+    diff_cleanupMergeFlat(diffs);
+  }
+  diff_cleanupSemanticLosslessFlat(diffs);
+
+  // Find any overlaps between deletions and insertions.
+  // e.g: <del>abcxxx</del><ins>xxxdef</ins>
+  //   -> <del>abc</del>xxx<ins>def</ins>
+  // e.g: <del>xxxabc</del><ins>defxxx</ins>
+  //   -> <ins>def</ins>xxx<del>abc</del>
+  // Only extract an overlap if it is as big as the edit ahead or behind it.
+  // Every operation is anchored, so trimming only moves offsets around.
+  std::vector<DiffOp> result;
+  result.reserve(ops.size() + ops.size() / 2);
+  pointer = 0;
+  while (pointer < ops.size()) {
+    if (pointer + 1 < ops.size() && ops[pointer].operation == DELETE &&
+        ops[pointer + 1].operation == INSERT) {
+      const DiffOp deletion = ops[pointer];
+      const DiffOp insertion = ops[pointer + 1];
+      const Char *deletion_text = diffs.data(deletion);
+      const Char *insertion_text = diffs.data(insertion);
+      std::size_t overlap_size1 =
+          CommonOverlap(deletion_text, deletion.length, insertion_text,
+                        insertion.length);
+      std::size_t overlap_size2 =
+          CommonOverlap(insertion_text, insertion.length, deletion_text,
+                        deletion.length);
+      if (overlap_size1 >= overlap_size2 &&
+          (overlap_size1 >= deletion.length / 2.0 ||
+           overlap_size1 >= insertion.length / 2.0)) {
+        // Overlap found.  Insert an equality and trim the surrounding edits.
+        result.push_back(DiffOp(DELETE, DiffOp::TEXT1, deletion.offset,
+                                deletion.length - overlap_size1));
+        result.push_back(
+            DiffOp(EQUAL, DiffOp::TEXT1,
+                   deletion.offset + deletion.length - overlap_size1,
+                   overlap_size1));
+        result.push_back(DiffOp(INSERT, DiffOp::TEXT2,
+                                insertion.offset + overlap_size1,
+                                insertion.length - overlap_size1));
+      } else if (overlap_size1 < overlap_size2 &&
+                 (overlap_size2 >= deletion.length / 2.0 ||
+                  overlap_size2 >= insertion.length / 2.0)) {
+        // Reverse overlap found.
+        // Insert an equality and swap and trim the surrounding edits.
+        result.push_back(DiffOp(INSERT, DiffOp::TEXT2, insertion.offset,
+                                insertion.length - overlap_size2));
+        result.push_back(
+            DiffOp(EQUAL, DiffOp::TEXT1, deletion.offset, overlap_size2));
+        result.push_back(DiffOp(DELETE, DiffOp::TEXT1,
+                                deletion.offset + overlap_size2,
+                                deletion.length - overlap_size2));
+      } else {
+        result.push_back(deletion);
+        result.push_back(insertion);
+      }
+      pointer += 2;
+    } else {
+      result.push_back(ops[pointer]);
+      pointer++;
+    }
+  }
+  ops.swap(result);
+}
+
 void diff_match_patch::diff_cleanupSemanticLossless(std::list<Diff> &diffs) {
+  PhaseTimer timer(CLEANUP_PHASE);
   std::wstring equality1, edit, equality2;
   std::wstring commonString;
   std::size_t commonOffset;
@@ -1004,9 +3734,107 @@ void diff_match_patch::diff_cleanupSemanticLossless(std::list<Diff> &diffs) {
   }
 }
 
+void diff_match_patch::diff_cleanupSemanticLossless(FlatDiffs &diffs) {
+  diff_cleanupSemanticLosslessFlat(diffs);
+}
+
+void diff_match_patch::diff_cleanupSemanticLossless(Utf8Diffs &diffs) {
+  diff_cleanupSemanticLosslessFlat(diffs);
+  diff_alignUtf8(diffs);
+}
+
+template <class Char>
+void diff_match_patch::diff_cleanupSemanticLosslessFlat(BasicFlatDiffs<Char> &diffs) {
+  PhaseTimer timer(CLEANUP_PHASE);
+  diffs.anchor();
+  std::vector<DiffOp> &ops = diffs.ops;
+  std::vector<bool> erased(ops.size(), false);
+  bool has_erased = false;
+  std::size_t prevOp = 0;
+  std::size_t thisOp = 1;
+  std::size_t nextOp = 2;
+
+  // Intentionally ignore the first and last element (don't need checking).
+  while (nextOp < ops.size()) {
+    if (ops[prevOp].operation == EQUAL && ops[nextOp].operation == EQUAL) {
+      // This is a single edit surrounded by equalities.
+      // Within the edit's own text the three operations are contiguous, so
+      // sliding the edit only moves the two boundaries of this window.
+      const std::size_t equality1_size = ops[prevOp].length;
+      const std::size_t edit_size = ops[thisOp].length;
+      const std::size_t equality2_size = ops[nextOp].length;
+      const Char *window = diffs.data(ops[thisOp]) - equality1_size;
+
+      // First, shift the edit as far left as possible.
+      int64_t shift = -static_cast<int64_t>(
+          CommonSuffix(window, equality1_size, window + equality1_size,
+                       edit_size));
+
+      // Second, step character by character right, looking for the best fit.
+      int64_t best_shift = shift;
+      const Char *edit = window + equality1_size + shift;
+      int bestScore =
+          diff_cleanupSemanticScore(window, equality1_size + shift, edit,
+                                    edit_size) +
+          diff_cleanupSemanticScore(edit, edit_size, edit + edit_size,
+                                    equality2_size - shift);
+      while (edit_size != 0 && equality2_size - shift != 0 &&
+             edit[0] == edit[edit_size]) {
+        shift++;
+        edit++;
+        int score =
+            diff_cleanupSemanticScore(window, equality1_size + shift, edit,
+                                      edit_size) +
+            diff_cleanupSemanticScore(edit, edit_size, edit + edit_size,
+                                      equality2_size - shift);
+        // The >= encourages trailing rather than leading whitespace on edits.
+        if (score >= bestScore) {
+          bestScore = score;
+          best_shift = shift;
+        }
+      }
+
+      if (best_shift != 0) {
+        // We have an improvement, save it back to the diff.
+        if (equality1_size + best_shift != 0) {
+          ops[prevOp].length = equality1_size + best_shift;
+        } else {
+          ops[prevOp].length = 0;
+          erased[prevOp] = has_erased = true;
+        }
+        ops[thisOp].offset += best_shift;
+        if (equality2_size - best_shift != 0) {
+          ops[nextOp].offset += best_shift;
+          ops[nextOp].length = equality2_size - best_shift;
+        } else {
+          erased[nextOp] = has_erased = true;
+          // Look at the same edit again against the following equality.
+          nextOp++;
+          continue;
+        }
+      }
+    }
+    prevOp = thisOp;
+    thisOp = nextOp;
+    nextOp++;
+  }
+  if (has_erased) {
+    EraseFlagged(ops, erased);
+  }
+}
+
 int diff_match_patch::diff_cleanupSemanticScore(const std::wstring &one,
                                                 const std::wstring &two) {
-  if (one.empty() || two.empty()) {
+  return diff_cleanupSemanticScore(one.data(), one.size(), two.data(),
+                                   two.size());
+}
+
+template <class Char>
+int diff_match_patch::diff_cleanupSemanticScore(const Char *one,
+                                                std::size_t one_size,
+                                                const Char *two,
+                                                std::size_t two_size) {
+  if (one_size == 0 || two_size == 0) {
     // Edges are the best.
     return 6;
   }
@@ -1016,16 +3844,16 @@ int diff_match_patch::diff_cleanupSemanticScore(const std::wstring &one,
   // 'whitespace'.  Since this function's purpose is largely cosmetic,
   // the choice has been made to use each language's native features
   // rather than force total conformity.
-  wchar_t char1 = one[one.size() - 1];
-  wchar_t char2 = two[0];
+  wint_t char1 = ScoreClass(one[one_size - 1]);
+  wint_t char2 = ScoreClass(two[0]);
   bool nonAlphaNumeric1 = !iswalnum(char1);
   bool nonAlphaNumeric2 = !iswalnum(char2);
   bool whitespace1 = nonAlphaNumeric1 && iswspace(char1);
   bool whitespace2 = nonAlphaNumeric2 && iswspace(char2);
   bool lineBreak1 = whitespace1 && iswcntrl(char1);
   bool lineBreak2 = whitespace2 && iswcntrl(char2);
-  bool blankLine1 = lineBreak1 && std::regex_search(one, BLANKLINEEND);
-  bool blankLine2 = lineBreak2 && std::regex_search(two, BLANKLINESTART);
+  bool blankLine1 = lineBreak1 && EndsWithBlankLine(one, one_size);
+  bool blankLine2 = lineBreak2 && StartsWithBlankLine(two, two_size);
 
   if (blankLine1 || blankLine2) {
     // Five points for blank lines.
@@ -1046,11 +3874,8 @@ int diff_match_patch::diff_cleanupSemanticScore(const std::wstring &one,
   return 0;
 }
 
-// Define some regex patterns for matching boundaries.
-std::wregex diff_match_patch::BLANKLINEEND(L"\\n\\r?\\n$");
-std::wregex diff_match_patch::BLANKLINESTART(L"^\\r?\\n\\r?\\n");
-
 void diff_match_patch::diff_cleanupEfficiency(std::list<Diff> &diffs) {
+  PhaseTimer timer(CLEANUP_PHASE);
   if (diffs.empty()) {
     return;
   }
@@ -1155,7 +3980,133 @@ void diff_match_patch::diff_cleanupEfficiency(std::list<Diff> &diffs) {
   }
 }
 
+void diff_match_patch::diff_cleanupEfficiency(FlatDiffs &diffs) {
+  diff_cleanupEfficiencyFlat(diffs);
+}
+
+void diff_match_patch::diff_cleanupEfficiency(Utf8Diffs &diffs) {
+  diff_cleanupEfficiencyFlat(diffs);
+  diff_alignUtf8(diffs);
+}
+
+template <class Char>
+void diff_match_patch::diff_cleanupEfficiencyFlat(BasicFlatDiffs<Char> &diffs) {
+  PhaseTimer timer(CLEANUP_PHASE);
+  if (diffs.empty()) {
+    return;
+  }
+  diffs.anchor();
+  std::vector<DiffOp> &ops = diffs.ops;
+  bool changes = false;
+  std::vector<std::size_t> equalities;  // Stack of equalities.
+  bool has_last_equality = false;
+  std::size_t last_equality = 0;  // Always equal to equalities.back().length
+  // Is there an insertion operation before the last equality.
+  bool pre_ins = false;
+  // Is there a deletion operation before the last equality.
+  bool pre_del = false;
+  // Is there an insertion operation after the last equality.
+  bool post_ins = false;
+  // Is there a deletion operation after the last equality.
+  bool post_del = false;
+  // Equalities to be replaced with a deletion and an insertion, see
+  // diff_cleanupSemantic.
+  std::vector<bool> split(ops.size(), false);
+
+  std::size_t pointer = 0;
+  bool insertion_half = false;
+  std::size_t safe_pointer = 0;
+  bool safe_insertion_half = false;
+
+  while (pointer < ops.size()) {
+    const DiffOp &thisOp = ops[pointer];
+    if (thisOp.operation == EQUAL && !split[pointer]) {
+      // Equality found.
+      if (thisOp.length < Diff_EditCost && (post_ins || post_del)) {
+        // Candidate found.
+        equalities.push_back(pointer);
+        pre_ins = post_ins;
+        pre_del = post_del;
+        last_equality = thisOp.length;
+        has_last_equality = true;
+      } else {
+        // Not a candidate, and can never become one.
+        equalities.clear();
+        has_last_equality = false;
+        safe_pointer = pointer;
+        safe_insertion_half = false;
+      }
+      post_ins = post_del = false;
+      pointer++;
+    } else {
+      // An insertion or deletion.
+      Operation operation = thisOp.operation;
+      if (split[pointer]) {
+        operation = insertion_half ? INSERT : DELETE;
+      }
+      if (operation == DELETE) {
+        post_del = true;
+      } else {
+        post_ins = true;
+      }
+      if (has_last_equality &&
+          ((pre_ins && pre_del && post_ins && post_del) ||
+           ((last_equality < Diff_EditCost / 2) &&
+            ((pre_ins ? 1 : 0) + (pre_del ? 1 : 0) + (post_ins ? 1 : 0) +
+             (post_del ? 1 : 0)) == 3))) {
+        // Replace equality with a delete and an insert, and continue from
+        // the insert.
+        pointer = equalities.back();
+        insertion_half = true;
+        split[pointer] = true;
+
+        equalities.pop_back();  // Throw away the equality we just deleted.
+        has_last_equality = false;
+        if (pre_ins && pre_del) {
+          // No changes made which could affect previous entry, keep going.
+          post_ins = post_del = true;
+          equalities.clear();
+          safe_pointer = pointer;
+          safe_insertion_half = true;
+          pointer++;
+          insertion_half = false;
+        } else {
+          if (!equalities.empty()) {
+            // Throw away the previous equality (it needs to be reevaluated).
+            equalities.pop_back();
+          }
+          if (equalities.empty()) {
+            // There are no previous questionable equalities,
+            // walk back to the last known safe diff.
+            pointer = safe_pointer;
+            insertion_half = safe_insertion_half;
+          } else {
+            // There is an equality we can fall back to.
+            pointer = equalities.back();
+            insertion_half = false;
+          }
+          post_ins = post_del = false;
+        }
+
+        changes = true;
+      } else if (split[pointer] && !insertion_half) {
+        insertion_half = true;
+      } else {
+        pointer++;
+        insertion_half = false;
+      }
+    }
+  }
+
+  if (changes) {
+    ExpandSplitEqualities(ops, split);
+    diffs.anchor();
+    diff_cleanupMergeFlat(diffs);
+  }
+}
+
 void diff_match_patch::diff_cleanupMerge(std::list<Diff> &diffs) {
+  PhaseTimer timer(CLEANUP_PHASE);
   diffs.push_back(Diff(EQUAL, L""));  // Add a dummy entry at the end.
   std::size_t count_delete = 0;
   std::size_t count_insert = 0;
@@ -1286,7 +4237,303 @@ void diff_match_patch::diff_cleanupMerge(std::list<Diff> &diffs) {
   }
   // If shifts were made, the diff needs reordering and another shift sweep.
   if (changes) {
-    diff_cleanupMerge(diffs);
+    diff_cleanupMerge(diffs);
+  }
+}
+
+void diff_match_patch::diff_cleanupMerge(FlatDiffs &diffs) {
+  diff_cleanupMergeFlat(diffs);
+}
+
+void diff_match_patch::diff_cleanupMerge(Utf8Diffs &diffs) {
+  diff_cleanupMergeFlat(diffs);
+  diff_alignUtf8(diffs);
+}
+
+template <class Char>
+void diff_match_patch::diff_cleanupMergeFlat(BasicFlatDiffs<Char> &diffs) {
+  PhaseTimer timer(CLEANUP_PHASE);
+  diffs.anchor();
+  std::vector<DiffOp> &ops = diffs.ops;
+  std::size_t text1_size = 0;
+  for (const auto &op : ops) {
+    if (op.operation != INSERT) {
+      text1_size += op.length;
+    }
+  }
+  // Every run of edits between two equalities is contiguous in text1 and
+  // text2, so merging a run only takes its first offset and total size.
+  std::vector<DiffOp> merged;
+  merged.reserve(ops.size() + 1);
+  std::size_t count_delete = 0;
+  std::size_t count_insert = 0;
+  std::size_t delete_offset = 0;
+  std::size_t delete_size = 0;
+  std::size_t insert_offset = 0;
+  std::size_t insert_size = 0;
+  std::size_t edits_start = 0;
+  bool prevEqual = false;
+  std::size_t commonsize;
+  // Visit a dummy entry at the end.
+  for (std::size_t pointer = 0; pointer <= ops.size(); pointer++) {
+    DiffOp thisOp = pointer < ops.size()
+                        ? ops[pointer]
+                        : DiffOp(EQUAL, DiffOp::TEXT1, text1_size, 0);
+    switch (thisOp.operation) {
+      case INSERT:
+        if (count_insert++ == 0) {
+          insert_offset = thisOp.offset;
+        }
+        insert_size += thisOp.length;
+        prevEqual = false;
+        break;
+      case DELETE:
+        if (count_delete++ == 0) {
+          delete_offset = thisOp.offset;
+        }
+        delete_size += thisOp.length;
+        prevEqual = false;
+        break;
+      case EQUAL: {
+        bool merge_equality = false;
+        if (count_delete + count_insert > 1) {
+          if (count_delete != 0 && count_insert != 0) {
+            const Char *text1 = diffs.base(DiffOp::TEXT1);
+            const Char *text2 = diffs.base(DiffOp::TEXT2);
+            // Factor out any common prefixies.
+            commonsize = CommonPrefix(text2 + insert_offset, insert_size,
+                                      text1 + delete_offset, delete_size);
+            if (commonsize != 0) {
+              if (!merged.empty()) {
+                if (merged.back().operation != EQUAL) {
+                  throw "Previous diff should have been an equality.";
+                }
+                merged.back().length += commonsize;
+              } else {
+                merged.push_back(
+                    DiffOp(EQUAL, DiffOp::TEXT1, delete_offset, commonsize));
+              }
+              insert_offset += commonsize;
+              insert_size -= commonsize;
+              delete_offset += commonsize;
+              delete_size -= commonsize;
+            }
+            // Factor out any common suffixies.
+            commonsize = CommonSuffix(text2 + insert_offset, insert_size,
+                                      text1 + delete_offset, delete_size);
+            if (commonsize != 0) {
+              thisOp.offset -= commonsize;
+              thisOp.length += commonsize;
+              insert_size -= commonsize;
+              delete_size -= commonsize;
+            }
+          }
+          // Insert the merged records.
+          if (delete_size != 0) {
+            merged.push_back(
+                DiffOp(DELETE, DiffOp::TEXT1, delete_offset, delete_size));
+          }
+          if (insert_size != 0) {
+            merged.push_back(
+                DiffOp(INSERT, DiffOp::TEXT2, insert_offset, insert_size));
+          }
+        } else {
+          // Keep a lone edit as is.
+          for (std::size_t j = edits_start; j < pointer; j++) {
+            merged.push_back(ops[j]);
+          }
+          // Merge this equality with the previous one.
+          merge_equality = prevEqual;
+        }
+        if (merge_equality) {
+          merged.back().length += thisOp.length;
+        } else {
+          merged.push_back(thisOp);
+        }
+        count_insert = 0;
+        count_delete = 0;
+        delete_size = 0;
+        insert_size = 0;
+        edits_start = pointer + 1;
+        prevEqual = true;
+        break;
+      }
+    }
+  }
+  if (merged.back().length == 0) {
+    merged.pop_back();  // Remove the dummy entry at the end.
+  }
+  ops.swap(merged);
+
+  /*
+  * Second pass: look for single edits surrounded on both sides by equalities
+  * which can be shifted sideways to eliminate an equality.
+  * e.g: A<ins>BA</ins>C -> <ins>AB</ins>AC
+  */
+  bool changes = false;
+  std::vector<bool> erased(ops.size(), false);
+  std::size_t prevOp = 0;
+  std::size_t thisOp = 1;
+  std::size_t nextOp = 2;
+
+  // Intentionally ignore the first and last element (don't need checking).
+  while (nextOp < ops.size()) {
+    DiffOp &prevDiff = ops[prevOp];
+    DiffOp &thisDiff = ops[thisOp];
+    DiffOp &nextDiff = ops[nextOp];
+    if (prevDiff.operation == EQUAL && nextDiff.operation == EQUAL) {
+      // This is a single edit surrounded by equalities.
+      const Char *edit = diffs.data(thisDiff);
+      if (thisDiff.length >= prevDiff.length &&
+          SpanEquals(edit + thisDiff.length - prevDiff.length,
+                     diffs.data(prevDiff), prevDiff.length)) {
+        // Shift the edit over the previous equality.
+        thisDiff.offset -= prevDiff.length;
+        nextDiff.offset -= prevDiff.length;
+        nextDiff.length += prevDiff.length;
+        // Delete prevDiff.
+        erased[prevOp] = true;
+        changes = true;
+        prevOp = nextOp;
+        thisOp = nextOp + 1;
+        nextOp += 2;
+        continue;
+      } else if (thisDiff.length >= nextDiff.length &&
+                 SpanEquals(edit, diffs.data(nextDiff), nextDiff.length)) {
+        // Shift the edit over the next equality.
+        prevDiff.length += nextDiff.length;
+        thisDiff.offset += nextDiff.length;
+        // Delete nextDiff.
+        erased[nextOp] = true;
+        changes = true;
+        prevOp = thisOp;
+        thisOp = nextOp + 1;
+        nextOp += 2;
+        continue;
+      }
+    }
+    prevOp = thisOp;
+    thisOp = nextOp;
+    nextOp++;
+  }
+  // If shifts were made, the diff needs reordering and another shift sweep.
+  if (changes) {
+    EraseFlagged(ops, erased);
+    diff_cleanupMergeFlat(diffs);
+  }
+}
+
+void diff_match_patch::diff_alignUtf8(Utf8Diffs &diffs) {
+  diffs.anchor();
+  std::vector<DiffOp> &ops = diffs.ops;
+  std::size_t text1_size = 0;
+  std::size_t text2_size = 0;
+  for (const auto &op : ops) {
+    if (op.operation != INSERT) {
+      text1_size += op.length;
+    }
+    if (op.operation != DELETE) {
+      text2_size += op.length;
+    }
+  }
+  const char *text1 = diffs.base(DiffOp::TEXT1);
+  const char *text2 = diffs.base(DiffOp::TEXT2);
+
+  std::vector<DiffOp> aligned;
+  aligned.reserve(ops.size() + 1);
+  std::size_t char_count1 = 0;
+  std::size_t char_count2 = 0;
+  // The edits since the last equality kept: where they start in each text,
+  // their first operation, and whether they have to be rebuilt because an
+  // equality next to them shrank.
+  std::size_t edits_start1 = 0;
+  std::size_t edits_start2 = 0;
+  std::size_t edits_start = 0;
+  bool rebuild = false;
+  // Visit a dummy entry at the end.
+  for (std::size_t pointer = 0; pointer <= ops.size(); pointer++) {
+    std::size_t start = 0;
+    std::size_t end = 0;
+    if (pointer < ops.size()) {
+      const DiffOp &op = ops[pointer];
+      if (op.operation != EQUAL) {
+        if (op.operation == DELETE) {
+          char_count1 += op.length;
+        } else {
+          char_count2 += op.length;
+        }
+        continue;
+      }
+      // Both texts hold the same bytes within the equality, so only its end
+      // can be a boundary in one text and not in the other.
+      const char *text = text1 + op.offset;
+      while (start < op.length && !IsUtf8Boundary(text, op.length, start)) {
+        start++;
+      }
+      end = op.length;
+      while (end > start &&
+             !(IsUtf8Boundary(text1, text1_size, char_count1 + end) &&
+               IsUtf8Boundary(text2, text2_size, char_count2 + end))) {
+        end--;
+      }
+      if (start == end) {
+        // Nothing left of the equality, it joins the edits around it.
+        char_count1 += op.length;
+        char_count2 += op.length;
+        rebuild = true;
+        continue;
+      }
+      rebuild = rebuild || start != 0;
+    }
+    // Flush the edits before the equality.
+    if (rebuild) {
+      if (char_count1 + start != edits_start1) {
+        aligned.push_back(DiffOp(DELETE, DiffOp::TEXT1, edits_start1,
+                                 char_count1 + start - edits_start1));
+      }
+      if (char_count2 + start != edits_start2) {
+        aligned.push_back(DiffOp(INSERT, DiffOp::TEXT2, edits_start2,
+                                 char_count2 + start - edits_start2));
+      }
+    } else {
+      aligned.insert(aligned.end(), ops.begin() + edits_start,
+                     ops.begin() + pointer);
+    }
+    if (pointer == ops.size()) {
+      break;
+    }
+    const std::size_t length = ops[pointer].length;
+    aligned.push_back(
+        DiffOp(EQUAL, DiffOp::TEXT1, char_count1 + start, end - start));
+    edits_start1 = char_count1 + end;
+    edits_start2 = char_count2 + end;
+    edits_start = pointer + 1;
+    rebuild = end != length;
+    char_count1 += length;
+    char_count2 += length;
+  }
+  ops.swap(aligned);
+
+  // Widen the approximate regions to whole code points.
+  for (auto &region : diffs.approximate) {
+    std::size_t end1 = region.start1 + region.size1;
+    std::size_t end2 = region.start2 + region.size2;
+    while (region.start1 > 0 &&
+           !IsUtf8Boundary(text1, text1_size, region.start1)) {
+      region.start1--;
+    }
+    while (!IsUtf8Boundary(text1, text1_size, end1)) {
+      end1++;
+    }
+    while (region.start2 > 0 &&
+           !IsUtf8Boundary(text2, text2_size, region.start2)) {
+      region.start2--;
+    }
+    while (!IsUtf8Boundary(text2, text2_size, end2)) {
+      end2++;
+    }
+    region.size1 = end1 - region.start1;
+    region.size2 = end2 - region.start2;
   }
 }
 
@@ -1296,7 +4543,7 @@ std::size_t diff_match_patch::diff_xIndex(const std::list<Diff> &diffs,
   std::size_t chars2 = 0;
   std::size_t last_chars1 = 0;
   std::size_t last_chars2 = 0;
-  Diff lastDiff;
+  bool deleted = false;
   for (const auto &aDiff : diffs) {
     if (aDiff.operation != INSERT) {
       // Equality or deletion.
@@ -1308,13 +4555,45 @@ std::size_t diff_match_patch::diff_xIndex(const std::list<Diff> &diffs,
     }
     if (chars1 > loc) {
       // Overshot the location.
-      lastDiff = aDiff;
+      deleted = aDiff.operation == DELETE;
+      break;
+    }
+    last_chars1 = chars1;
+    last_chars2 = chars2;
+  }
+  if (deleted) {
+    // The location was deleted.
+    return last_chars2;
+  }
+  // Add the remaining character size.
+  return last_chars2 + (loc - last_chars1);
+}
+
+std::size_t diff_match_patch::diff_xIndex(const FlatDiffs &diffs,
+                                          std::size_t loc) {
+  std::size_t chars1 = 0;
+  std::size_t chars2 = 0;
+  std::size_t last_chars1 = 0;
+  std::size_t last_chars2 = 0;
+  bool deleted = false;
+  for (const auto &op : diffs.ops) {
+    if (op.operation != INSERT) {
+      // Equality or deletion.
+      chars1 += op.length;
+    }
+    if (op.operation != DELETE) {
+      // Equality or insertion.
+      chars2 += op.length;
+    }
+    if (chars1 > loc) {
+      // Overshot the location.
+      deleted = op.operation == DELETE;
       break;
     }
     last_chars1 = chars1;
     last_chars2 = chars2;
   }
-  if (lastDiff.operation == DELETE) {
+  if (deleted) {
     // The location was deleted.
     return last_chars2;
   }
@@ -1367,6 +4646,16 @@ std::wstring diff_match_patch::diff_wideText1(const std::list<Diff> &diffs) {
   return text;
 }
 
+std::wstring diff_match_patch::diff_wideText1(const FlatDiffs &diffs) {
+  std::wstring text;
+  for (const auto &op : diffs.ops) {
+    if (op.operation != INSERT) {
+      text.append(diffs.data(op), op.length);
+    }
+  }
+  return text;
+}
+
 std::string diff_match_patch::diff_text2(const std::list<Diff> &diffs) {
   UnicodeEncoder unicode_encoder;
   return unicode_encoder.to_bytes(diff_wideText2(diffs));
@@ -1382,6 +4671,16 @@ std::wstring diff_match_patch::diff_wideText2(const std::list<Diff> &diffs) {
   return text;
 }
 
+std::wstring diff_match_patch::diff_wideText2(const FlatDiffs &diffs) {
+  std::wstring text;
+  for (const auto &op : diffs.ops) {
+    if (op.operation != DELETE) {
+      text.append(diffs.data(op), op.length);
+    }
+  }
+  return text;
+}
+
 std::size_t diff_match_patch::diff_levenshtein(const std::list<Diff> &diffs) {
   std::size_t levenshtein = 0;
   std::size_t insertions = 0;
@@ -1406,6 +4705,48 @@ std::size_t diff_match_patch::diff_levenshtein(const std::list<Diff> &diffs) {
   return levenshtein;
 }
 
+std::size_t diff_match_patch::diff_levenshtein(const std::wstring &text1,
+                                               const std::wstring &text2) {
+  // Common affixes do not change the distance.
+  const std::size_t prefix_size =
+      CommonPrefix(text1.data(), text1.size(), text2.data(), text2.size());
+  const std::size_t suffix_size = CommonSuffix(
+      text1.data() + prefix_size, text1.size() - prefix_size,
+      text2.data() + prefix_size, text2.size() - prefix_size);
+  const wchar_t *middle1 = text1.data() + prefix_size;
+  const std::size_t size1 = text1.size() - prefix_size - suffix_size;
+  const wchar_t *middle2 = text2.data() + prefix_size;
+  const std::size_t size2 = text2.size() - prefix_size - suffix_size;
+  // The shorter text makes the fewest words of bit vectors.
+  return size1 <= size2
+             ? BitParallelLevenshtein(middle1, size1, middle2, size2)
+             : BitParallelLevenshtein(middle2, size2, middle1, size1);
+}
+
+std::size_t diff_match_patch::diff_levenshtein(const FlatDiffs &diffs) {
+  std::size_t levenshtein = 0;
+  std::size_t insertions = 0;
+  std::size_t deletions = 0;
+  for (const auto &op : diffs.ops) {
+    switch (op.operation) {
+      case INSERT:
+        insertions += op.length;
+        break;
+      case DELETE:
+        deletions += op.length;
+        break;
+      case EQUAL:
+        // A deletion and an insertion is one substitution.
+        levenshtein += std::max(insertions, deletions);
+        insertions = 0;
+        deletions = 0;
+        break;
+    }
+  }
+  levenshtein += std::max(insertions, deletions);
+  return levenshtein;
+}
+
 std::string diff_match_patch::diff_toDelta(const std::list<Diff> &diffs) {
   UnicodeEncoder unicode_encoder;
   return unicode_encoder.to_bytes(diff_toWideDelta(diffs));
@@ -1435,6 +4776,36 @@ std::wstring diff_match_patch::diff_toWideDelta(const std::list<Diff> &diffs) {
   return res;
 }
 
+std::string diff_match_patch::diff_toDelta(const FlatDiffs &diffs) {
+  UnicodeEncoder unicode_encoder;
+  return unicode_encoder.to_bytes(diff_toWideDelta(diffs));
+}
+
+std::wstring diff_match_patch::diff_toWideDelta(const FlatDiffs &diffs) {
+  std::wstringstream text;
+  for (const auto &op : diffs.ops) {
+    switch (op.operation) {
+      case INSERT: {
+        text << L'+' << URLEncode(diffs.text(op), L" !~*'();/?:@&=+$,#")
+             << L'\t';
+        break;
+      }
+      case DELETE:
+        text << L'-' << op.length << '\t';
+        break;
+      case EQUAL:
+        text << L'=' << op.length << L'\t';
+        break;
+    }
+  }
+  const auto &res = text.str();
+  if (!res.empty()) {
+    // Strip off trailing tab character.
+    return res.substr(0, res.size() - 1);
+  }
+  return res;
+}
+
 std::list<Diff> diff_match_patch::diff_fromDelta(const std::string &text1,
                                                  const std::string &delta) {
   UnicodeEncoder unicode_encoder;
@@ -1524,47 +4895,184 @@ std::size_t diff_match_patch::match_main(const std::wstring &text,
   }
 }
 
+std::size_t diff_match_patch::match_mainUtf8(const std::string &text,
+                                             const std::string &pattern,
+                                             std::size_t loc) {
+  loc = std::min(loc, text.size());
+  if (text == pattern) {
+    // Shortcut (potentially not guaranteed by the algorithm)
+    return 0;
+  } else if (text.empty()) {
+    // Nothing to match.
+    return std::string::npos;
+  } else if (loc + pattern.size() <= text.size() &&
+             text.compare(loc, pattern.size(), pattern) == 0) {
+    // Perfect match at the perfect spot!  (Includes case of null pattern)
+    return loc;
+  }
+  // Do a fuzzy compare, then move a match found within a multi-byte sequence
+  // back to the start of its code point.
+  std::size_t match = match_bitap(text.data(), text.size(), pattern.data(),
+                                  pattern.size(), loc);
+  if (match != std::string::npos) {
+    while (!IsUtf8Boundary(text.data(), text.size(), match)) {
+      match--;
+    }
+  }
+  return match;
+}
+
+struct diff_match_patch::BitapLane {
+  const std::wstring *pattern;
+  std::size_t loc;
+  std::size_t *result;
+  // Word of the group holding the lane, its lowest bit there, and its bits:
+  // all of them, the lowest one and the top one, which flags a match.
+  std::size_t word;
+  std::size_t bit;
+  uint64_t mask;
+  uint64_t low;
+  uint64_t top;
+  // Search state, as in match_bitap.
+  double score_threshold;
+  std::size_t bin_max;
+  std::size_t start;
+  std::size_t finish;
+  // Searching at the current error level; done with all of them.
+  bool active;
+  bool done;
+};
+
+std::size_t diff_match_patch::match_main(const MatchIndex &index,
+                                         const std::wstring &pattern,
+                                         std::size_t loc) {
+  const std::wstring &text = index.text();
+  loc = std::min(loc, text.size());
+  if (text == pattern) {
+    // Shortcut (potentially not guaranteed by the algorithm)
+    return 0;
+  } else if (text.empty()) {
+    // Nothing to match.
+    return std::wstring::npos;
+  } else if (loc + pattern.size() <= text.size() &&
+             text.compare(loc, pattern.size(), pattern) == 0) {
+    // Perfect match at the perfect spot!  (Includes case of null pattern)
+    return loc;
+  }
+  // Do a fuzzy compare.
+  return match_bitapIndexed(index, pattern, loc);
+}
+
+std::vector<std::size_t> diff_match_patch::match_mainBatch(
+    const std::wstring &text,
+    const std::vector<std::pair<std::wstring, std::size_t> > &queries) {
+  std::vector<std::size_t> results(queries.size(), std::wstring::npos);
+  std::vector<BitapLane> lanes;
+  for (std::size_t i = 0; i < queries.size(); i++) {
+    const std::wstring &pattern = queries[i].first;
+    const std::size_t loc = std::min(queries[i].second, text.size());
+    // The shortcuts of match_main.
+    if (text == pattern) {
+      results[i] = 0;
+    } else if (text.empty()) {
+      results[i] = std::wstring::npos;
+    } else if (loc + pattern.size() <= text.size() &&
+               text.compare(loc, pattern.size(), pattern) == 0) {
+      results[i] = loc;
+    } else if (pattern.size() > 64) {
+      results[i] = match_bitap(text, pattern, loc);
+    } else {
+      if (!(Match_MaxBits == 0 || pattern.size() <= Match_MaxBits)) {
+        throw "Pattern too long for this application.";
+      }
+      BitapLane lane;
+      lane.pattern = &pattern;
+      lane.loc = loc;
+      lane.result = &results[i];
+      lanes.push_back(lane);
+    }
+  }
+  match_bitapLanes(text, lanes);
+  return results;
+}
+
 std::size_t diff_match_patch::match_bitap(const std::wstring &text,
                                           const std::wstring &pattern,
                                           std::size_t loc) {
-  if (!(Match_MaxBits == 0 || pattern.size() <= Match_MaxBits)) {
+  return match_bitap(text.data(), text.size(), pattern.data(), pattern.size(),
+                     loc);
+}
+
+template <class Char>
+std::size_t diff_match_patch::match_bitap(const Char *text,
+                                          std::size_t text_size,
+                                          const Char *pattern,
+                                          std::size_t pattern_size,
+                                          std::size_t loc) {
+  if (!(Match_MaxBits == 0 || pattern_size <= Match_MaxBits)) {
     throw "Pattern too long for this application.";
   }
 
-  // Initialise the alphabet.
-  auto s = match_alphabet(pattern);
-
   // Highest score beyond which we give up.
   double score_threshold = Match_Threshold;
   // Is there a nearby exact match? (speedup)
-  std::size_t best_loc = text.find(pattern, loc);
+  std::size_t best_loc = FindSpan(text, text_size, pattern, pattern_size, loc);
   if (best_loc != std::wstring::npos) {
-    score_threshold =
-        std::min(match_bitapScore(0, best_loc, loc, pattern), score_threshold);
+    score_threshold = std::min(
+        match_bitapScore(0, best_loc, loc, pattern_size), score_threshold);
     // What about in the other direction? (speedup)
-    best_loc = text.rfind(pattern, loc + pattern.size());
+    best_loc = RFindSpan(text, text_size, pattern, pattern_size,
+                         loc + pattern_size);
     if (best_loc != std::wstring::npos) {
-      score_threshold = std::min(match_bitapScore(0, best_loc, loc, pattern),
-                                 score_threshold);
+      score_threshold = std::min(
+          match_bitapScore(0, best_loc, loc, pattern_size), score_threshold);
     }
   }
+  return match_bitapScan(text, text_size, pattern, pattern_size, loc,
+                         score_threshold);
+}
 
-  // Initialise the bit arrays.
-  std::size_t matchmask = 1 << (pattern.size() - 1);
-  best_loc = std::wstring::npos;
+template <class Char>
+std::size_t diff_match_patch::match_bitapScan(const Char *text,
+                                              std::size_t text_size,
+                                              const Char *pattern,
+                                              std::size_t pattern_size,
+                                              std::size_t loc,
+                                              double score_threshold) {
+  // Initialise the alphabet.  Character i of the pattern is bit
+  // pattern_size - 1 - i of the masks, which take as many 64-bit words as
+  // the pattern needs.
+  const std::basic_string<Char> reversed(
+      std::reverse_iterator<const Char *>(pattern + pattern_size),
+      std::reverse_iterator<const Char *>(pattern));
+  const PatternMasks<Char> s(reversed.data(), pattern_size);
+  const std::size_t words = s.words();
+  const std::vector<uint64_t> no_match(words, 0);
+
+  // Initialise the bit arrays.  Each row holds 'words' words, the lowest
+  // first; bits shifted out of the top of a word carry into the next one.
+  const std::size_t match_word = (pattern_size - 1) / 64;
+  const uint64_t matchmask = uint64_t(1) << ((pattern_size - 1) % 64);
+  std::size_t best_loc = std::wstring::npos;
 
   std::size_t bin_min, bin_mid;
-  std::size_t bin_max = pattern.size() + text.size();
-  std::unique_ptr<std::size_t[]> rd;
-  std::unique_ptr<std::size_t[]> last_rd = NULL;
-  for (std::size_t d = 0; d < pattern.size(); d++) {
+  std::size_t bin_max = pattern_size + text_size;
+  // The window of the first error level holds those of the next ones, which
+  // stray less far from loc, down to as far before loc as a match found
+  // after it may let the scan go.  Row j is at (j - base) * words.
+  BitapWorkspace &workspace = BitapWorkspace::ForThisThread();
+  uint64_t *rd = NULL;
+  uint64_t *last_rd = NULL;
+  std::size_t base = 0;
+  for (std::size_t d = 0; d < pattern_size; d++) {
     // Scan for the best match; each iteration allows for one more error.
     // Run a binary search to determine how far from 'loc' we can stray at
     // this error level.
     bin_min = 0;
     bin_mid = bin_max;
     while (bin_min < bin_mid) {
-      if (match_bitapScore(d, loc + bin_mid, loc, pattern) <= score_threshold) {
+      if (match_bitapScore(d, loc + bin_mid, loc, pattern_size) <=
+          score_threshold) {
         bin_min = bin_mid;
       } else {
         bin_max = bin_mid;
@@ -1574,57 +5082,703 @@ std::size_t diff_match_patch::match_bitap(const std::wstring &text,
     // Use the result from this iteration as the maximum for the next.
     bin_max = bin_mid;
     std::size_t start = std::max<int64_t>(1, (int64_t)loc - bin_mid + 1);
-    std::size_t finish = std::min(loc + bin_mid, text.size()) + pattern.size();
-
-    rd.reset(new std::size_t[finish + 2]);
-    rd[finish + 1] = (1 << d) - 1;
+    std::size_t finish = std::min(loc + bin_mid, text_size) + pattern_size;
+
+    if (d == 0) {
+      base = std::max<int64_t>(1, 2 * (int64_t)loc + 1 - (int64_t)finish);
+      base = std::min(base, start);
+      workspace.Reserve((finish + 2 - base) * words);
+      rd = workspace.row1();
+      last_rd = workspace.row2();
+    }
+    // The lowest d bits are set past the end.
+    for (std::size_t w = 0; w < words; w++) {
+      const std::size_t bits = std::min<std::size_t>(d - std::min(d, w * 64),
+                                                     64);
+      rd[(finish + 1 - base) * words + w] =
+          bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+    }
+    std::size_t scanned = finish + 1;
     for (std::size_t j = finish; j >= start; j--) {
-      std::size_t charMatch;
-      if (text.size() <= j - 1) {
+      const uint64_t *charMatch;
+      if (text_size <= j - 1) {
         // Out of range.
-        charMatch = 0;
+        charMatch = no_match.data();
+      } else {
+        charMatch = s.Find(text[j - 1]);
+      }
+      uint64_t *row = &rd[(j - base) * words];
+      const uint64_t *next = row + words;
+      scanned = j;
+      uint64_t carry = 1;
+      if (d == 0) {
+        // First pass: exact match.
+        for (std::size_t w = 0; w < words; w++) {
+          row[w] = ((next[w] << 1) | carry) & charMatch[w];
+          carry = next[w] >> 63;
+        }
+      } else {
+        // Subsequent passes: fuzzy match.
+        const uint64_t *last = &last_rd[(j - base) * words];
+        const uint64_t *last_next = last + words;
+        uint64_t last_carry = 1;
+        for (std::size_t w = 0; w < words; w++) {
+          const uint64_t either = last_next[w] | last[w];
+          row[w] = (((next[w] << 1) | carry) & charMatch[w]) |
+                   ((either << 1) | last_carry) | last_next[w];
+          carry = next[w] >> 63;
+          last_carry = either >> 63;
+        }
+      }
+      if ((row[match_word] & matchmask) != 0) {
+        double score = match_bitapScore(d, j - 1, loc, pattern_size);
+        // This match will almost certainly be better than any existing
+        // match.  But check anyway.
+        if (score <= score_threshold) {
+          // Told you so.
+          score_threshold = score;
+          best_loc = j - 1;
+          if (best_loc > loc) {
+            // When passing loc, don't exceed our current distance from loc.
+            start = std::max<int64_t>(1, 2 * (int64_t)loc - best_loc);
+          } else {
+            // Already passed loc, downhill from here on in.
+            break;
+          }
+        }
+      }
+    }
+    if (match_bitapScore(d + 1, loc, loc, pattern_size) > score_threshold) {
+      // No hope for a (better) match at greater error levels.
+      break;
+    }
+    // The rows left unscanned hold no partial match for the next level.
+    std::fill(rd, rd + (scanned - base) * words, 0);
+    std::swap(rd, last_rd);
+  }
+  workspace.Release();
+  return best_loc;
+}
+
+namespace {
+
+// Most words of lanes matched in one shared Bitap pass.
+const std::size_t kBitapGroupWords = 4;
+
+}  // namespace
+
+void diff_match_patch::match_bitapLanes(const std::wstring &text,
+                                        std::vector<BitapLane> &lanes) {
+  const std::size_t text_size = text.size();
+  // Narrows the window of a lane for error level d, as match_bitap does.
+  auto narrow = [&](BitapLane &lane, std::size_t d) {
+    const std::size_t pattern_size = lane.pattern->size();
+    std::size_t bin_min = 0;
+    std::size_t bin_mid = lane.bin_max;
+    while (bin_min < bin_mid) {
+      if (match_bitapScore(d, lane.loc + bin_mid, lane.loc, pattern_size) <=
+          lane.score_threshold) {
+        bin_min = bin_mid;
       } else {
-        charMatch = s[text[j - 1]];
+        lane.bin_max = bin_mid;
+      }
+      bin_mid = (lane.bin_max - bin_min) / 2 + bin_min;
+    }
+    lane.bin_max = bin_mid;
+    lane.start = std::max<int64_t>(1, (int64_t)lane.loc - bin_mid + 1);
+    lane.finish = std::min(lane.loc + bin_mid, text_size) + pattern_size;
+  };
+
+  for (BitapLane &lane : lanes) {
+    const std::wstring &pattern = *lane.pattern;
+    *lane.result = std::wstring::npos;
+    lane.done = false;
+    lane.score_threshold = Match_Threshold;
+    // Is there a nearby exact match? (speedup)  Only those within reach of
+    // the threshold can lower it, so the searches stay near loc rather than
+    // running to the ends of the text for each query.  As in match_bitap,
+    // one before loc counts if there is any at or after it.
+    const std::size_t reach =
+        Match_Distance == 0
+            ? 0
+            : static_cast<std::size_t>(Match_Threshold * Match_Distance) + 1;
+    const std::size_t near_begin = lane.loc - std::min(lane.loc, reach);
+    const std::size_t near_end =
+        std::min(text_size, lane.loc + reach + pattern.size());
+    const std::size_t after = FindSpan(text.data(), near_end, pattern.data(),
+                                       pattern.size(), lane.loc);
+    std::size_t before = RFindSpan(text.data() + near_begin,
+                                   near_end - near_begin, pattern.data(),
+                                   pattern.size(),
+                                   lane.loc + pattern.size() - near_begin);
+    if (before != std::wstring::npos) {
+      before += near_begin;
+      if (after == std::wstring::npos &&
+          FindSpan(text.data(), text_size, pattern.data(), pattern.size(),
+                   lane.loc) == std::wstring::npos) {
+        before = std::wstring::npos;
+      }
+    }
+    for (const std::size_t best_loc : {after, before}) {
+      if (best_loc != std::wstring::npos) {
+        lane.score_threshold = std::min(
+            match_bitapScore(0, best_loc, lane.loc, pattern.size()),
+            lane.score_threshold);
+      }
+    }
+    lane.bin_max = pattern.size() + text_size;
+    narrow(lane, 0);
+  }
+  std::sort(lanes.begin(), lanes.end(),
+            [](const BitapLane &a, const BitapLane &b) {
+              return a.start < b.start;
+            });
+
+  BitapWorkspace &workspace = BitapWorkspace::ForThisThread();
+  for (std::size_t first = 0; first < lanes.size();) {
+    // Pack the lanes whose first windows overlap into words, each lane in
+    // the bits above the previous one.  The top bit of a lane shifts into
+    // the lowest bit of the next, which every step sets anyway.
+    std::size_t words = 1, used = 0, last = first;
+    std::size_t finish = lanes[first].finish;
+    for (; last < lanes.size(); last++) {
+      BitapLane &lane = lanes[last];
+      if (last != first && lane.start > finish) {
+        break;
+      }
+      if (used + lane.pattern->size() > 64) {
+        if (words == kBitapGroupWords) {
+          break;
+        }
+        words++;
+        used = 0;
+      }
+      lane.word = words - 1;
+      lane.bit = used;
+      lane.low = uint64_t(1) << used;
+      lane.top = uint64_t(1) << (used + lane.pattern->size() - 1);
+      lane.mask = (lane.top - lane.low) | lane.top;
+      used += lane.pattern->size();
+      finish = std::max(finish, lane.finish);
+    }
+
+    // One alphabet for the whole group: lane bit i + k holds character
+    // size - 1 - k of its pattern.  Bits above the lanes are never read.
+    std::wstring packed(words * 64, L'\0');
+    for (std::size_t i = first; i < last; i++) {
+      const std::wstring &pattern = *lanes[i].pattern;
+      const std::size_t offset = lanes[i].word * 64 + lanes[i].bit;
+      for (std::size_t k = 0; k < pattern.size(); k++) {
+        packed[offset + k] = pattern[pattern.size() - 1 - k];
+      }
+    }
+    const PatternMasks<wchar_t> s(packed.data(), packed.size());
+    const uint64_t no_match[kBitapGroupWords] = {0};
+    uint64_t lows[kBitapGroupWords] = {0};
+    uint64_t tops[kBitapGroupWords] = {0};
+    for (std::size_t i = first; i < last; i++) {
+      lows[lanes[i].word] |= lanes[i].low;
+      tops[lanes[i].word] |= lanes[i].top;
+    }
+
+    // Rows span the first windows of all the lanes, down to as far before
+    // its loc as a match found after it may let a lane go.
+    std::size_t base = std::wstring::npos;
+    for (std::size_t i = first; i < last; i++) {
+      base = std::min<std::size_t>(
+          base, std::min<int64_t>(lanes[i].start,
+                                  std::max<int64_t>(
+                                      1, 2 * (int64_t)lanes[i].loc + 1 -
+                                             (int64_t)lanes[i].finish)));
+    }
+    workspace.Reserve((finish + 2 - base) * words);
+    uint64_t *rd = workspace.row1();
+    uint64_t *last_rd = workspace.row2();
+    auto row_at = [&](uint64_t *rows, std::size_t j) {
+      return rows + (j - base) * words;
+    };
+
+    // Lanes in order of their windows' ends, which the scan reaches first.
+    std::vector<std::size_t> order;
+    for (std::size_t d = 0;; d++) {
+      order.clear();
+      std::size_t top = 0;
+      for (std::size_t i = first; i < last; i++) {
+        BitapLane &lane = lanes[i];
+        lane.active = false;
+        if (lane.done || d >= lane.pattern->size()) {
+          lane.done = true;
+          continue;
+        }
+        if (d != 0) {
+          narrow(lane, d);
+        }
+        order.push_back(i);
+        top = std::max(top, lane.finish);
+      }
+      if (order.empty()) {
+        break;
+      }
+      std::sort(order.begin(), order.end(),
+                [&lanes](std::size_t a, std::size_t b) {
+                  return lanes[a].finish > lanes[b].finish;
+                });
+
+      uint64_t active[kBitapGroupWords] = {0};
+      std::fill(row_at(rd, top + 1), row_at(rd, top + 2), 0);
+      std::size_t next = 0, low = top + 1, stop = 0;
+      for (std::size_t j = top; j >= 1; j--) {
+        // A lane's window starts above j: the row there is the initial one,
+        // with the lowest d bits of the lane set.
+        for (; next < order.size() && lanes[order[next]].finish == j;
+             next++) {
+          BitapLane &lane = lanes[order[next]];
+          row_at(rd, j + 1)[lane.word] |= (lane.low << d) - lane.low;
+          if (lane.start <= j) {
+            lane.active = true;
+            active[lane.word] |= lane.mask;
+            stop = std::max(stop, lane.start);
+          }
+        }
+        uint64_t any = 0;
+        for (std::size_t w = 0; w < words; w++) {
+          any |= active[w];
+        }
+        if (any == 0 && next == order.size()) {
+          break;
+        }
+
+        const uint64_t *charMatch =
+            j - 1 < text_size ? s.Find(text[j - 1]) : no_match;
+        uint64_t *row = row_at(rd, j);
+        const uint64_t *next_row = row + words;
+        uint64_t matches = 0;
+        if (d == 0) {
+          // First pass: exact match.
+          for (std::size_t w = 0; w < words; w++) {
+            row[w] = ((next_row[w] << 1) | lows[w]) & charMatch[w] & active[w];
+          }
+        } else {
+          // Subsequent passes: fuzzy match.
+          const uint64_t *last_row = row_at(last_rd, j);
+          const uint64_t *last_next = last_row + words;
+          for (std::size_t w = 0; w < words; w++) {
+            row[w] = ((((next_row[w] << 1) | lows[w]) & charMatch[w]) |
+                      (((last_next[w] | last_row[w]) << 1) | lows[w]) |
+                      last_next[w]) &
+                     active[w];
+          }
+        }
+        low = j;
+        for (std::size_t w = 0; w < words; w++) {
+          matches |= row[w] & tops[w];
+        }
+
+        if (matches != 0 || j <= stop) {
+          stop = 0;
+          for (const std::size_t i : order) {
+            BitapLane &lane = lanes[i];
+            if (!lane.active) {
+              continue;
+            }
+            if ((row[lane.word] & lane.top) != 0) {
+              const double score =
+                  match_bitapScore(d, j - 1, lane.loc, lane.pattern->size());
+              if (score <= lane.score_threshold) {
+                lane.score_threshold = score;
+                *lane.result = j - 1;
+                if (j - 1 > lane.loc) {
+                  // When passing loc, don't exceed our current distance
+                  // from loc.
+                  lane.start =
+                      std::max<int64_t>(1, 2 * (int64_t)lane.loc - (j - 1));
+                } else {
+                  // Already passed loc, downhill from here on in.
+                  lane.start = j + 1;
+                }
+              }
+            }
+            if (lane.start >= j) {
+              // The lane's window ends here.
+              lane.active = false;
+              active[lane.word] &= ~lane.mask;
+            } else {
+              stop = std::max(stop, lane.start);
+            }
+          }
+        }
+      }
+      // The rows left unscanned hold no partial match for the next level,
+      // but for the initial rows of the lanes the scan did not reach.
+      std::fill(rd, row_at(rd, low), 0);
+      for (; next < order.size(); next++) {
+        BitapLane &lane = lanes[order[next]];
+        row_at(rd, lane.finish + 1)[lane.word] |= (lane.low << d) - lane.low;
+      }
+
+      for (const std::size_t i : order) {
+        BitapLane &lane = lanes[i];
+        if (match_bitapScore(d + 1, lane.loc, lane.loc,
+                             lane.pattern->size()) > lane.score_threshold) {
+          // No hope for a (better) match at greater error levels.
+          lane.done = true;
+        }
+      }
+      std::swap(rd, last_rd);
+    }
+    first = last;
+  }
+  workspace.Release();
+}
+
+std::size_t diff_match_patch::match_bitapIndexed(const MatchIndex &index,
+                                                 const std::wstring &pattern,
+                                                 std::size_t loc) {
+  const std::wstring &text = index.text();
+  const std::size_t text_size = text.size();
+  const std::size_t pattern_size = pattern.size();
+  const std::size_t q = index.q();
+  if (!(Match_MaxBits == 0 || pattern_size <= Match_MaxBits)) {
+    throw "Pattern too long for this application.";
+  }
+  if (pattern_size < q) {
+    // No gram to look up.
+    return match_bitap(text, pattern, loc);
+  }
+
+  // Buckets of the grams of the pattern, and its rarest gram.
+  std::vector<std::size_t> buckets(pattern_size - q + 1);
+  std::size_t rare = 0;
+  for (std::size_t k = 0; k < buckets.size(); k++) {
+    buckets[k] = index.Bucket(&pattern[k]);
+    if (index.starts_[buckets[k] + 1] - index.starts_[buckets[k]] <
+        index.starts_[buckets[rare] + 1] - index.starts_[buckets[rare]]) {
+      rare = k;
+    }
+  }
+  const uint32_t *rare_begin =
+      index.positions_.data() + index.starts_[buckets[rare]];
+  const uint32_t *rare_end =
+      index.positions_.data() + index.starts_[buckets[rare] + 1];
+  auto occurs = [&](std::size_t at) {
+    return at + pattern_size <= text_size &&
+           text.compare(at, pattern_size, pattern) == 0;
+  };
+
+  // Highest score beyond which we give up.
+  double score_threshold = Match_Threshold;
+  // Is there a nearby exact match? (speedup)  The first occurrence at or
+  // after loc, and the last one starting at or before loc + pattern_size,
+  // among the places holding the rarest gram at the right offset.
+  std::size_t best_loc = std::wstring::npos;
+  for (const uint32_t *it = std::lower_bound(rare_begin, rare_end, loc + rare);
+       it != rare_end; ++it) {
+    if (occurs(*it - rare)) {
+      best_loc = *it - rare;
+      break;
+    }
+  }
+  if (best_loc != std::wstring::npos) {
+    score_threshold = std::min(
+        match_bitapScore(0, best_loc, loc, pattern_size), score_threshold);
+    // What about in the other direction? (speedup)
+    const std::size_t last =
+        std::min(loc + pattern_size, text_size - pattern_size);
+    for (const uint32_t *it =
+             std::upper_bound(rare_begin, rare_end, last + rare);
+         it != rare_begin && *(it - 1) >= rare;) {
+      --it;
+      if (occurs(*it - rare)) {
+        score_threshold = std::min(
+            match_bitapScore(0, *it - rare, loc, pattern_size),
+            score_threshold);
+        break;
+      }
+    }
+  }
+
+  // By the q-gram lemma, a match with at most d errors leaves at least
+  // pattern_size + 1 - q * (d + 1) of the pattern's grams intact, within the
+  // pattern_size + d characters it spans.  Filtering for fewer errors keeps
+  // fewer places, so filter first for the levels leaving half of the grams
+  // intact, which most searches stay within, then if need be for the highest
+  // level the search can reach as long as the lemma still requires a gram,
+  // and beyond that do without.
+  std::size_t max_level = 0;
+  while (max_level + 1 < pattern_size &&
+         match_bitapScore(max_level + 1, loc, loc, pattern_size) <=
+             score_threshold) {
+    max_level++;
+  }
+  const std::size_t most_levels =
+      std::min(max_level, (pattern_size - q) / q);
+  const double exact_threshold = score_threshold;
+
+  const std::wstring reversed(pattern.rbegin(), pattern.rend());
+  const PatternMasks<wchar_t> s(reversed.data(), pattern_size);
+  const std::size_t words = s.words();
+  const std::vector<uint64_t> no_match(words, 0);
+  const std::size_t match_word = (pattern_size - 1) / 64;
+  const uint64_t matchmask = uint64_t(1) << ((pattern_size - 1) % 64);
+
+  // Rows j of the candidates, where a match may start at j - 1, and the
+  // rows computed for them: from each candidate up to further than a match
+  // reaches, above which the rows may be wrong without changing the
+  // candidates' matches.  Each range of rows keeps its own slots in the
+  // workspace, with one more above it for the row seeding the scan.
+  struct Rows {
+    std::size_t low;
+    std::size_t high;
+    std::size_t slot;
+  };
+  std::vector<Rows> candidates;
+  std::vector<Rows> ranges;
+  // Positions in reach of the first window holding a gram of the pattern.
+  std::vector<uint32_t> hits;
+  bool hits_found = false;
+
+  BitapWorkspace &workspace = BitapWorkspace::ForThisThread();
+  for (std::size_t levels = std::min(most_levels,
+                                     (pattern_size - q + 1) / (2 * q));
+       ; levels = most_levels) {
+    const std::size_t needed = pattern_size + 1 - q * (levels + 1);
+    const std::size_t span = pattern_size + levels - q + 1;
+    score_threshold = exact_threshold;
+    best_loc = std::wstring::npos;
+    candidates.clear();
+    ranges.clear();
+    std::size_t slots = 0;
+    // Whether the search went past the levels filtered for, and whether the
+    // filter is not worth it at all.
+    bool deeper = false;
+    bool unfiltered = false;
+
+    std::size_t bin_min, bin_mid;
+    std::size_t bin_max = pattern_size + text_size;
+    uint64_t *rd = NULL;
+    uint64_t *last_rd = NULL;
+    for (std::size_t d = 0; d < pattern_size; d++) {
+      if (d > levels) {
+        deeper = true;
+        break;
+      }
+      // Scan for the best match; each iteration allows for one more error.
+      // Run a binary search to determine how far from 'loc' we can stray at
+      // this error level.
+      bin_min = 0;
+      bin_mid = bin_max;
+      while (bin_min < bin_mid) {
+        if (match_bitapScore(d, loc + bin_mid, loc, pattern_size) <=
+            score_threshold) {
+          bin_min = bin_mid;
+        } else {
+          bin_max = bin_mid;
+        }
+        bin_mid = (bin_max - bin_min) / 2 + bin_min;
       }
+      // Use the result from this iteration as the maximum for the next.
+      bin_max = bin_mid;
+      std::size_t start = std::max<int64_t>(1, (int64_t)loc - bin_mid + 1);
+      std::size_t finish = std::min(loc + bin_mid, text_size) + pattern_size;
+
       if (d == 0) {
-        // First pass: exact match.
-        rd[j] = ((rd[j + 1] << 1) | 1) & charMatch;
-      } else {
-        // Subsequent passes: fuzzy match.
-        rd[j] = (((rd[j + 1] << 1) | 1) & charMatch) |
-                (((last_rd[j + 1] | last_rd[j]) << 1) | 1) | last_rd[j + 1];
+        const std::size_t window = finish + 1 - start;
+        if (!hits_found) {
+          hits_found = true;
+          const std::size_t low = start - 1;
+          const std::size_t high = std::min(
+              finish + pattern_size + most_levels - q, text_size - q + 1);
+          std::vector<std::size_t> distinct(buckets);
+          std::sort(distinct.begin(), distinct.end());
+          distinct.erase(std::unique(distinct.begin(), distinct.end()),
+                         distinct.end());
+          std::vector<std::pair<const uint32_t *, const uint32_t *> > lists;
+          std::size_t count = 0;
+          for (const std::size_t bucket : distinct) {
+            const uint32_t *begin =
+                index.positions_.data() + index.starts_[bucket];
+            const uint32_t *end =
+                index.positions_.data() + index.starts_[bucket + 1];
+            lists.push_back(std::make_pair(std::lower_bound(begin, end, low),
+                                           std::lower_bound(begin, end, high)));
+            count += lists.back().second - lists.back().first;
+          }
+          if (count > window / 4) {
+            // Grams too common for the filter to leave out much.
+            unfiltered = true;
+            break;
+          }
+          // Merge the sorted lists of the buckets pairwise.
+          std::vector<std::size_t> ends(1, 0);
+          for (const auto &list : lists) {
+            hits.insert(hits.end(), list.first, list.second);
+            ends.push_back(hits.size());
+          }
+          while (ends.size() > 2) {
+            std::size_t merged = 1;
+            for (std::size_t i = 2; i < ends.size(); i += 2) {
+              std::inplace_merge(hits.begin() + ends[i - 2],
+                                 hits.begin() + ends[i - 1],
+                                 hits.begin() + ends[i]);
+              ends[merged++] = ends[i];
+            }
+            if (ends.size() % 2 == 0) {
+              ends[merged++] = ends.back();
+            }
+            ends.resize(merged);
+          }
+        }
+        // Row j is a candidate when positions j - 1 to j + span - 2 hold
+        // enough hits, e.g. hits i to i + needed - 1 in a span of them.
+        for (std::size_t i = 0; i + needed <= hits.size(); i++) {
+          const std::size_t last_hit = hits[i + needed - 1];
+          if (last_hit - hits[i] >= span) {
+            continue;
+          }
+          const std::size_t low_row =
+              std::max<int64_t>(start, (int64_t)last_hit + 2 - span);
+          const std::size_t high_row =
+              std::min<std::size_t>(finish, hits[i] + 1);
+          if (low_row > high_row) {
+            continue;
+          }
+          if (!candidates.empty() && low_row <= candidates.back().high + 1) {
+            candidates.back().high =
+                std::max(candidates.back().high, high_row);
+          } else {
+            candidates.push_back(Rows{low_row, high_row, 0});
+          }
+          const std::size_t top =
+              std::min(finish, high_row + pattern_size + levels + 1);
+          if (!ranges.empty() && low_row <= ranges.back().high + 1) {
+            ranges.back().high = std::max(ranges.back().high, top);
+          } else {
+            ranges.push_back(Rows{low_row, top, 0});
+          }
+        }
+        for (Rows &range : ranges) {
+          range.slot = slots;
+          slots += range.high - range.low + 2;
+        }
+        if (max_level > levels && slots > window / 4) {
+          // Too little left out to be worth filtering before maybe having
+          // to start again.
+          unfiltered = true;
+          break;
+        }
+        workspace.Reserve(slots * words);
+        rd = workspace.row1();
+        last_rd = workspace.row2();
       }
-      if ((rd[j] & matchmask) != 0) {
-        double score = match_bitapScore(d, j - 1, loc, pattern);
-        // This match will almost certainly be better than any existing
-        // match.  But check anyway.
-        if (score <= score_threshold) {
-          // Told you so.
-          score_threshold = score;
-          best_loc = j - 1;
-          if (best_loc > loc) {
-            // When passing loc, don't exceed our current distance from loc.
-            start = std::max<int64_t>(1, 2 * (int64_t)loc - best_loc);
+
+      std::size_t scanned = finish + 1;
+      std::size_t candidate = candidates.size();
+      bool passed = false;
+      for (std::size_t r = ranges.size(); r-- > 0 && !passed;) {
+        const Rows &range = ranges[r];
+        if (range.low > finish) {
+          continue;
+        } else if (range.high < start) {
+          break;
+        }
+        auto row_at = [&](uint64_t *rows, std::size_t j) {
+          return rows + (range.slot + j - range.low) * words;
+        };
+        // Seed the scan with the lowest d bits set past the end of the
+        // window.  Below the top of the window, the rows above the range are
+        // too far from its candidates to matter.
+        const std::size_t top = std::min(range.high, finish);
+        uint64_t *seed = row_at(rd, top + 1);
+        for (std::size_t w = 0; w < words; w++) {
+          const std::size_t bits =
+              top < finish ? 0
+                           : std::min<std::size_t>(d - std::min(d, w * 64),
+                                                   64);
+          seed[w] = bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+        }
+        for (std::size_t j = top; j >= std::max(range.low, start); j--) {
+          const uint64_t *charMatch;
+          if (text_size <= j - 1) {
+            // Out of range.
+            charMatch = no_match.data();
           } else {
-            // Already passed loc, downhill from here on in.
-            break;
+            charMatch = s.Find(text[j - 1]);
+          }
+          uint64_t *row = row_at(rd, j);
+          const uint64_t *next = row + words;
+          scanned = j;
+          uint64_t carry = 1;
+          if (d == 0) {
+            // First pass: exact match.
+            for (std::size_t w = 0; w < words; w++) {
+              row[w] = ((next[w] << 1) | carry) & charMatch[w];
+              carry = next[w] >> 63;
+            }
+          } else {
+            // Subsequent passes: fuzzy match.
+            const uint64_t *last = row_at(last_rd, j);
+            const uint64_t *last_next = last + words;
+            uint64_t last_carry = 1;
+            for (std::size_t w = 0; w < words; w++) {
+              const uint64_t either = last_next[w] | last[w];
+              row[w] = (((next[w] << 1) | carry) & charMatch[w]) |
+                       ((either << 1) | last_carry) | last_next[w];
+              carry = next[w] >> 63;
+              last_carry = either >> 63;
+            }
+          }
+          while (candidate > 0 && candidates[candidate - 1].low > j) {
+            candidate--;
+          }
+          if (candidate > 0 && candidates[candidate - 1].high >= j &&
+              (row[match_word] & matchmask) != 0) {
+            double score = match_bitapScore(d, j - 1, loc, pattern_size);
+            if (score <= score_threshold) {
+              score_threshold = score;
+              best_loc = j - 1;
+              if (best_loc > loc) {
+                // When passing loc, don't exceed our current distance from
+                // loc.
+                start = std::max<int64_t>(1, 2 * (int64_t)loc - best_loc);
+              } else {
+                // Already passed loc, downhill from here on in.
+                passed = true;
+                break;
+              }
+            }
           }
         }
       }
+      if (match_bitapScore(d + 1, loc, loc, pattern_size) > score_threshold) {
+        // No hope for a (better) match at greater error levels.
+        break;
+      }
+      // The rows left unscanned hold no partial match for the next level.
+      for (const Rows &range : ranges) {
+        if (range.low >= scanned) {
+          break;
+        }
+        const std::size_t end = std::min(range.high + 2, scanned);
+        std::fill(rd + range.slot * words,
+                  rd + (range.slot + end - range.low) * words, 0);
+      }
+      std::swap(rd, last_rd);
     }
-    if (match_bitapScore(d + 1, loc, loc, pattern) > score_threshold) {
-      // No hope for a (better) match at greater error levels.
-      break;
+    workspace.Release();
+    if (!deeper && !unfiltered) {
+      return best_loc;
+    } else if (unfiltered || levels == most_levels) {
+      // The filter cannot rule out enough: search without it.
+      return match_bitapScan(text.data(), text_size, pattern.data(),
+                             pattern_size, loc, exact_threshold);
     }
-    last_rd = std::move(rd);
   }
-  return best_loc;
 }
 
 double diff_match_patch::match_bitapScore(std::size_t e, std::size_t x,
                                           std::size_t loc,
-                                          const std::wstring &pattern) {
-  const float accuracy = static_cast<float>(e) / pattern.size();
+                                          std::size_t pattern_size) {
+  const float accuracy = static_cast<float>(e) / pattern_size;
   const std::size_t proximity = (loc > x) ? (loc - x) : x - loc;
   if (Match_Distance == 0) {
     // Dodge divide by zero error.
@@ -1635,14 +5789,19 @@ double diff_match_patch::match_bitapScore(std::size_t e, std::size_t x,
 
 std::unordered_map<wchar_t, std::size_t> diff_match_patch::match_alphabet(
     const std::wstring &pattern) {
-  std::unordered_map<wchar_t, std::size_t> s;
-  std::size_t i;
-  for (auto c : pattern) {
-    s.emplace(c, 0);
-  }
-  std::size_t mask = 1 << (pattern.size() - 1);
-  for (auto c : pattern) {
-    s[c] |= mask;
+  return match_alphabet(pattern.data(), pattern.size());
+}
+
+template <class Char>
+std::unordered_map<Char, std::size_t> diff_match_patch::match_alphabet(
+    const Char *pattern, std::size_t pattern_size) {
+  std::unordered_map<Char, std::size_t> s;
+  for (std::size_t i = 0; i < pattern_size; i++) {
+    s.emplace(pattern[i], 0);
+  }
+  std::size_t mask = std::size_t(1) << (pattern_size - 1);
+  for (std::size_t i = 0; i < pattern_size; i++) {
+    s[pattern[i]] |= mask;
     mask >>= 1;
   }
   return s;
@@ -1652,53 +5811,30 @@ std::unordered_map<wchar_t, std::size_t> diff_match_patch::match_alphabet(
 
 void diff_match_patch::patch_addContext(Patch &patch,
                                         const std::wstring &text) {
-  if (text.empty()) {
-    return;
-  }
-  std::wstring pattern = safeSubStr(text, patch.start2, patch.size1);
-  std::size_t padding = 0;
-
-  // Look for the first and last matches of pattern in text.  If two different
-  // matches are found, increase the pattern size.
-  while (text.find(pattern) != text.rfind(pattern) &&
-         pattern.size() < Match_MaxBits - Patch_Margin - Patch_Margin) {
-    padding += Patch_Margin;
-    std::size_t offset = patch.start2 > padding ? patch.start2 - padding : 0;
-    pattern = safeSubStr(
-        text, offset,
-        std::min(text.size(), patch.start2 + patch.size1 + padding) - offset);
-  }
-  // Add one chunk for good luck.
-  padding += Patch_Margin;
+  AddContext(patch, RollingText<wchar_t>(text.data(), text.size(), NULL, 0),
+             patch.start2, Patch_Margin, Match_MaxBits);
+}
 
-  // Add the prefix.
-  auto offset = patch.start2 > padding ? patch.start2 - padding : 0;
-  std::wstring prefix = safeSubStr(text, offset, patch.start2 - offset);
-  if (!prefix.empty()) {
-    patch.diffs.push_front(Diff(EQUAL, prefix));
-  }
-  // Add the suffix.
-  std::wstring suffix =
-      safeSubStr(text, patch.start2 + patch.size1,
-                 std::min(text.size(), patch.start2 + patch.size1 + padding) -
-                     (patch.start2 + patch.size1));
-  if (!suffix.empty()) {
-    patch.diffs.push_back(Diff(EQUAL, suffix));
+std::list<Patch> diff_match_patch::patch_make(const std::string &text1,
+                                              const std::string &text2) {
+  // Diff the bytes, only decoding the result for the patches.
+  Utf8Diffs diffs = diff_mainUtf8(text1, text2, true);
+  if (diffs.size() > 2) {
+    diff_cleanupSemantic(diffs);
+    diff_cleanupEfficiency(diffs);
   }
 
-  // Roll back the start points.
-  patch.start1 -= prefix.size();
-  patch.start2 -= prefix.size();
-  // Extend the sizes.
-  patch.size1 += prefix.size() + suffix.size();
-  patch.size2 += prefix.size() + suffix.size();
+  return patch_makeFlat(diffs);
 }
 
-std::list<Patch> diff_match_patch::patch_make(const std::string &text1,
-                                              const std::string &text2) {
-  UnicodeEncoder unicode_encoder;
-  return patch_make(unicode_encoder.from_bytes(text1),
-                    unicode_encoder.from_bytes(text2));
+std::list<Patch> diff_match_patch::patch_makeFiles(const MappedFile &file1,
+                                                   const MappedFile &file2) {
+  Utf8Diffs diffs = diff_mainFiles(file1, file2, true);
+  if (diffs.size() > 2) {
+    diff_cleanupSemantic(diffs);
+    diff_cleanupEfficiency(diffs);
+  }
+  return patch_makeFlat(diffs);
 }
 
 std::list<Patch> diff_match_patch::patch_make(const std::wstring &text1,
@@ -1719,6 +5855,16 @@ std::list<Patch> diff_match_patch::patch_make(const std::list<Diff> &diffs) {
   return patch_make(text1, diffs);
 }
 
+std::list<Patch> diff_match_patch::patch_make(const FlatDiffs &diffs) {
+  // No origin string provided, compute our own.
+  const std::wstring text1 = diff_wideText1(diffs);
+  return patch_make(text1, diffs);
+}
+
+std::list<Patch> diff_match_patch::patch_make(const Utf8Diffs &diffs) {
+  return patch_makeFlat(diffs);
+}
+
 std::list<Patch> diff_match_patch::patch_make(const std::string &text1,
                                               const std::string & /*text2*/,
                                               const std::list<Diff> &diffs) {
@@ -1749,11 +5895,18 @@ std::list<Patch> diff_match_patch::patch_make(const std::wstring &text1,
   Patch patch;
   std::size_t char_count1 = 0;  // Number of characters into the text1 string.
   std::size_t char_count2 = 0;  // Number of characters into the text2 string.
-  // Start with text1 (prepatch_text) and apply the diffs until we arrive at
-  // text2 (postpatch_text).  We recreate the patches one by one to determine
-  // context info.
-  std::wstring prepatch_text = text1;
-  std::wstring postpatch_text = text1;
+  // Number of characters into text1 itself, which char_count1 stops being
+  // once it is moved onto the patched text.
+  std::size_t text1_count = 0;
+  // Unlike Unidiff, our patch lists have a rolling context.
+  // http://code.google.com/p/google-diff-match-patch/wiki/Unidiff
+  // Context is taken from text1 with the previous patches applied, which is
+  // text2 up to the end of the previous patch followed by the rest of text1.
+  const std::wstring text2 = diff_wideText2(diffs);
+  RollingText<wchar_t> prepatch_text(text2.data(), 0, text1.data(),
+                                     text1.size());
+  ContextIndexes<wchar_t> indexes(text1.data(), text1.size(), text2.data(),
+                                  text2.size());
   for (const auto &aDiff : diffs) {
     if (patch.diffs.empty() && aDiff.operation != EQUAL) {
       // A new patch starts here.
@@ -1765,15 +5918,10 @@ std::list<Patch> diff_match_patch::patch_make(const std::wstring &text1,
       case INSERT:
         patch.diffs.push_back(aDiff);
         patch.size2 += aDiff.text.size();
-        postpatch_text = postpatch_text.substr(0, char_count2) + aDiff.text +
-                         safeSubStr(postpatch_text, char_count2);
         break;
       case DELETE:
         patch.size1 += aDiff.text.size();
         patch.diffs.push_back(aDiff);
-        postpatch_text =
-            postpatch_text.substr(0, char_count2) +
-            safeSubStr(postpatch_text, char_count2 + aDiff.text.size());
         break;
       case EQUAL:
         if (aDiff.text.size() <= 2 * Patch_Margin && !patch.diffs.empty() &&
@@ -1787,14 +5935,17 @@ std::list<Patch> diff_match_patch::patch_make(const std::wstring &text1,
         if (aDiff.text.size() >= 2 * Patch_Margin) {
           // Time for a new patch.
           if (!patch.diffs.empty()) {
-            patch_addContext(patch, prepatch_text);
+            indexes.Use(prepatch_text, patches.size());
+            AddContext(patch, prepatch_text, patch.start2, Patch_Margin,
+                       Match_MaxBits);
             patches.push_back(patch);
             patch = Patch();
-            // Unlike Unidiff, our patch lists have a rolling context.
-            // http://code.google.com/p/google-diff-match-patch/wiki/Unidiff
             // Update prepatch text & pos to reflect the application of the
             // just completed patch.
-            prepatch_text = postpatch_text;
+            const std::size_t tail = std::min(text1_count, text1.size());
+            prepatch_text = RollingText<wchar_t>(text2.data(), char_count2,
+                                                 text1.data() + tail,
+                                                 text1.size() - tail);
             char_count1 = char_count2;
           }
         }
@@ -1804,6 +5955,7 @@ std::list<Patch> diff_match_patch::patch_make(const std::wstring &text1,
     // Update the current character count.
     if (aDiff.operation != INSERT) {
       char_count1 += aDiff.text.size();
+      text1_count += aDiff.text.size();
     }
     if (aDiff.operation != DELETE) {
       char_count2 += aDiff.text.size();
@@ -1811,7 +5963,208 @@ std::list<Patch> diff_match_patch::patch_make(const std::wstring &text1,
   }
   // Pick up the leftover patch if not empty.
   if (!patch.diffs.empty()) {
-    patch_addContext(patch, prepatch_text);
+    indexes.Use(prepatch_text, patches.size());
+    AddContext(patch, prepatch_text, patch.start2, Patch_Margin,
+               Match_MaxBits);
+    patches.push_back(patch);
+  }
+
+  return patches;
+}
+
+std::list<Patch> diff_match_patch::patch_make(const std::wstring &text1,
+                                              const FlatDiffs &diffs) {
+  std::list<Patch> patches;
+  if (diffs.empty()) {
+    return patches;  // Get rid of the null case.
+  }
+  const DiffOp &lastOp = diffs.ops.back();
+  Patch patch;
+  std::size_t char_count1 = 0;  // Number of characters into the text1 string.
+  std::size_t char_count2 = 0;  // Number of characters into the text2 string.
+  // Number of characters into text1 itself, which char_count1 stops being
+  // once it is moved onto the patched text.
+  std::size_t text1_count = 0;
+  // Unlike Unidiff, our patch lists have a rolling context.
+  // http://code.google.com/p/google-diff-match-patch/wiki/Unidiff
+  // Context is taken from text1 with the previous patches applied, which is
+  // text2 up to the end of the previous patch followed by the rest of text1.
+  const std::wstring text2 = diff_wideText2(diffs);
+  RollingText<wchar_t> prepatch_text(text2.data(), 0, text1.data(),
+                                     text1.size());
+  ContextIndexes<wchar_t> indexes(text1.data(), text1.size(), text2.data(),
+                                  text2.size());
+  for (const auto &op : diffs.ops) {
+    if (patch.diffs.empty() && op.operation != EQUAL) {
+      // A new patch starts here.
+      patch.start1 = char_count1;
+      patch.start2 = char_count2;
+    }
+
+    switch (op.operation) {
+      case INSERT:
+        patch.diffs.push_back(Diff(INSERT, diffs.text(op)));
+        patch.size2 += op.length;
+        break;
+      case DELETE:
+        patch.size1 += op.length;
+        patch.diffs.push_back(Diff(DELETE, diffs.text(op)));
+        break;
+      case EQUAL:
+        if (op.length <= 2 * Patch_Margin && !patch.diffs.empty() &&
+            !(op.length == lastOp.length &&
+              lastOp.operation == EQUAL &&
+              SpanEquals(diffs.data(op), diffs.data(lastOp), op.length))) {
+          // Small equality inside a patch.
+          patch.diffs.push_back(Diff(EQUAL, diffs.text(op)));
+          patch.size1 += op.length;
+          patch.size2 += op.length;
+        }
+
+        if (op.length >= 2 * Patch_Margin) {
+          // Time for a new patch.
+          if (!patch.diffs.empty()) {
+            indexes.Use(prepatch_text, patches.size());
+            AddContext(patch, prepatch_text, patch.start2, Patch_Margin,
+                       Match_MaxBits);
+            patches.push_back(patch);
+            patch = Patch();
+            // Update prepatch text & pos to reflect the application of the
+            // just completed patch.
+            const std::size_t tail = std::min(text1_count, text1.size());
+            prepatch_text = RollingText<wchar_t>(text2.data(), char_count2,
+                                                 text1.data() + tail,
+                                                 text1.size() - tail);
+            char_count1 = char_count2;
+          }
+        }
+        break;
+    }
+
+    // Update the current character count.
+    if (op.operation != INSERT) {
+      char_count1 += op.length;
+      text1_count += op.length;
+    }
+    if (op.operation != DELETE) {
+      char_count2 += op.length;
+    }
+  }
+  // Pick up the leftover patch if not empty.
+  if (!patch.diffs.empty()) {
+    indexes.Use(prepatch_text, patches.size());
+    AddContext(patch, prepatch_text, patch.start2, Patch_Margin,
+               Match_MaxBits);
+    patches.push_back(patch);
+  }
+
+  return patches;
+}
+
+template <class Char>
+std::list<Patch> diff_match_patch::patch_makeFlat(
+    const BasicFlatDiffs<Char> &diffs) {
+  std::list<Patch> patches;
+  if (diffs.empty()) {
+    return patches;  // Get rid of the null case.
+  }
+  bool detached = false;
+  for (const auto &op : diffs.ops) {
+    detached = detached || op.source == DiffOp::ARENA;
+  }
+  if (detached && (diffs.text1_ == NULL || diffs.text2_ == NULL)) {
+    // Rebuild the texts the context is taken from.
+    BasicFlatDiffs<Char> anchored = diffs;
+    anchored.anchor();
+    return patch_makeFlat(anchored);
+  }
+  const Char *text1 = diffs.base(DiffOp::TEXT1);
+  const Char *text2 = diffs.base(DiffOp::TEXT2);
+  std::size_t text1_size = 0;
+  std::size_t text2_size = 0;
+  for (const auto &op : diffs.ops) {
+    if (op.operation != INSERT) {
+      text1_size += op.length;
+    }
+    if (op.operation != DELETE) {
+      text2_size += op.length;
+    }
+  }
+  const DiffOp &lastOp = diffs.ops.back();
+
+  // Code units into text1 and text2, and wide characters into text2.
+  std::size_t char_count1 = 0;
+  std::size_t char_count2 = 0;
+  std::size_t wide_count2 = 0;
+  // Unlike Unidiff, our patch lists have a rolling context.
+  // http://code.google.com/p/google-diff-match-patch/wiki/Unidiff
+  // Context is taken from text1 with the previous patches applied, which is
+  // text2 up to the end of the previous patch followed by the rest of text1.
+  RollingText<Char> prepatch_text(text2, 0, text1, text1_size);
+  ContextIndexes<Char> indexes(text1, text1_size, text2, text2_size);
+  Patch patch;
+  // Where the patch starts in prepatch_text.
+  std::size_t patch_start = 0;
+  for (const auto &op : diffs.ops) {
+    // Margins count wide characters.
+    const std::size_t wide_length = CodePointCount(diffs.data(op), op.length);
+    if (patch.diffs.empty() && op.operation != EQUAL) {
+      // A new patch starts here.
+      patch.start1 = wide_count2;
+      patch.start2 = wide_count2;
+      patch_start = char_count2;
+    }
+
+    switch (op.operation) {
+      case INSERT:
+        patch.diffs.push_back(Diff(INSERT, Widen(diffs.text(op))));
+        patch.size2 += wide_length;
+        break;
+      case DELETE:
+        patch.diffs.push_back(Diff(DELETE, Widen(diffs.text(op))));
+        patch.size1 += wide_length;
+        break;
+      case EQUAL:
+        if (wide_length <= 2 * Patch_Margin && !patch.diffs.empty() &&
+            !(op.length == lastOp.length && lastOp.operation == EQUAL &&
+              SpanEquals(diffs.data(op), diffs.data(lastOp), op.length))) {
+          // Small equality inside a patch.
+          patch.diffs.push_back(Diff(EQUAL, Widen(diffs.text(op))));
+          patch.size1 += wide_length;
+          patch.size2 += wide_length;
+        }
+
+        if (wide_length >= 2 * Patch_Margin) {
+          // Time for a new patch.
+          if (!patch.diffs.empty()) {
+            indexes.Use(prepatch_text, patches.size());
+            AddContext(patch, prepatch_text, patch_start, Patch_Margin,
+                       Match_MaxBits);
+            patches.push_back(patch);
+            patch = Patch();
+            // Update prepatch text to reflect the application of the just
+            // completed patch.
+            prepatch_text = RollingText<Char>(text2, char_count2,
+                                              text1 + char_count1,
+                                              text1_size - char_count1);
+          }
+        }
+        break;
+    }
+
+    // Update the current character count.
+    if (op.operation != INSERT) {
+      char_count1 += op.length;
+    }
+    if (op.operation != DELETE) {
+      char_count2 += op.length;
+      wide_count2 += wide_length;
+    }
+  }
+  // Pick up the leftover patch if not empty.
+  if (!patch.diffs.empty()) {
+    indexes.Use(prepatch_text, patches.size());
+    AddContext(patch, prepatch_text, patch_start, Patch_Margin, Match_MaxBits);
     patches.push_back(patch);
   }
 
@@ -1836,6 +6189,19 @@ std::list<Patch> diff_match_patch::patch_deepCopy(
   return patchesCopy;
 }
 
+struct diff_match_patch::PatchEdit {
+  // Whether the patch was applied.
+  bool applied;
+  // Where the patch matched, or npos if it did not.
+  std::size_t start;
+  // Whether the text there was just what the patch expected.
+  bool perfect;
+  // The patch replaces text[begin, end) with replacement.
+  std::size_t begin;
+  std::size_t end;
+  std::wstring replacement;
+};
+
 std::pair<std::string, std::vector<bool> > diff_match_patch::patch_apply(
     const std::list<Patch> &patches, const std::string &text) {
   UnicodeEncoder unicode_encoder;
@@ -1859,95 +6225,311 @@ std::pair<std::wstring, std::vector<bool> > diff_match_patch::patch_apply(
   text = nullPadding + text + nullPadding;
   patch_splitMax(patchesCopy);
 
-  std::size_t x = 0;
+  std::vector<bool> results(patchesCopy.size());
+  patch_applyPieces(patchesCopy, text, results);
+  // Strip the padding off.
+  text = safeSubStr(text, nullPadding.size(),
+                    text.size() - 2 * nullPadding.size());
+  return std::pair<std::wstring, std::vector<bool> >(text, results);
+}
+
+void diff_match_patch::patch_locate(const Patch &aPatch,
+                                    const std::wstring &text,
+                                    std::size_t expected_loc,
+                                    PatchEdit &edit) {
+  edit.applied = false;
+  edit.perfect = false;
+  edit.begin = edit.end = 0;
+  edit.replacement.clear();
+  std::wstring text1 = diff_wideText1(aPatch.diffs);
+  std::size_t start_loc;
+  std::size_t end_loc = std::wstring::npos;
+  if (Match_MaxBits != 0 && text1.size() > Match_MaxBits) {
+    // patch_splitMax will only provide an oversized pattern in the case of
+    // a monster delete.
+    start_loc = match_main(text, text1.substr(0, Match_MaxBits), expected_loc);
+    if (start_loc != std::wstring::npos) {
+      end_loc = match_main(text, text1.substr(text1.size() - Match_MaxBits),
+                           expected_loc + text1.size() - Match_MaxBits);
+      if (end_loc == std::wstring::npos || start_loc >= end_loc) {
+        // Can't find valid trailing context.  Drop this patch.
+        start_loc = std::wstring::npos;
+      }
+    }
+  } else {
+    start_loc = match_main(text, text1, expected_loc);
+  }
+  edit.start = start_loc;
+  if (start_loc == std::wstring::npos) {
+    // No match found.  :(
+    return;
+  }
+  // Found a match.  :)
+  edit.applied = true;
+  std::wstring text2;
+  if (end_loc == std::wstring::npos) {
+    text2 = safeSubStr(text, start_loc, text1.size());
+  } else {
+    text2 = safeSubStr(text, start_loc, end_loc + Match_MaxBits - start_loc);
+  }
+  // The patch turns text[start_loc, start_loc + taken) into local.
+  std::wstring local;
+  std::size_t taken = 0;
+  edit.perfect = text1 == text2;
+  if (edit.perfect) {
+    // Perfect match, just shove the replacement text in.
+    local = diff_wideText2(aPatch.diffs);
+    taken = text1.size();
+  } else {
+    // Imperfect match.  Run a diff to get a framework of equivalent indices.
+    std::list<Diff> diffs = diff_main(text1, text2, false);
+    if (Match_MaxBits != 0 && text1.size() > Match_MaxBits &&
+        diff_levenshtein(diffs) / static_cast<float>(text1.size()) >
+            Patch_DeleteThreshold) {
+      // The end points match, but the content is unacceptably bad.
+      edit.applied = false;
+      return;
+    }
+    diff_cleanupSemanticLossless(diffs);
+    // Take in more of the text whenever an edit reaches past what has been
+    // taken so far.
+    const auto take = [&](std::size_t position) {
+      if (position > local.size()) {
+        const std::size_t more = std::min(position - local.size(),
+                                          text.size() - start_loc - taken);
+        local.append(text, start_loc + taken, more);
+        taken += more;
+      }
+    };
+    std::size_t index1 = 0;
+    for (const auto &aDiff : aPatch.diffs) {
+      if (aDiff.operation != EQUAL) {
+        std::size_t index2 = diff_xIndex(diffs, index1);
+        take(index2);
+        if (aDiff.operation == INSERT) {
+          // Insertion
+          local = local.substr(0, index2) + aDiff.text +
+                  safeSubStr(local, index2);
+        } else if (aDiff.operation == DELETE) {
+          // Deletion
+          const std::size_t end2 =
+              diff_xIndex(diffs, index1 + aDiff.text.size());
+          take(end2);
+          local = local.substr(0, index2) + safeSubStr(local, end2);
+        }
+      }
+      if (aDiff.operation != DELETE) {
+        index1 += aDiff.text.size();
+      }
+    }
+  }
+  // Keep only what changed.
+  const wchar_t *const original = text.data() + start_loc;
+  std::size_t prefix = 0;
+  while (prefix < taken && prefix < local.size() &&
+         original[prefix] == local[prefix]) {
+    prefix++;
+  }
+  std::size_t suffix = 0;
+  while (suffix < taken - prefix && suffix < local.size() - prefix &&
+         original[taken - 1 - suffix] == local[local.size() - 1 - suffix]) {
+    suffix++;
+  }
+  edit.begin = start_loc + prefix;
+  edit.end = start_loc + taken - suffix;
+  edit.replacement = local.substr(prefix, local.size() - prefix - suffix);
+}
+
+void diff_match_patch::patch_applyPieces(const std::list<Patch> &patches,
+                                         std::wstring &text,
+                                         std::vector<bool> &results) {
+  // The text stays as it is while the edits of the patches pile up in order
+  // along it, as in a piece table, and they are spliced in once at the end.
+  // A patch is located on the text as long as it cannot read what an edit
+  // before it changed; otherwise the edits so far are spliced in first.
+  // With threads, the patches are located speculatively, at where the
+  // serial loop is predicted to look for them.  Walking them in order then
+  // keeps each one whose prediction held; the others are located again.
+  const std::size_t threads =
+      Patch_Threads > 1 && text.size() >= Diff_ParallelGrain ? Patch_Threads
+                                                             : 1;
+  std::vector<const Patch *> list;
+  std::vector<std::wstring> texts1;
+  for (const auto &aPatch : patches) {
+    list.push_back(&aPatch);
+    texts1.push_back(diff_wideText1(aPatch.diffs));
+  }
+  // Started once there are patches to locate in parallel.
+  std::unique_ptr<TaskPool> pool;
+
+  // How far from its expected location a patch may match.  Text further off
+  // scores beyond Match_Threshold, so cannot change where it matches.
+  std::size_t reach;
+  if (Match_Distance == 0) {
+    reach = Match_Threshold >= 1 ? std::wstring::npos : 0;
+  } else {
+    reach = static_cast<std::size_t>(
+                std::max(0.0, Match_Threshold * (1 + 1e-5) * Match_Distance)) +
+            2;
+  }
+
+  // Edits kept so far, in order along the text, which is left as it is
+  // until they are spliced in.  From the end of the last one on, the text
+  // the serial loop would have is this one shifted by 'shift'.
+  std::vector<PatchEdit> kept;
+  int64_t shift = 0;
+  std::size_t settled = 0;
+  std::wstring spliced;
+  const auto splice = [&] {
+    if (kept.size() == 1) {
+      // Only the text after the edit moves, if at all.
+      const PatchEdit &edit = kept.front();
+      text.replace(edit.begin, edit.end - edit.begin, edit.replacement);
+    } else if (!kept.empty()) {
+      spliced.clear();
+      spliced.reserve(text.size() + shift);
+      std::size_t position = 0;
+      for (const auto &edit : kept) {
+        spliced.append(text, position, edit.begin - position);
+        spliced += edit.replacement;
+        position = edit.end;
+      }
+      spliced.append(text, position, std::wstring::npos);
+      text.swap(spliced);
+    }
+    kept.clear();
+    shift = 0;
+    settled = 0;
+  };
+  // Whether locating patch x at loc reads no text before 'from': a patch
+  // found unchanged where expected reads none before it, else it reads as
+  // far back as it could match.
+  const auto reads_after = [&](std::size_t x, std::size_t loc,
+                               std::size_t from) {
+    if (loc <= text.size() && texts1[x].size() <= text.size() - loc &&
+        text.compare(loc, texts1[x].size(), texts1[x]) == 0) {
+      return loc >= from;
+    }
+    return reach < loc && loc - reach - 1 >= from;
+  };
+
+  std::vector<PatchEdit> edits(list.size());
+  std::vector<std::size_t> locs(list.size());
   // delta keeps track of the offset between the expected and actual location
   // of the previous patch.  If there are patches expected at positions 10 and
   // 20, but the first patch was found at 12, delta is 2 and the second patch
   // has an effective expected position of 22.
   std::size_t delta = 0;
-  std::vector<bool> results(patchesCopy.size());
-  for (const auto &aPatch : patchesCopy) {
-    std::size_t expected_loc = aPatch.start2 + delta;
-    std::wstring text1 = diff_wideText1(aPatch.diffs);
-    std::size_t start_loc;
-    std::size_t end_loc = std::wstring::npos;
-    if (text1.size() > Match_MaxBits) {
-      // patch_splitMax will only provide an oversized pattern in the case of
-      // a monster delete.
-      start_loc =
-          match_main(text, text1.substr(0, Match_MaxBits), expected_loc);
-      if (start_loc != std::wstring::npos) {
-        end_loc = match_main(text, text1.substr(text1.size() - Match_MaxBits),
-                             expected_loc + text1.size() - Match_MaxBits);
-        if (end_loc == std::wstring::npos || start_loc >= end_loc) {
-          // Can't find valid trailing context.  Drop this patch.
-          start_loc = std::wstring::npos;
+  // Offset between where the previous patch was found and its start2.  The
+  // serial loop sets delta to where a patch was found less where it was
+  // expected, so unless the drift changes, delta alternates between two
+  // values adding up to it.
+  std::size_t drift = 0;
+  // Keeps the patch if it was located where the serial loop looks for it,
+  // on text which no earlier edit reaches.
+  const auto keep = [&](std::size_t x) {
+    const Patch &aPatch = *list[x];
+    const std::size_t expected_loc = aPatch.start2 + delta;
+    const std::size_t loc = expected_loc - shift;
+    if (loc != locs[x]) {
+      return false;
+    }
+    PatchEdit &edit = edits[x];
+    if (!kept.empty()) {
+      const std::size_t patched_size = text.size() + shift;
+      if (expected_loc > patched_size ||
+          static_cast<int64_t>(expected_loc) < shift ||
+          std::min(text.size(), patched_size) <= texts1[x].size()) {
+        return false;
+      }
+      if (edit.perfect && edit.start == loc) {
+        if (loc < settled) {
+          return false;
         }
+      } else if (reach >= loc || loc - reach - 1 < settled) {
+        return false;
       }
-    } else {
-      start_loc = match_main(text, text1, expected_loc);
     }
-    if (start_loc == std::wstring::npos) {
-      // No match found.  :(
-      results[x] = false;
-      // Subtract the delta for this failed patch from subsequent patches.
+    results[x] = edit.applied;
+    if (edit.start == std::wstring::npos) {
       delta -= aPatch.size2 - aPatch.size1;
-    } else {
-      // Found a match.  :)
-      results[x] = true;
-      delta = start_loc - expected_loc;
-      std::wstring text2;
-      if (end_loc == std::wstring::npos) {
-        text2 = safeSubStr(text, start_loc, text1.size());
-      } else {
-        text2 =
-            safeSubStr(text, start_loc, end_loc + Match_MaxBits - start_loc);
+      drift -= aPatch.size2 - aPatch.size1;
+      return true;
+    }
+    delta = edit.start + shift - expected_loc;
+    drift = edit.start + shift - aPatch.start2;
+    if (edit.begin != edit.end || !edit.replacement.empty()) {
+      shift += static_cast<int64_t>(edit.replacement.size()) -
+               static_cast<int64_t>(edit.end - edit.begin);
+      settled = edit.end;
+      kept.push_back(std::move(edit));
+    }
+    return true;
+  };
+
+  std::size_t next = 0;
+  std::size_t batch = threads;
+  while (next < list.size()) {
+    // Where the serial loop looks for the first patch of the batch is known.
+    // Should it read text which earlier edits changed, splice them in.
+    locs[next] = list[next]->start2 + delta - shift;
+    if (!kept.empty() && !reads_after(next, locs[next], settled)) {
+      splice();
+      locs[next] = list[next]->start2 + delta;
+    }
+    // Predict where it looks for the others, supposing each patch is found
+    // as far from its start2 as the last one was.  Stop at a patch which
+    // would read text that one before it changes.
+    std::size_t end = std::min(list.size(), next + batch);
+    std::size_t predicted_delta = delta;
+    int64_t predicted_shift = shift;
+    std::size_t reached = settled;
+    for (std::size_t x = next; x < end; x++) {
+      locs[x] = list[x]->start2 + predicted_delta - predicted_shift;
+      if (x > next && !reads_after(x, locs[x], reached)) {
+        end = x;
+        break;
       }
-      if (text1 == text2) {
-        // Perfect match, just shove the replacement text in.
-        text = text.substr(0, start_loc) + diff_wideText2(aPatch.diffs) +
-               safeSubStr(text, start_loc + text1.size());
-      } else {
-        // Imperfect match.  Run a diff to get a framework of equivalent
-        // indices.
-        std::list<Diff> diffs = diff_main(text1, text2, false);
-        if (text1.size() > Match_MaxBits &&
-            diff_levenshtein(diffs) / static_cast<float>(text1.size()) >
-                Patch_DeleteThreshold) {
-          // The end points match, but the content is unacceptably bad.
-          results[x] = false;
-        } else {
-          diff_cleanupSemanticLossless(diffs);
-          std::size_t index1 = 0;
-          for (const auto &aDiff : aPatch.diffs) {
-            if (aDiff.operation != EQUAL) {
-              std::size_t index2 = diff_xIndex(diffs, index1);
-              if (aDiff.operation == INSERT) {
-                // Insertion
-                text = text.substr(0, start_loc + index2) + aDiff.text +
-                       safeSubStr(text, start_loc + index2);
-              } else if (aDiff.operation == DELETE) {
-                // Deletion
-                text = text.substr(0, start_loc + index2) +
-                       safeSubStr(
-                           text,
-                           start_loc +
-                               diff_xIndex(diffs, index1 + aDiff.text.size()));
-              }
-            }
-            if (aDiff.operation != DELETE) {
-              index1 += aDiff.text.size();
-            }
+      reached = std::max(reached, locs[x] + texts1[x].size());
+      predicted_delta = drift - predicted_delta;
+      predicted_shift += static_cast<int64_t>(list[x]->size2) -
+                         list[x]->size1;
+    }
+    // Halve the batch until one patch is left, leaving the other halves for
+    // idle threads to steal.
+    std::function<void(std::size_t, std::size_t)> locate_range =
+        [&](std::size_t begin, std::size_t finish) {
+          if (finish - begin == 1) {
+            patch_locate(*list[begin], text, locs[begin], edits[begin]);
+            return;
           }
-        }
-      }
+          const std::size_t middle = begin + (finish - begin) / 2;
+          pool->Invoke([&] { locate_range(begin, middle); },
+                       [&] { locate_range(middle, finish); });
+        };
+    if (pool == NULL && end - next > 1) {
+      pool.reset(new TaskPool(threads));
+    }
+    locate_range(next, end);
+    std::size_t x = next;
+    while (x < end && keep(x)) {
+      x++;
     }
-    x++;
+    if (x == next) {
+      // The first patch read text which earlier edits changed after all.
+      splice();
+      locs[next] = list[next]->start2 + delta;
+      patch_locate(*list[next], text, locs[next], edits[next]);
+      keep(next);
+      x++;
+    }
+    // Look twice as far ahead as predictions held.
+    if (threads > 1) {
+      batch = std::min<std::size_t>(2 * (x - next), 64 * threads);
+    }
+    next = x;
   }
-  // Strip the padding off.
-  text = safeSubStr(text, nullPadding.size(),
-                    text.size() - 2 * nullPadding.size());
-  return std::pair<std::wstring, std::vector<bool> >(text, results);
+  splice();
 }
 
 std::string diff_match_patch::patch_addPadding(std::list<Patch> &patches) {
@@ -2012,6 +6594,10 @@ std::wstring diff_match_patch::patch_addWidePadding(std::list<Patch> &patches) {
 }
 
 void diff_match_patch::patch_splitMax(std::list<Patch> &patches) {
+  if (Match_MaxBits == 0) {
+    // No limit on the pattern size, so there is nothing to split.
+    return;
+  }
   short patch_size = Match_MaxBits;
   std::wstring precontext, postcontext;
   Patch patch;
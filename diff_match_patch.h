@@ -23,6 +23,9 @@
 #ifndef DIFF_MATCH_PATCH_H_
 #define DIFF_MATCH_PATCH_H_
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <list>
 #include <regex>
 #include <string>
@@ -69,6 +72,27 @@
 */
 enum Operation { DELETE, INSERT, EQUAL };
 
+/**
+* Algorithm diffing what is left once the common prefix, suffix and any
+* half-match have been taken out:
+* MYERS: Myers' O(ND) bisection, which finds a minimal diff.
+* PATIENCE: anchors on the characters (or lines, in line mode) which occur
+*     once in each text and diffs between them, falling back to MYERS when
+*     there is no such anchor.
+* HISTOGRAM: splits around the longest common run containing the rarest
+*     characters, falling back to MYERS when all of them are too common.
+* BIT_PARALLEL: traces a longest common subsequence back through bit
+*     vectors which cover 64 characters of text1 per word, so a text2 of n
+*     characters takes n steps per word.  Minimal like MYERS, without the
+*     setup cost of bisecting, for short texts such as the windows
+*     patch_apply re-diffs; falls back to MYERS when the bit vectors would
+*     take over 8 MB.
+* PATIENCE and HISTOGRAM are not minimal, but cut the search space of large,
+* heavily edited texts and align hunks better on repeated lines such as
+* braces.
+*/
+enum DiffAlgorithm { MYERS, PATIENCE, HISTOGRAM, BIT_PARALLEL };
+
 /**
 * Class representing one diff operation.
 */
@@ -113,6 +137,337 @@ class Patch {
   std::wstring toString() const;
 };
 
+/**
+* Class representing one operation of a FlatDiffs.  Rather than owning its
+* text, the operation covers [offset, offset + length) of one of the buffers
+* held by the FlatDiffs.
+*/
+class DiffOp {
+ public:
+  // Buffer holding the text of an operation.
+  enum Source { TEXT1, TEXT2, ARENA };
+
+  Operation operation;
+  // One of: INSERT, DELETE or EQUAL.
+  Source source;
+  // The buffer the text lives in.
+  std::size_t offset;
+  std::size_t length;
+  // The span of the text within the buffer.
+
+  /**
+   * Constructor.  Initializes the operation with the provided values.
+   * @param operation One of INSERT, DELETE or EQUAL.
+   * @param source Buffer holding the text.
+   * @param offset Start of the text within the buffer.
+   * @param length Size of the text.
+   */
+  DiffOp(Operation _operation, Source _source, std::size_t _offset,
+         std::size_t _length);
+  DiffOp();
+};
+
+/**
+* Class representing a region of a diff: [start1, start1 + size1) of the old
+* text against [start2, start2 + size2) of the new one.
+*/
+class DiffRegion {
+ public:
+  std::size_t start1;
+  std::size_t size1;
+  std::size_t start2;
+  std::size_t size2;
+
+  /**
+   * Constructor.  Initializes the region with the provided values.
+   * @param start1 Start of the region in the old text.
+   * @param size1 Size of the region in the old text.
+   * @param start2 Start of the region in the new text.
+   * @param size2 Size of the region in the new text.
+   */
+  DiffRegion(std::size_t _start1, std::size_t _size1, std::size_t _start2,
+             std::size_t _size2);
+  DiffRegion();
+  bool operator==(const DiffRegion &d) const;
+  bool operator!=(const DiffRegion &d) const;
+};
+
+/**
+* Class representing a diff as a contiguous array of operations.
+* Unlike std::list<Diff>, no text is copied: DELETE and EQUAL operations refer
+* to text1, INSERT operations to text2, and text which is in neither (e.g.
+* converted from a std::list<Diff>) is kept in a side arena.
+* When both texts are attached, the operations must describe a diff from
+* text1 to text2.  The attached texts must outlive the diff.
+* Offsets and lengths count code units of the texts: wchar_t for FlatDiffs,
+* bytes of UTF-8 for Utf8Diffs.
+*/
+template <class Char>
+class BasicFlatDiffs {
+  friend class diff_match_patch;
+
+ public:
+  typedef std::basic_string<Char> String;
+
+  std::vector<DiffOp> ops;
+  // Regions whose diff was cut short by Diff_Timeout or a cancellation, in
+  // order.  They were replaced wholesale, or approximated when Diff_Anytime
+  // is set.  The rest of the texts was diffed in full.
+  std::vector<DiffRegion> approximate;
+
+  /**
+   * Constructor.  Initializes an empty diff with no attached texts.
+   */
+  BasicFlatDiffs();
+
+  /**
+   * Constructor.  Initializes an empty diff between two texts.
+   * @param text1 Old string.
+   * @param text2 New string.
+   */
+  BasicFlatDiffs(const String &text1, const String &text2);
+  BasicFlatDiffs(const Char *text1, std::size_t text1_size, const Char *text2,
+                 std::size_t text2_size);
+
+  bool empty() const { return ops.empty(); }
+  std::size_t size() const { return ops.size(); }
+
+  /**
+   * Pointer to the first code unit of an operation's text.
+   * @param op Operation of this diff.
+   * @return Start of the text, valid for op.length code units.
+   */
+  const Char *data(const DiffOp &op) const;
+
+  /**
+   * Copy of an operation's text.
+   * @param op Operation of this diff.
+   * @return The text.
+   */
+  String text(const DiffOp &op) const;
+
+  /**
+   * Append an operation whose text is copied into the arena.
+   * @param operation One of INSERT, DELETE or EQUAL.
+   * @param text The text being applied.
+   */
+  void appendText(Operation operation, const String &text);
+
+  /**
+   * Convert to the legacy representation, decoding UTF-8 for Utf8Diffs.
+   * @return Linked List of Diff objects.
+   */
+  std::list<Diff> toList() const;
+
+  /**
+   * Convert from the legacy representation, encoding UTF-8 for Utf8Diffs.
+   * The text is copied to the arena.
+   * @param diffs Linked List of Diff objects.
+   * @return Equivalent diff.
+   */
+  static BasicFlatDiffs fromList(const std::list<Diff> &diffs);
+
+ private:
+  const Char *base(DiffOp::Source source) const;
+
+  /**
+   * Make every operation refer to its canonical position: DELETE and EQUAL
+   * at the current offset in text1, INSERT at the current offset in text2.
+   * Texts which are not attached are rebuilt from the operations first.
+   */
+  void anchor();
+
+  /**
+   * Append the operations of a diff between parts of this diff's texts,
+   * moving them to their position within this diff's texts.
+   * @param diffs Diff whose texts lie within text1 and text2.
+   */
+  void append(const BasicFlatDiffs &diffs);
+
+  /**
+   * Add a region to the approximate ones, merging it with those it overlaps
+   * or touches.
+   * @param region Region of this diff's texts.
+   */
+  void markApproximate(const DiffRegion &region);
+
+  const Char *text1_;
+  std::size_t text1_size_;
+  const Char *text2_;
+  std::size_t text2_size_;
+  // Storage for texts rebuilt by anchor() when none was attached.
+  String owned_text1_;
+  String owned_text2_;
+  String arena_;
+};
+
+/**
+* Diff between two std::wstring texts.
+*/
+typedef BasicFlatDiffs<wchar_t> FlatDiffs;
+
+/**
+* Diff between two UTF-8 std::string texts, computed on the bytes themselves.
+* Offsets and lengths are in bytes.  diff_mainUtf8 and the cleanups taking a
+* Utf8Diffs never split a code point: every operation starts and ends on a
+* code point boundary of both texts (provided the texts are valid UTF-8), so
+* each operation's text is valid UTF-8 on its own.
+*/
+typedef BasicFlatDiffs<char> Utf8Diffs;
+
+/**
+* Read-only memory mapping of a file, so that files can be diffed without
+* being read into memory.  The OS loads pages as the diff touches them and
+* can drop them again, so resident memory follows the parts of the files
+* being compared rather than their size.
+* The file must not be modified while it is mapped.
+*/
+class MappedFile {
+ public:
+  /**
+   * Constructor.  Maps the whole file.
+   * @param path Path of the file.
+   * @throws std::string If the file cannot be opened or mapped.
+   */
+  explicit MappedFile(const std::string &path);
+  ~MappedFile();
+
+  const char *data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+ private:
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+  const char *data_;
+  std::size_t size_;
+  // Contents of the file where it cannot be mapped.
+  std::string contents_;
+};
+
+/**
+* Flag letting another thread stop a diff in progress, e.g. when the client
+* which asked for it has gone.  A cancelled diff ends as if it had reached
+* Diff_Timeout: it returns early with a valid but coarser diff.
+*/
+class CancellationToken {
+ public:
+  CancellationToken() : cancelled_(false) {}
+
+  /**
+   * Stop the diffs using this token.  Safe to call from any thread.
+   */
+  void cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+
+  bool cancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<bool> cancelled_;
+};
+
+/**
+* Class representing the work done by all the diffs in the process since the
+* last diff_resetStats.  The counters are only kept when the library is built
+* with DIFF_MATCH_PATCH_STATS defined (cmake -DDIFF_MATCH_PATCH_STATS=ON);
+* otherwise they stay zero and cost nothing.
+*/
+class DiffStats {
+ public:
+  class Phase {
+   public:
+    uint64_t calls;
+    // Number of times the phase ran.
+    uint64_t nanoseconds;
+    // Time spent in the phase, not counting nested phases.
+
+    Phase();
+  };
+
+  Phase prefix;
+  // Trimming of the common prefix and suffix.
+  Phase halfMatch;
+  // Search for a common substring at least half as long as the longer text.
+  Phase lineHash;
+  // Hashing of lines into characters for line mode.
+  Phase bisect;
+  // Myers' bisection.
+  Phase cleanup;
+  // Semantic, lossless, efficiency and merge cleanups.
+  Phase transcode;
+  // Conversion between UTF-8 and wide strings.
+  uint64_t bisectDepth;
+  // Largest edit distance d reached by one bisection.
+  uint64_t bisectSteps;
+  // Sum of the edit distances reached by all the bisections.
+  uint64_t deadlineHits;
+  // Bisections cut short by Diff_Timeout or a cancellation.
+  uint64_t bytesTranscoded;
+  // UTF-8 bytes converted to or from wide strings.
+  bool enabled;
+  // Whether the library was built with DIFF_MATCH_PATCH_STATS.
+
+  DiffStats();
+};
+
+/**
+* Class representing the throughput of a batch of diffs.
+*/
+class DiffBatchStats {
+ public:
+  std::size_t pairs;
+  // Number of pairs diffed.
+  std::size_t characters;
+  // Code units in both texts of all the pairs.
+  std::size_t timeouts;
+  // Pairs cut short by Diff_Timeout or a cancellation.
+  double seconds;
+  // Wall-clock time the batch took.
+
+  DiffBatchStats();
+  double pairsPerSecond() const;
+  double charactersPerSecond() const;
+};
+
+/**
+* Positional index of the q-grams of one text, built once so that many
+* match_main calls on that text can skip the parts of it where the pattern
+* cannot match.  Grams are hashed into buckets, each listing the positions of
+* its grams in order.  The index refers to the text, which must outlive it and
+* stay unchanged.
+*/
+class MatchIndex {
+ public:
+  /**
+   * Constructor.  Indexes the gram starting at every position of the text.
+   * @param text Text to index.
+   * @param q Length of the grams.  Shorter grams let match_main filter at
+   *     more error levels, longer ones give fewer false candidates.
+   * @throws std::string If q is zero or the text has 2^32 characters or more.
+   */
+  explicit MatchIndex(const std::wstring &text, std::size_t q = 3);
+  // The index keeps a pointer to the text, so it can't index a temporary.
+  MatchIndex(std::wstring &&text, std::size_t q = 3) = delete;
+
+  const std::wstring &text() const { return *text_; }
+  std::size_t q() const { return q_; }
+
+ private:
+  MatchIndex(const MatchIndex &);
+  MatchIndex &operator=(const MatchIndex &);
+  friend class diff_match_patch;
+
+  // Bucket of the gram starting at gram.
+  std::size_t Bucket(const wchar_t *gram) const;
+
+  const std::wstring *text_;
+  std::size_t q_;
+  int shift_;
+  // Positions of the grams of bucket b are positions_[starts_[b]] up to
+  // positions_[starts_[b + 1]], in increasing order.
+  std::vector<uint32_t> starts_;
+  std::vector<uint32_t> positions_;
+};
+
 /**
  * Class containing the diff, match and patch methods.
  * Also contains the behaviour settings.
@@ -125,9 +480,23 @@ class diff_match_patch {
   // Set these on your diff_match_patch instance to override the defaults.
 
   // Number of seconds to map a diff before giving up (0 for infinity).
+  // This is wall-clock time, whatever the number of threads.
   float Diff_Timeout;
+  // On timeout, approximate the rest of the diff from equal lines and unique
+  // runs of characters rather than replacing it wholesale.  FlatDiffs and
+  // Utf8Diffs list the approximated regions.
+  bool Diff_Anytime;
+  // Token to stop diffs from another thread (NULL for none).
+  const CancellationToken *Diff_CancellationToken;
   // Cost of an empty edit operation in terms of edit characters.
   short Diff_EditCost;
+  // Algorithm for the parts of a diff which cannot be trimmed or split.
+  DiffAlgorithm Diff_Algorithm;
+  // Number of threads diffing independent parts of a text (1 for serial).
+  // The result is the same as the serial one.
+  int Diff_Threads;
+  // Smallest part (characters in both texts) worth handing to another thread.
+  std::size_t Diff_ParallelGrain;
   // At what point is no match declared (0.0 = perfection, 1.0 = very loose).
   float Match_Threshold;
   // How far to search for a match (0 = exact location, 1000+ = broad match).
@@ -141,15 +510,17 @@ class diff_match_patch {
   float Patch_DeleteThreshold;
   // Chunk size for context size.
   short Patch_Margin;
-
-  // The number of bits in an int.
+  // Number of threads locating patches in patch_apply (1 for serial).  The
+  // result is the same as the serial one.  Texts shorter than
+  // Diff_ParallelGrain are patched serially.
+  int Patch_Threads;
+
+  // Longest pattern match_bitap accepts (0 for no limit), and so the size of
+  // the pieces patch_splitMax cuts patches into.  Patterns longer than 64
+  // characters take several words per Bitap row; larger values let patches
+  // carry more context and be applied with fewer matches.
   short Match_MaxBits;
 
- private:
-  // Define some regex patterns for matching boundaries.
-  static std::wregex BLANKLINEEND;
-  static std::wregex BLANKLINESTART;
-
  public:
   diff_match_patch();
 
@@ -179,50 +550,199 @@ class diff_match_patch {
   std::list<Diff> diff_main(const std::wstring &text1,
                             const std::wstring &text2, bool checklines);
 
+  /**
+   * Find the differences between two texts, without copying them.
+   * The result refers to text1 and text2, which must outlive it.
+   * @param text1 Old string to be diffed.
+   * @param text2 New string to be diffed.
+   * @param checklines Speedup flag.  If false, then don't run a
+   *     line-level diff first to identify the changed areas.
+   *     If true, then run a faster slightly less optimal diff.
+   * @return FlatDiffs between text1 and text2.
+   */
+  FlatDiffs diff_mainFlat(const std::wstring &text1, const std::wstring &text2);
+  FlatDiffs diff_mainFlat(const std::wstring &text1, const std::wstring &text2,
+                          bool checklines);
+
+  /**
+   * Find the differences between two UTF-8 texts, working on their bytes
+   * rather than decoding them.  Offsets and lengths in the result are in
+   * bytes, and no operation splits a code point.
+   * The result refers to text1 and text2, which must outlive it.
+   * @param text1 Old string to be diffed.
+   * @param text2 New string to be diffed.
+   * @param checklines Speedup flag.  If false, then don't run a
+   *     line-level diff first to identify the changed areas.
+   *     If true, then run a faster slightly less optimal diff.
+   * @return Utf8Diffs between text1 and text2.
+   */
+  Utf8Diffs diff_mainUtf8(const std::string &text1, const std::string &text2);
+  Utf8Diffs diff_mainUtf8(const std::string &text1, const std::string &text2,
+                          bool checklines);
+
+  /**
+   * Find the differences between two UTF-8 files, working on their mapped
+   * bytes: the common prefix and suffix are trimmed and line mode runs in
+   * place, without copying or decoding the files.  Offsets and lengths in
+   * the result are in bytes, and no operation splits a code point.
+   * The result refers to the mappings, which must outlive it.
+   * @param file1 Old file to be diffed.
+   * @param file2 New file to be diffed.
+   * @param checklines Speedup flag.  If false, then don't run a
+   *     line-level diff first to identify the changed areas.
+   *     If true, then run a faster slightly less optimal diff.
+   * @return Utf8Diffs between file1 and file2.
+   */
+ public:
+  Utf8Diffs diff_mainFiles(const MappedFile &file1, const MappedFile &file2);
+  Utf8Diffs diff_mainFiles(const MappedFile &file1, const MappedFile &file2,
+                           bool checklines);
+
+  /**
+   * Find the differences between many pairs of texts, spread over
+   * Diff_Threads threads which steal work from each other.  Pairs large
+   * enough to be split are diffed in parallel too.  Each pair has its own
+   * Diff_Timeout, counted from when it starts.
+   * The results refer to the texts, which must outlive them.
+   * @param pairs Pairs of old and new strings to be diffed.
+   * @param checklines Speedup flag.  If false, then don't run a
+   *     line-level diff first to identify the changed areas.
+   *     If true, then run a faster slightly less optimal diff.
+   * @param stats If not NULL, receives the throughput of the batch.
+   * @return FlatDiffs between the texts of each pair, in the same order.
+   */
+ public:
+  std::vector<FlatDiffs> diff_mainBatch(
+      const std::vector<std::pair<std::wstring, std::wstring> > &pairs);
+  std::vector<FlatDiffs> diff_mainBatch(
+      const std::vector<std::pair<std::wstring, std::wstring> > &pairs,
+      bool checklines, DiffBatchStats *stats);
+
+  /**
+   * Find the differences between many pairs of UTF-8 texts, like
+   * diff_mainBatch.  Offsets and lengths in the results are in bytes, and
+   * no operation splits a code point.
+   * @param pairs Pairs of old and new strings to be diffed.
+   * @param checklines Speedup flag.
+   * @param stats If not NULL, receives the throughput of the batch.
+   * @return Utf8Diffs between the texts of each pair, in the same order.
+   */
+  std::vector<Utf8Diffs> diff_mainUtf8Batch(
+      const std::vector<std::pair<std::string, std::string> > &pairs);
+  std::vector<Utf8Diffs> diff_mainUtf8Batch(
+      const std::vector<std::pair<std::string, std::string> > &pairs,
+      bool checklines, DiffBatchStats *stats);
+
+  /**
+   * Snapshot of the work done by the diffs in this process.
+   * @return Counters and timers per phase; all zero unless the library was
+   *     built with DIFF_MATCH_PATCH_STATS.
+   */
+  static DiffStats diff_stats();
+
+  /**
+   * Zero the counters returned by diff_stats.
+   */
+  static void diff_resetStats();
+
+  /**
+   * State shared by all the parts of one diff, possibly across threads.
+   */
+ private:
+  struct DiffContext;
+
+  /**
+   * Find the differences between two texts, setting up the deadline and the
+   * threads for the whole diff.
+   * @param text1 Old string to be diffed.
+   * @param text1_size Size of text1.
+   * @param text2 New string to be diffed.
+   * @param text2_size Size of text2.
+   * @param checklines Speedup flag.
+   * @return Diff between text1 and text2.
+   */
+ private:
+  template <class Char>
+  BasicFlatDiffs<Char> diff_mainFlat(const Char *text1, std::size_t text1_size,
+                                     const Char *text2, std::size_t text2_size,
+                                     bool checklines);
+
+  /**
+   * Find the differences between many pairs of texts on one set of threads.
+   * @param pairs Pairs of old and new strings to be diffed.
+   * @param checklines Speedup flag.
+   * @param finish Run on each diff once computed, on the thread which
+   *     computed it.
+   * @param stats If not NULL, receives the throughput of the batch.
+   * @return Diffs between the texts of each pair, in the same order.
+   */
+ private:
+  template <class Char>
+  std::vector<BasicFlatDiffs<Char> > diff_mainBatch(
+      const std::vector<std::pair<std::basic_string<Char>,
+                                  std::basic_string<Char> > > &pairs,
+      bool checklines,
+      const std::function<void(BasicFlatDiffs<Char> &)> &finish,
+      DiffBatchStats *stats);
+
   /**
    * Find the differences between two texts.  Simplifies the problem by
    * stripping any common prefix or suffix off the texts before diffing.
+   * The texts are spans which are never copied; the result refers to them.
    * @param text1 Old string to be diffed.
+   * @param text1_size Size of text1.
    * @param text2 New string to be diffed.
+   * @param text2_size Size of text2.
    * @param checklines Speedup flag.  If false, then don't run a
    *     line-level diff first to identify the changed areas.
    *     If true, then run a faster slightly less optimal diff.
-   * @param deadline Time when the diff should be complete by.  Used
-   *     internally for recursive calls.  Users should set DiffTimeout instead.
-   * @return Linked List of Diff objects.
+   * @param context Deadline and threads shared by all parts of the diff.
+   *     Used internally for recursive calls.  Users should set Diff_Timeout
+   *     and Diff_Threads instead.
+   * @return Diff between text1 and text2.
    */
  private:
-  std::list<Diff> diff_main(const std::wstring &text1,
-                            const std::wstring &text2, bool checklines,
-                            clock_t deadline);
+  template <class Char>
+  BasicFlatDiffs<Char> diff_main(const Char *text1, std::size_t text1_size,
+                                 const Char *text2, std::size_t text2_size,
+                                 bool checklines, const DiffContext &context);
 
   /**
    * Find the differences between two texts.  Assumes that the texts do not
    * have any common prefix or suffix.
    * @param text1 Old string to be diffed.
+   * @param text1_size Size of text1.
    * @param text2 New string to be diffed.
+   * @param text2_size Size of text2.
    * @param checklines Speedup flag.  If false, then don't run a
    *     line-level diff first to identify the changed areas.
    *     If true, then run a faster slightly less optimal diff.
-   * @param deadline Time when the diff should be complete by.
-   * @return Linked List of Diff objects.
+   * @param context Deadline and threads shared by all parts of the diff.
+   * @return Diff between text1 and text2.
    */
  private:
-  std::list<Diff> diff_compute(std::wstring text1, std::wstring text2,
-                               bool checklines, clock_t deadline);
+  template <class Char>
+  BasicFlatDiffs<Char> diff_compute(const Char *text1, std::size_t text1_size,
+                                    const Char *text2, std::size_t text2_size,
+                                    bool checklines,
+                                    const DiffContext &context);
 
   /**
    * Do a quick line-level diff on both strings, then rediff the parts for
    * greater accuracy.
    * This speedup can produce non-minimal diffs.
    * @param text1 Old string to be diffed.
+   * @param text1_size Size of text1.
    * @param text2 New string to be diffed.
-   * @param deadline Time when the diff should be complete by.
-   * @return Linked List of Diff objects.
+   * @param text2_size Size of text2.
+   * @param context Deadline and threads shared by all parts of the diff.
+   * @return Diff between text1 and text2.
    */
  private:
-  std::list<Diff> diff_lineMode(std::wstring text1, std::wstring text2,
-                                clock_t deadline);
+  template <class Char>
+  BasicFlatDiffs<Char> diff_lineMode(const Char *text1, std::size_t text1_size,
+                                     const Char *text2, std::size_t text2_size,
+                                     const DiffContext &context);
 
   /**
    * Find the 'middle snake' of a diff, split the problem in two
@@ -235,21 +755,110 @@ class diff_match_patch {
  protected:
   std::list<Diff> diff_bisect(const std::wstring &text1,
                               const std::wstring &text2, clock_t deadline);
+ private:
+  template <class Char>
+  BasicFlatDiffs<Char> diff_bisect(const Char *text1, std::size_t text1_size,
+                                   const Char *text2, std::size_t text2_size,
+                                   const DiffContext &context);
+
+  /**
+   * Diff two texts without a deadline, once it has passed: the equal lines
+   * which occur once in each text are kept first, then the parts between
+   * them are aligned on unique runs of characters, shorter and shorter,
+   * and replaced wholesale where none is left.  Takes O(n log n) time for
+   * each length of run tried.  Its whole region is marked approximate.
+   * @param text1 Old string to be diffed.
+   * @param text1_size Size of text1.
+   * @param text2 New string to be diffed.
+   * @param text2_size Size of text2.
+   * @return Diff between text1 and text2.
+   */
+ private:
+  template <class Char>
+  BasicFlatDiffs<Char> diff_approximate(const Char *text1,
+                                        std::size_t text1_size,
+                                        const Char *text2,
+                                        std::size_t text2_size) const;
+
+  /**
+   * Patience diff: find the characters which occur exactly once in each
+   * text, keep the longest sequence of them which is in the same order in
+   * both, and diff the parts in between.  Falls back to diff_bisect when no
+   * character is unique in both texts.
+   * @param text1 Old string to be diffed.
+   * @param text1_size Size of text1.
+   * @param text2 New string to be diffed.
+   * @param text2_size Size of text2.
+   * @param context Deadline and threads shared by all parts of the diff.
+   * @return Diff between text1 and text2.
+   */
+ private:
+  template <class Char>
+  BasicFlatDiffs<Char> diff_patience(const Char *text1, std::size_t text1_size,
+                                     const Char *text2, std::size_t text2_size,
+                                     const DiffContext &context);
+
+  /**
+   * Histogram diff: find the longest common run whose rarest character
+   * occurs the fewest times in text1, nearest the middle of text2 among
+   * equal ones, split the diff around it and diff both parts.
+   * Characters occurring more than 64 times are never used as anchors; when
+   * no anchor is left, falls back to diff_bisect.
+   * @param text1 Old string to be diffed.
+   * @param text1_size Size of text1.
+   * @param text2 New string to be diffed.
+   * @param text2_size Size of text2.
+   * @param context Deadline and threads shared by all parts of the diff.
+   * @return Diff between text1 and text2.
+   */
+ private:
+  template <class Char>
+  BasicFlatDiffs<Char> diff_histogram(const Char *text1,
+                                      std::size_t text1_size,
+                                      const Char *text2,
+                                      std::size_t text2_size,
+                                      const DiffContext &context);
+
+  /**
+   * Bit-parallel diff: compute the longest common subsequence of the texts
+   * 64 characters of text1 at a time (Hyyrö 2004), keeping the bit vector
+   * of each character of text2, and trace it back into a minimal diff.
+   * Falls back to diff_bisect when the bit vectors would be too large.
+   * @param text1 Old string to be diffed.
+   * @param text1_size Size of text1.
+   * @param text2 New string to be diffed.
+   * @param text2_size Size of text2.
+   * @param context Deadline and threads shared by all parts of the diff.
+   * @return Diff between text1 and text2.
+   */
+ private:
+  template <class Char>
+  BasicFlatDiffs<Char> diff_bitParallel(const Char *text1,
+                                        std::size_t text1_size,
+                                        const Char *text2,
+                                        std::size_t text2_size,
+                                        const DiffContext &context);
 
   /**
    * Given the location of the 'middle snake', split the diff in two parts
    * and recurse.
    * @param text1 Old string to be diffed.
+   * @param text1_size Size of text1.
    * @param text2 New string to be diffed.
+   * @param text2_size Size of text2.
    * @param x Index of split point in text1.
    * @param y Index of split point in text2.
-   * @param deadline Time at which to bail if not yet complete.
-   * @return LinkedList of Diff objects.
+   * @param context Deadline and threads shared by all parts of the diff.
+   * @return Diff between text1 and text2.
    */
  private:
-  std::list<Diff> diff_bisectSplit(const std::wstring &text1,
-                                   const std::wstring &text2, std::size_t x,
-                                   std::size_t y, clock_t deadline);
+  template <class Char>
+  BasicFlatDiffs<Char> diff_bisectSplit(const Char *text1,
+                                        std::size_t text1_size,
+                                        const Char *text2,
+                                        std::size_t text2_size, std::size_t x,
+                                        std::size_t y,
+                                        const DiffContext &context);
 
   /**
    * Split two texts into a list of strings.  Reduce the texts to a string of
@@ -268,18 +877,31 @@ class diff_match_patch {
   // std::wstring, elem 2
   // is std::vector<std::wstring>
 
+  /**
+   * Unique lines of the texts being diffed in line mode, referring to the
+   * texts rather than copying them.
+   */
+ private:
+  template <class Char>
+  struct LineTable;
+
   /**
    * Split a text into a list of strings.  Reduce the texts to a string of
-   * hashes where each Unicode character represents one line.
+   * hashes where each 32-bit character represents one line, so that any
+   * number of unique lines up to 2^32 - 1 can be encoded.
    * @param text String to encode.
-   * @param lineArray List of unique strings.
-   * @param lineHash Map of strings to indices.
+   * @param text_size Size of text.
+   * @param lineTable Unique lines, receiving those of text.  The text must
+   *     outlive it.
+   * @param lineStarts Receives the offset of each line within text, followed
+   *     by text_size.
    * @return Encoded string.
    */
  private:
-  std::wstring diff_linesToCharsMunge(
-      const std::wstring &text, std::vector<std::wstring> &lineArray,
-      std::unordered_map<std::wstring, std::size_t> &lineHash) const;
+  template <class Char>
+  std::u32string diff_linesToCharsMunge(
+      const Char *text, std::size_t text_size, LineTable<Char> &lineTable,
+      std::vector<std::size_t> &lineStarts) const;
 
   /**
    * Rehydrate the text in a diff from a string of line hashes to real lines of
@@ -322,6 +944,17 @@ class diff_match_patch {
   std::size_t diff_commonOverlap(const std::wstring &text1,
                                  const std::wstring &text2);
 
+  /**
+   * Location of a common substring: it starts at start1 in the first text and
+   * at start2 in the second one.
+   */
+ private:
+  struct HalfMatch {
+    std::size_t start1;
+    std::size_t start2;
+    std::size_t size;
+  };
+
   /**
    * Do the two texts share a substring which is at least half the size of
    * the longer text?
@@ -335,21 +968,28 @@ class diff_match_patch {
  protected:
   std::vector<std::wstring> diff_halfMatch(const std::wstring &text1,
                                            const std::wstring &text2);
+ private:
+  template <class Char>
+  bool diff_halfMatch(const Char *text1, std::size_t text1_size,
+                      const Char *text2, std::size_t text2_size,
+                      HalfMatch &hm);
 
   /**
    * Does a substring of shorttext exist within longtext such that the
    * substring is at least half the size of longtext?
    * @param longtext Longer string.
+   * @param longtext_size Size of longtext.
    * @param shorttext Shorter string.
+   * @param shorttext_size Size of shorttext.
    * @param i Start index of quarter size substring within longtext.
-   * @return Five element String array, containing the prefix of longtext, the
-   *     suffix of longtext, the prefix of shorttext, the suffix of shorttext
-   *     and the common middle.  Or null if there was no match.
+   * @param hm Receives the common middle, start1 being within longtext.
+   * @return True if there was a match.
    */
  private:
-  std::vector<std::wstring> diff_halfMatchI(const std::wstring &longtext,
-                                            const std::wstring &shorttext,
-                                            std::size_t i);
+  template <class Char>
+  bool diff_halfMatchI(const Char *longtext, std::size_t longtext_size,
+                       const Char *shorttext, std::size_t shorttext_size,
+                       std::size_t i, HalfMatch &hm);
 
   /**
    * Reduce the number of edits by eliminating semantically trivial equalities.
@@ -357,6 +997,11 @@ class diff_match_patch {
    */
  public:
   void diff_cleanupSemantic(std::list<Diff> &diffs);
+  void diff_cleanupSemantic(FlatDiffs &diffs);
+  void diff_cleanupSemantic(Utf8Diffs &diffs);
+ private:
+  template <class Char>
+  void diff_cleanupSemanticFlat(BasicFlatDiffs<Char> &diffs);
 
   /**
    * Look for single edits surrounded on both sides by equalities
@@ -366,6 +1011,11 @@ class diff_match_patch {
    */
  public:
   void diff_cleanupSemanticLossless(std::list<Diff> &diffs);
+  void diff_cleanupSemanticLossless(FlatDiffs &diffs);
+  void diff_cleanupSemanticLossless(Utf8Diffs &diffs);
+ private:
+  template <class Char>
+  void diff_cleanupSemanticLosslessFlat(BasicFlatDiffs<Char> &diffs);
 
   /**
    * Given two strings, compute a score representing whether the internal
@@ -378,6 +1028,9 @@ class diff_match_patch {
  private:
   int diff_cleanupSemanticScore(const std::wstring &one,
                                 const std::wstring &two);
+  template <class Char>
+  int diff_cleanupSemanticScore(const Char *one, std::size_t one_size,
+                                const Char *two, std::size_t two_size);
 
   /**
    * Reduce the number of edits by eliminating operationally trivial equalities.
@@ -385,6 +1038,11 @@ class diff_match_patch {
    */
  public:
   void diff_cleanupEfficiency(std::list<Diff> &diffs);
+  void diff_cleanupEfficiency(FlatDiffs &diffs);
+  void diff_cleanupEfficiency(Utf8Diffs &diffs);
+ private:
+  template <class Char>
+  void diff_cleanupEfficiencyFlat(BasicFlatDiffs<Char> &diffs);
 
   /**
    * Reorder and merge like edit sections.  Merge equalities.
@@ -393,6 +1051,21 @@ class diff_match_patch {
    */
  public:
   void diff_cleanupMerge(std::list<Diff> &diffs);
+  void diff_cleanupMerge(FlatDiffs &diffs);
+  void diff_cleanupMerge(Utf8Diffs &diffs);
+ private:
+  template <class Char>
+  void diff_cleanupMergeFlat(BasicFlatDiffs<Char> &diffs);
+
+  /**
+   * Move the boundaries of a UTF-8 diff onto code point boundaries: each
+   * equality shrinks to the code points it fully covers, and the edits in
+   * between are rebuilt as one deletion and one insertion wherever an
+   * equality moved.
+   * @param diffs Utf8Diffs between two valid UTF-8 texts.
+   */
+ private:
+  void diff_alignUtf8(Utf8Diffs &diffs);
 
   /**
    * loc is a location in text1, compute and return the equivalent location in
@@ -404,6 +1077,7 @@ class diff_match_patch {
    */
  public:
   std::size_t diff_xIndex(const std::list<Diff> &diffs, std::size_t loc);
+  std::size_t diff_xIndex(const FlatDiffs &diffs, std::size_t loc);
 
   /**
    * Convert a Diff list into a pretty HTML report.
@@ -422,6 +1096,7 @@ class diff_match_patch {
  public:
   std::string diff_text1(const std::list<Diff> &diffs);
   std::wstring diff_wideText1(const std::list<Diff> &diffs);
+  std::wstring diff_wideText1(const FlatDiffs &diffs);
 
   /**
    * Compute and return the destination text (all equalities and insertions).
@@ -431,6 +1106,7 @@ class diff_match_patch {
  public:
   std::string diff_text2(const std::list<Diff> &diffs);
   std::wstring diff_wideText2(const std::list<Diff> &diffs);
+  std::wstring diff_wideText2(const FlatDiffs &diffs);
 
   /**
    * Compute the Levenshtein distance; the number of inserted, deleted or
@@ -440,6 +1116,20 @@ class diff_match_patch {
    */
  public:
   std::size_t diff_levenshtein(const std::list<Diff> &diffs);
+  std::size_t diff_levenshtein(const FlatDiffs &diffs);
+
+  /**
+   * Compute the Levenshtein distance between two texts directly, with bit
+   * vectors covering 64 characters of the shorter text per word (Myers 1999,
+   * Hyyrö 2003), without diffing them first.  This is the true edit
+   * distance, at most the one of any diff between the texts.
+   * @param text1 Old string.
+   * @param text2 New string.
+   * @return Number of changes.
+   */
+ public:
+  std::size_t diff_levenshtein(const std::wstring &text1,
+                               const std::wstring &text2);
 
   /**
    * Crush the diff into an encoded string which describes the operations
@@ -452,6 +1142,8 @@ class diff_match_patch {
  public:
   std::string diff_toDelta(const std::list<Diff> &diffs);
   std::wstring diff_toWideDelta(const std::list<Diff> &diffs);
+  std::string diff_toDelta(const FlatDiffs &diffs);
+  std::wstring diff_toWideDelta(const FlatDiffs &diffs);
 
   /**
    * Given the original text1, and an encoded string which describes the
@@ -483,9 +1175,78 @@ class diff_match_patch {
   std::size_t match_main(const std::wstring &text, const std::wstring &pattern,
                          std::size_t loc);
 
+  /**
+   * Locate the best instance of 'pattern' in the UTF-8 'text' near 'loc',
+   * working on bytes rather than decoding the text.  loc and the result are
+   * byte offsets, the result being the start of a code point, and the
+   * Match_MaxBits limit on the pattern counts bytes.
+   * Returns std::string::npos if no match found.
+   * @param text The text to search.
+   * @param pattern The pattern to search for.
+   * @param loc The location to search around.
+   * @return Best match index or std::string::npos.
+   */
+ public:
+  std::size_t match_mainUtf8(const std::string &text,
+                             const std::string &pattern, std::size_t loc);
+
+  /**
+   * Locate the best instance of 'pattern' in the indexed text near 'loc',
+   * with the same result as match_main on the text itself.  The exact-match
+   * speedup looks up the pattern's rarest gram rather than scanning the text,
+   * and by the q-gram lemma Bitap only runs around the places sharing enough
+   * grams with the pattern to hold a match.  Searches going on to error
+   * levels where the lemma no longer rules anything out (beyond (m - q) / q
+   * errors for a pattern of m characters), or where the pattern's grams are
+   * common enough to be everywhere, run Bitap over the whole window as
+   * match_main does.
+   * @param index Index of the text to search.
+   * @param pattern The pattern to search for.
+   * @param loc The location to search around.
+   * @return Best match index or std::wstring::npos.
+   */
+ public:
+  std::size_t match_main(const MatchIndex &index, const std::wstring &pattern,
+                         std::size_t loc);
+
+  /**
+   * Locate the best instance of each of many patterns in one text, each near
+   * its own location, with the same results as one match_main per query.
+   * Patterns of up to 64 characters whose search windows overlap are packed
+   * side by side into the lanes of a bit vector of a few words, and found
+   * in one shared Bitap pass over the union of their windows, with one
+   * alphabet for all of them.  The exact-match speedup only searches as far
+   * from each location as a match could still score within Match_Threshold.
+   * @param text The text to search.
+   * @param queries Patterns to search for, each with the location to search
+   *     around.
+   * @return Best match index or std::wstring::npos, for each query.
+   */
+ public:
+  std::vector<std::size_t> match_mainBatch(
+      const std::wstring &text,
+      const std::vector<std::pair<std::wstring, std::size_t> > &queries);
+
+  /**
+   * One pattern of a shared Bitap pass, with its search state.
+   */
+ private:
+  struct BitapLane;
+
+  /**
+   * Run Bitap for many patterns at once, as match_bitap does for each.
+   * @param text The text to search.
+   * @param lanes The patterns, each at most 64 characters, with their
+   *     locations; receive their best match index.
+   */
+ private:
+  void match_bitapLanes(const std::wstring &text,
+                        std::vector<BitapLane> &lanes);
+
   /**
    * Locate the best instance of 'pattern' in 'text' near 'loc' using the
-   * Bitap algorithm.  Returns std::wstring::npos if no match found.
+   * Bitap algorithm, with rows of as many 64-bit words as the pattern needs.
+   * Returns std::wstring::npos if no match found.
    * @param text The text to search.
    * @param pattern The pattern to search for.
    * @param loc The location to search around.
@@ -494,27 +1255,68 @@ class diff_match_patch {
  protected:
   std::size_t match_bitap(const std::wstring &text, const std::wstring &pattern,
                           std::size_t loc);
+ private:
+  template <class Char>
+  std::size_t match_bitap(const Char *text, std::size_t text_size,
+                          const Char *pattern, std::size_t pattern_size,
+                          std::size_t loc);
+
+  /**
+   * The Bitap search of match_bitap, once any exact match nearby has
+   * lowered the score threshold.
+   * @param text The text to search.
+   * @param text_size Size of the text.
+   * @param pattern The pattern to search for.
+   * @param pattern_size Size of the pattern.
+   * @param loc The location to search around.
+   * @param score_threshold Highest score beyond which to give up.
+   * @return Best match index or std::wstring::npos.
+   */
+ private:
+  template <class Char>
+  std::size_t match_bitapScan(const Char *text, std::size_t text_size,
+                              const Char *pattern, std::size_t pattern_size,
+                              std::size_t loc, double score_threshold);
+
+  /**
+   * Locate the best instance of 'pattern' in the indexed text near 'loc'
+   * using the Bitap algorithm, only on the rows where the q-gram filter
+   * allows a match.
+   * @param index Index of the text to search.
+   * @param pattern The pattern to search for.
+   * @param loc The location to search around.
+   * @return Best match index or std::wstring::npos.
+   */
+ private:
+  std::size_t match_bitapIndexed(const MatchIndex &index,
+                                 const std::wstring &pattern, std::size_t loc);
 
   /**
    * Compute and return the score for a match with e errors and x location.
    * @param e Number of errors in match.
    * @param x Location of match.
    * @param loc Expected location of match.
-   * @param pattern Pattern being sought.
+   * @param pattern_size Size of the pattern being sought.
    * @return Overall score for match (0.0 = good, 1.0 = bad).
    */
  private:
   double match_bitapScore(std::size_t e, std::size_t x, std::size_t loc,
-                          const std::wstring &pattern);
+                          std::size_t pattern_size);
 
   /**
-   * Initialise the alphabet for the Bitap algorithm.
+   * Initialise the alphabet for the Bitap algorithm, for patterns of up to
+   * 64 characters.  match_bitap itself uses flat tables of masks, without
+   * hashing.
    * @param pattern The text to encode.
    * @return Hash of character locations.
    */
  protected:
   std::unordered_map<wchar_t, std::size_t> match_alphabet(
       const std::wstring &pattern);
+ private:
+  template <class Char>
+  std::unordered_map<Char, std::size_t> match_alphabet(
+      const Char *pattern, std::size_t pattern_size);
 
   //  PATCH FUNCTIONS
 
@@ -548,6 +1350,32 @@ class diff_match_patch {
    */
  public:
   std::list<Patch> patch_make(const std::list<Diff> &diffs);
+  std::list<Patch> patch_make(const FlatDiffs &diffs);
+  std::list<Patch> patch_make(const Utf8Diffs &diffs);
+
+  /**
+   * Compute a list of patches to turn one UTF-8 file into another.
+   * The files are diffed in place by diff_mainFiles, and only the changed
+   * parts and their context are decoded into the patches.
+   * @param file1 Old file.
+   * @param file2 New file.
+   * @return LinkedList of Patch objects.
+   */
+ public:
+  std::list<Patch> patch_makeFiles(const MappedFile &file1,
+                                   const MappedFile &file2);
+
+  /**
+   * Compute a list of patches from a diff between attached texts.  The
+   * rolling context of each patch is read from the new text up to the
+   * previous patch and the old text after it, without rebuilding either.
+   * Offsets of the patches count wide characters, whatever the code unit.
+   * @param diffs Diff between two texts.
+   * @return LinkedList of Patch objects.
+   */
+ private:
+  template <class Char>
+  std::list<Patch> patch_makeFlat(const BasicFlatDiffs<Char> &diffs);
 
   /**
    * Compute a list of patches to turn text1 into text2.
@@ -580,6 +1408,8 @@ class diff_match_patch {
                               const std::list<Diff> &diffs);
   std::list<Patch> patch_make(const std::wstring &text1,
                               const std::list<Diff> &diffs);
+  std::list<Patch> patch_make(const std::wstring &text1,
+                              const FlatDiffs &diffs);
 
   /**
    * Given an array of patches, return another array that is identical.
@@ -603,6 +1433,36 @@ class diff_match_patch {
   std::pair<std::string, std::vector<bool> > patch_apply(
       const std::list<Patch> &patches, const std::string &text);
 
+  /**
+   * Where a patch matched in a text, and the edit which applies it there.
+   */
+ private:
+  struct PatchEdit;
+
+  /**
+   * Locate a patch in the text near its expected location, as patch_apply
+   * does, and work out the edit applying it makes, leaving the text as is.
+   * @param patch The patch to apply.
+   * @param text The text to apply it to.
+   * @param expected_loc Where the patch is expected in the text.
+   * @param edit Receives where the patch matched and its edit.
+   */
+ private:
+  void patch_locate(const Patch &patch, const std::wstring &text,
+                    std::size_t expected_loc, PatchEdit &edit);
+
+  /**
+   * Apply padded and split patches one after the other, keeping their edits
+   * aside and splicing them into the text once, and locating them on
+   * Patch_Threads threads.
+   * @param patches The patches to apply.
+   * @param text The padded text, which receives the patched one.
+   * @param results Receives whether each patch was applied.
+   */
+ private:
+  void patch_applyPieces(const std::list<Patch> &patches, std::wstring &text,
+                         std::vector<bool> &results);
+
   /**
    * Add some padding on text start and end so that edges can match something.
    * Intended to be called only from within patch_apply.
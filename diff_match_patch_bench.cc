@@ -0,0 +1,699 @@
+/*
+ * Copyright 2008 Google Inc. All Rights Reserved.
+ * Author: fraser@google.com (Neil Fraser)
+ * Author: mikeslemmer@gmail.com (Mike Slemmer)
+ * Author: quentinfiard@gmail.com (Quentin Fiard)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Diff Match and Patch -- Benchmarks
+ * http://code.google.com/p/google-diff-match-patch/
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <codecvt>
+#include <cstdlib>
+#include <cwctype>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <locale>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "diff_match_patch.h"
+
+namespace {
+
+// Command line settings.
+struct Options {
+  // Shortest time each benchmark runs for, in seconds.
+  double min_time;
+  // Only run the benchmarks whose name contains this.
+  std::string filter;
+  // Print JSON rather than a table on stdout.
+  bool json;
+  // File to write JSON to as well as the table, empty for none.
+  std::string json_path;
+  // Files to diff with each algorithm, as in the other ports' speed tests.
+  std::vector<std::string> files;
+};
+
+// One benchmark's measurement.
+struct Result {
+  std::string name;
+  // Extra information about the workload, e.g. the size of its diff.
+  std::string detail;
+  // Input one call reads.
+  double bytes;
+  std::size_t calls;
+  double seconds;
+};
+
+std::string JsonEscape(const std::string &text) {
+  std::string escaped;
+  for (const char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      std::ostringstream code;
+      code << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+           << static_cast<int>(c);
+      escaped += code.str();
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// Runs benchmarks and collects their results.  Benchmark names are
+// "operation/corpus/size/edits" and stay the same between releases, so that
+// reports can be compared.
+class Benchmark {
+ public:
+  explicit Benchmark(const Options &options) : options_(options) {}
+
+  // Is the benchmark selected by the filter?  Workloads which are expensive
+  // to build check this first.
+  bool Selected(const std::string &name) const {
+    return name.find(options_.filter) != std::string::npos;
+  }
+
+  // Runs the function until at least min_time has passed and reports its
+  // throughput, 'bytes' being the amount of input one call reads.
+  void Run(const std::string &name, double bytes,
+           const std::function<void()> &function,
+           const std::string &detail = "") {
+    if (!Selected(name)) {
+      return;
+    }
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    Result result = {name, detail, bytes, 0, 0};
+    do {
+      function();
+      result.calls++;
+      result.seconds =
+          std::chrono::duration<double>(Clock::now() - start).count();
+    } while (result.seconds < options_.min_time);
+    results_.push_back(result);
+    if (!options_.json) {
+      std::cout << std::left << std::setw(44) << name << std::right
+                << std::setw(12) << std::fixed << std::setprecision(1)
+                << bytes * result.calls / result.seconds / 1e6 << " MB/s"
+                << std::setw(14) << std::setprecision(1)
+                << result.seconds / result.calls * 1e6 << " us/call"
+                << (detail.empty() ? "" : "  (" + detail + ")") << std::endl;
+    }
+  }
+
+  void WriteJson(std::ostream &out) const {
+    out << "{\n  \"benchmark\": \"diff_match_patch_bench\",\n"
+        << "  \"min_time\": " << options_.min_time << ",\n"
+        << "  \"results\": [";
+    for (std::size_t i = 0; i < results_.size(); i++) {
+      const Result &result = results_[i];
+      out << (i == 0 ? "\n" : ",\n") << "    {\"name\": \""
+          << JsonEscape(result.name) << "\", \"detail\": \""
+          << JsonEscape(result.detail) << "\", \"bytes\": " << std::fixed
+          << std::setprecision(0) << result.bytes
+          << ", \"calls\": " << result.calls << ", \"seconds\": "
+          << std::setprecision(6) << result.seconds
+          << ", \"us_per_call\": " << std::setprecision(3)
+          << result.seconds / result.calls * 1e6
+          << ", \"mb_per_second\": " << std::setprecision(3)
+          << result.bytes * result.calls / result.seconds / 1e6 << "}";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+ private:
+  const Options &options_;
+  std::vector<Result> results_;
+};
+
+// Keeps the compiler from optimizing a result away.
+volatile std::size_t sink;
+
+// Linear congruential generator, so that every run sees the same workloads.
+class Random {
+ public:
+  explicit Random(uint32_t seed) : state_(seed) {}
+
+  uint32_t Next() {
+    state_ = state_ * 1103515245u + 12345u;
+    return (state_ >> 16) & 0x7fff;
+  }
+
+  std::size_t Below(std::size_t bound) { return Next() % bound; }
+
+ private:
+  uint32_t state_;
+};
+
+// Deterministic pseudo-random text over a small alphabet.
+std::wstring RandomText(std::size_t size, uint32_t seed) {
+  std::wstring text(size, L' ');
+  for (auto &c : text) {
+    seed = seed * 1103515245u + 12345u;
+    c = L"abcd"[(seed >> 16) % 4];
+  }
+  return text;
+}
+
+// Copy of text with an edit every 'spacing' characters.
+std::wstring Edit(const std::wstring &text, std::size_t spacing) {
+  std::wstring edited = text;
+  for (std::size_t i = spacing / 2; i < edited.size(); i += spacing) {
+    edited[i] = L'x';
+  }
+  return edited;
+}
+
+// English-like prose of about 'size' characters: sentences of common words,
+// one paragraph per line.
+std::wstring ProseText(std::size_t size, uint32_t seed) {
+  static const wchar_t *const kWords[] = {
+      L"the",     L"of",      L"and",    L"to",     L"in",     L"a",
+      L"is",      L"that",    L"for",    L"it",     L"as",     L"was",
+      L"with",    L"be",      L"by",     L"on",     L"not",    L"he",
+      L"this",    L"are",     L"or",     L"his",    L"from",   L"at",
+      L"which",   L"but",     L"have",   L"an",     L"had",    L"they",
+      L"you",     L"were",    L"their",  L"one",    L"all",    L"we",
+      L"can",     L"her",     L"has",    L"there",  L"been",   L"if",
+      L"more",    L"when",    L"will",   L"would",  L"who",    L"so",
+      L"king",    L"castle",  L"ghost",  L"night",  L"sword",  L"letter",
+      L"river",   L"morning", L"silver", L"promise", L"winter", L"garden"};
+  const std::size_t word_count = sizeof(kWords) / sizeof(kWords[0]);
+  Random random(seed);
+  std::wstring text;
+  while (text.size() < size) {
+    const std::size_t sentences = 2 + random.Below(6);
+    for (std::size_t s = 0; s < sentences; s++) {
+      const std::size_t words = 4 + random.Below(12);
+      for (std::size_t w = 0; w < words; w++) {
+        std::wstring word = kWords[random.Below(word_count)];
+        if (w == 0) {
+          word[0] = towupper(word[0]);
+        }
+        text += word;
+        text += w + 1 == words ? (random.Below(8) == 0 ? L"? " : L". ")
+                               : (random.Below(10) == 0 ? L", " : L" ");
+      }
+    }
+    text.back() = L'\n';
+  }
+  return text;
+}
+
+// Source file of about 'size' characters of C-like functions, with braces
+// and blank lines repeated throughout as in real code.
+std::wstring CodeText(std::size_t size, uint32_t seed) {
+  Random random(seed);
+  std::wstring text;
+  for (std::size_t f = 0; text.size() < size; f++) {
+    text += L"int function" + std::to_wstring(f) + L"(int x) {\n";
+    const std::size_t statements = 1 + random.Below(6);
+    for (std::size_t s = 0; s < statements; s++) {
+      text += L"  if (x > " + std::to_wstring(random.Below(100)) + L") {\n";
+      text += L"    x = helper" + std::to_wstring(random.Below(50)) + L"(x);\n";
+      text += L"  }\n";
+    }
+    text += L"  return x;\n}\n\n";
+  }
+  return text;
+}
+
+// Server log of about 'size' characters: one timestamped line per request,
+// most of each line the same as its neighbours'.
+std::wstring LogText(std::size_t size, uint32_t seed) {
+  static const wchar_t *const kLevels[] = {L"INFO ", L"INFO ", L"INFO ",
+                                           L"DEBUG", L"WARN ", L"ERROR"};
+  static const wchar_t *const kPaths[] = {L"/api/v1/items", L"/api/v1/users",
+                                          L"/api/v1/orders", L"/healthz",
+                                          L"/static/app.js"};
+  Random random(seed);
+  std::wstring text;
+  std::size_t millis = 0;
+  while (text.size() < size) {
+    millis += random.Below(500);
+    const std::size_t seconds = millis / 1000;
+    std::wostringstream line;
+    line << L"2024-03-01T" << std::setfill(L'0') << std::setw(2)
+         << seconds / 3600 % 24 << L':' << std::setw(2) << seconds / 60 % 60
+         << L':' << std::setw(2) << seconds % 60 << L'.' << std::setw(3)
+         << millis % 1000 << L"Z " << kLevels[random.Below(6)] << L" [worker-"
+         << random.Below(8) << L"] " << kPaths[random.Below(5)] << L'/'
+         << random.Below(10000) << L" status=" << (random.Below(20) ? 200 : 500)
+         << L" latency_ms=" << random.Below(300) << L'\n';
+    text += line.str();
+  }
+  return text;
+}
+
+// Chinese-like text of about 'size' characters: common CJK ideographs with
+// full-width punctuation, a line per paragraph.
+std::wstring CjkText(std::size_t size, uint32_t seed) {
+  Random random(seed);
+  std::wstring text;
+  while (text.size() < size) {
+    const std::size_t clauses = 2 + random.Below(6);
+    for (std::size_t c = 0; c < clauses; c++) {
+      const std::size_t characters = 3 + random.Below(12);
+      for (std::size_t i = 0; i < characters; i++) {
+        // The 1500 ideographs after U+4E00 include most common ones.
+        text += static_cast<wchar_t>(0x4E00 + random.Below(1500));
+      }
+      text += c + 1 == clauses ? L'。' : L'，';
+    }
+    text += L'\n';
+  }
+  return text;
+}
+
+// Next revision of a text: on average one line in 'spacing' is deleted,
+// rewritten in part or followed by a new line.  The last line is edited if no
+// other one was.
+std::wstring Revise(const std::wstring &text, std::size_t spacing,
+                    uint32_t seed) {
+  Random random(seed);
+  std::wstring revised;
+  std::size_t line_start = 0;
+  bool edited = false;
+  while (line_start < text.size()) {
+    std::size_t line_end = text.find(L'\n', line_start);
+    line_end = line_end == std::wstring::npos ? text.size() : line_end + 1;
+    std::wstring line = text.substr(line_start, line_end - line_start);
+    line_start = line_end;
+    if (random.Below(spacing) != 0 && (edited || line_end < text.size())) {
+      revised += line;
+      continue;
+    }
+    edited = true;
+    switch (random.Below(3)) {
+      case 0:
+        break;  // Deleted.
+      case 1: {
+        // Characters of the line itself, so that the edit fits the corpus.
+        const std::size_t edits = 1 + random.Below(3);
+        for (std::size_t e = 0; e < edits && line.size() > 1; e++) {
+          const std::size_t pos = random.Below(line.size() - 1);
+          const std::size_t length = 1 + random.Below(8);
+          line.replace(pos, std::min(length, line.size() - 1 - pos),
+                       line.substr(random.Below(line.size() - 1), 1 + e));
+        }
+        revised += line;
+        break;
+      }
+      default:
+        revised += line;
+        revised += line.substr(line.size() / 2);
+        break;
+    }
+  }
+  return revised;
+}
+
+std::wstring ReadFile(const std::string &path) {
+  std::ifstream in(path.c_str(), std::ios::binary);
+  if (!in) {
+    std::cerr << "Cannot read " << path << std::endl;
+    std::exit(1);
+  }
+  std::stringstream bytes;
+  bytes << in.rdbuf();
+  std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t> unicode_encoder;
+  return unicode_encoder.from_bytes(bytes.str());
+}
+
+// Diffs two texts with each algorithm.  The edit count shows how far from
+// minimal the faster algorithms are.
+void RunAlgorithms(Benchmark &benchmark, diff_match_patch &dmp,
+                   const std::string &workload, const std::wstring &text1,
+                   const std::wstring &text2) {
+  const struct {
+    DiffAlgorithm algorithm;
+    const char *name;
+  } algorithms[] = {{MYERS, "myers"},
+                    {PATIENCE, "patience"},
+                    {HISTOGRAM, "histogram"},
+                    {BIT_PARALLEL, "bit-parallel"}};
+  for (const auto &algorithm : algorithms) {
+    const std::string name =
+        "diff_main/" + workload + "/" + algorithm.name;
+    if (!benchmark.Selected(name)) {
+      continue;
+    }
+    dmp.Diff_Algorithm = algorithm.algorithm;
+    const std::size_t edits =
+        dmp.diff_levenshtein(dmp.diff_main(text1, text2, true));
+    benchmark.Run(name, (text1.size() + text2.size()) * sizeof(wchar_t),
+                  [&] { sink = dmp.diff_main(text1, text2, true).size(); },
+                  std::to_string(edits) + " edits");
+  }
+  dmp.Diff_Algorithm = MYERS;
+}
+
+// Runs every operation on a pair of revisions of one corpus.  Character
+// mode diffs of large, heavily edited texts take minutes, so unless
+// 'complete' is set they are left out.
+void RunPair(Benchmark &benchmark, diff_match_patch &dmp,
+             const std::string &workload, const std::wstring &text1,
+             const std::wstring &text2, bool complete) {
+  const double bytes = (text1.size() + text2.size()) * sizeof(wchar_t);
+  if (complete) {
+    benchmark.Run("diff_main/" + workload, bytes, [&] {
+      sink = dmp.diff_main(text1, text2, false).size();
+    });
+  }
+  benchmark.Run("diff_main_lines/" + workload, bytes, [&] {
+    sink = dmp.diff_main(text1, text2, true).size();
+  });
+
+  const std::list<Diff> diffs = dmp.diff_main(text1, text2, true);
+  const std::string detail = std::to_string(diffs.size()) + " diffs";
+  benchmark.Run("diff_cleanupSemantic/" + workload, bytes,
+                [&] {
+                  std::list<Diff> copy = diffs;
+                  dmp.diff_cleanupSemantic(copy);
+                  sink = copy.size();
+                },
+                detail);
+
+  benchmark.Run("diff_toDelta/" + workload, bytes,
+                [&] { sink = dmp.diff_toDelta(diffs).size(); }, detail);
+  const std::wstring delta = dmp.diff_toWideDelta(diffs);
+  benchmark.Run("diff_fromDelta/" + workload,
+                (text1.size() + delta.size()) * sizeof(wchar_t),
+                [&] { sink = dmp.diff_fromDelta(text1, delta).size(); },
+                detail);
+
+  benchmark.Run("patch_make/" + workload, bytes,
+                [&] { sink = dmp.patch_make(text1, diffs).size(); }, detail);
+  const std::list<Patch> patches = dmp.patch_make(text1, diffs);
+  const std::string patch_detail = std::to_string(patches.size()) + " patches";
+  benchmark.Run("patch_toText/" + workload, bytes,
+                [&] { sink = dmp.patch_toText(patches).size(); },
+                patch_detail);
+  const std::string patch_text = dmp.patch_toText(patches);
+  benchmark.Run("patch_fromText/" + workload, patch_text.size(),
+                [&] { sink = dmp.patch_fromText(patch_text).size(); },
+                patch_detail);
+  benchmark.Run("patch_apply/" + workload, bytes,
+                [&] { sink = dmp.patch_apply(patches, text1).first.size(); },
+                patch_detail);
+  // Onto a copy of text1 which has drifted meanwhile, so that the patches
+  // are found by fuzzy matches rather than at their expected locations.
+  const std::wstring drifted = Revise(text1, 50, 99);
+  benchmark.Run("patch_apply_drifted/" + workload, bytes,
+                [&] { sink = dmp.patch_apply(patches, drifted).first.size(); },
+                patch_detail);
+  // Both again with the patches located on four threads.
+  dmp.Patch_Threads = 4;
+  benchmark.Run("patch_apply_parallel/" + workload, bytes,
+                [&] { sink = dmp.patch_apply(patches, text1).first.size(); },
+                patch_detail);
+  benchmark.Run("patch_apply_drifted_parallel/" + workload, bytes,
+                [&] { sink = dmp.patch_apply(patches, drifted).first.size(); },
+                patch_detail);
+  dmp.Patch_Threads = 1;
+}
+
+// Looks for a mangled 32 character excerpt of the revised text around where
+// it lies, as patch_apply does.
+void RunMatch(Benchmark &benchmark, diff_match_patch &dmp,
+              const std::string &workload, const std::wstring &text1,
+              const std::wstring &text2) {
+  const std::size_t loc = text2.size() / 2;
+  std::wstring pattern = text2.substr(loc, 32);
+  pattern[pattern.size() / 2] = L'#';
+  // Drift from the expected location, as after earlier edits.
+  const std::size_t expected = loc + 200 < text1.size() ? loc + 200 : loc;
+  benchmark.Run("match_main/" + workload, text1.size() * sizeof(wchar_t),
+                [&] { sink = dmp.match_main(text1, pattern, expected); });
+  // The same through an index of the text, built once.
+  const MatchIndex index(text1);
+  benchmark.Run("match_main_indexed/" + workload,
+                text1.size() * sizeof(wchar_t),
+                [&] { sink = dmp.match_main(index, pattern, expected); });
+  benchmark.Run("MatchIndex/" + workload, text1.size() * sizeof(wchar_t),
+                [&] { sink = MatchIndex(text1).q(); });
+
+  // Expected at the start, with a Match_Distance which puts the whole text
+  // in reach but scores the match too far away, so that Bitap scans all of
+  // the text at each error level: the scan rate of match_main.
+  const int distance = dmp.Match_Distance;
+  dmp.Match_Distance = static_cast<int>(text1.size());
+  benchmark.Run("match_main_scan/" + workload, text1.size() * sizeof(wchar_t),
+                [&] { sink = dmp.match_main(text1, pattern, 0); });
+  benchmark.Run("match_main_scan_indexed/" + workload,
+                text1.size() * sizeof(wchar_t),
+                [&] { sink = dmp.match_main(index, pattern, 0); });
+  // Expected an eighth of the text away from where it lies, which is still
+  // close enough to score as a match: a fuzzy anchor search.
+  const std::size_t far = loc - std::min(loc, text1.size() / 8);
+  benchmark.Run("match_main_far/" + workload, text1.size() * sizeof(wchar_t),
+                [&] { sink = dmp.match_main(text1, pattern, far); });
+  benchmark.Run("match_main_far_indexed/" + workload,
+                text1.size() * sizeof(wchar_t),
+                [&] { sink = dmp.match_main(index, pattern, far); });
+  dmp.Match_Distance = distance;
+
+  // Many short mangled excerpts close together, as the patches of a dense
+  // edit are: one match_main each, then all of them in one batch.
+  std::vector<std::pair<std::wstring, std::size_t> > queries;
+  for (std::size_t at = loc; at + 16 <= text2.size() && queries.size() < 32;
+       at += 48) {
+    std::wstring excerpt = text2.substr(at, 16);
+    excerpt[excerpt.size() / 2] = L'#';
+    queries.push_back(std::make_pair(
+        excerpt, at + 200 < text1.size() ? at + 200 : at));
+  }
+  const std::size_t batch_bytes = text1.size() * sizeof(wchar_t);
+  benchmark.Run("match_main_each/" + workload, batch_bytes, [&] {
+    for (const auto &query : queries) {
+      sink = dmp.match_main(text1, query.first, query.second);
+    }
+  });
+  benchmark.Run("match_mainBatch/" + workload, batch_bytes,
+                [&] { sink = dmp.match_mainBatch(text1, queries).size(); });
+}
+
+const char kUsage[] =
+    "Usage: diff_match_patch_bench [--min-time=SECONDS] [--filter=TEXT]\n"
+    "                              [--json | --json=FILE]\n"
+    "                              [old_file new_file]\n"
+    "--min-time  Shortest time each benchmark runs for (default 0.25).\n"
+    "--filter    Only run the benchmarks whose name contains TEXT.\n"
+    "--json      Print the results as JSON rather than a table, or also\n"
+    "            write them to FILE.\n"
+    "The optional files, e.g. the Speedtest1.txt and Speedtest2.txt of the\n"
+    "other ports, are diffed with each algorithm in addition to the\n"
+    "built-in workloads.\n";
+
+bool ParseOptions(int argc, char **argv, Options &options) {
+  options.min_time = 0.25;
+  options.json = false;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.compare(0, 11, "--min-time=") == 0) {
+      options.min_time = std::atof(arg.c_str() + 11);
+    } else if (arg.compare(0, 9, "--filter=") == 0) {
+      options.filter = arg.substr(9);
+    } else if (arg == "--json") {
+      options.json = true;
+    } else if (arg.compare(0, 7, "--json=") == 0) {
+      options.json_path = arg.substr(7);
+    } else if (arg.compare(0, 2, "--") == 0) {
+      return false;
+    } else {
+      options.files.push_back(arg);
+    }
+  }
+  return options.files.empty() || options.files.size() == 2;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    std::cerr << kUsage;
+    return 2;
+  }
+  Benchmark benchmark(options);
+  diff_match_patch dmp;
+  // Run every diff to completion, so that the work done does not depend on
+  // the speed of the machine.
+  dmp.Diff_Timeout = 0;
+
+  // Long equal runs, as in two revisions of a large document.
+  const std::size_t sizes[] = {1 << 10, 1 << 16, 1 << 22};
+  for (const std::size_t size : sizes) {
+    const std::wstring text1(size, L'x');
+    const std::wstring text2 = text1;
+    const double bytes = 2.0 * size * sizeof(wchar_t);
+    const std::string suffix = "/equal/" + std::to_string(size);
+    benchmark.Run("diff_commonPrefix" + suffix, bytes,
+                  [&] { sink = dmp.diff_commonPrefix(text1, text2); });
+    benchmark.Run("diff_commonSuffix" + suffix, bytes,
+                  [&] { sink = dmp.diff_commonSuffix(text1, text2); });
+  }
+
+  // Pure Myers diffs, with long and with short diagonals.
+  const std::wstring base = RandomText(1 << 16, 1);
+  const std::wstring sparse = Edit(base, 4096);
+  benchmark.Run("diff_main/random/long-diagonals",
+                2.0 * base.size() * sizeof(wchar_t),
+                [&] { sink = dmp.diff_main(base, sparse, false).size(); });
+  const std::string base_utf8(base.begin(), base.end());
+  const std::string sparse_utf8(sparse.begin(), sparse.end());
+  benchmark.Run("diff_mainUtf8/random/long-diagonals", 2.0 * base_utf8.size(),
+                [&] {
+                  sink =
+                      dmp.diff_mainUtf8(base_utf8, sparse_utf8, false).size();
+                });
+  const std::wstring other = RandomText(1 << 11, 2);
+  const std::wstring short_base = base.substr(0, other.size());
+  benchmark.Run(
+      "diff_main/random/short-diagonals", 2.0 * other.size() * sizeof(wchar_t),
+      [&] { sink = dmp.diff_main(short_base, other, false).size(); });
+
+  // Windows of 32 characters, like the ones patch_apply re-diffs, with the
+  // bisecting and the bit-parallel engines, and their Levenshtein distance
+  // with and without a diff.
+  const std::wstring dense = Edit(base, 8);
+  std::vector<std::pair<std::wstring, std::wstring> > windows;
+  for (std::size_t i = 0; i + 32 <= base.size(); i += 64) {
+    windows.push_back(std::make_pair(base.substr(i, 32), dense.substr(i, 32)));
+  }
+  const double window_bytes = 64.0 * windows.size() * sizeof(wchar_t);
+  const struct {
+    DiffAlgorithm algorithm;
+    const char *name;
+  } window_engines[] = {{MYERS, "myers"}, {BIT_PARALLEL, "bit-parallel"}};
+  for (const auto &engine : window_engines) {
+    dmp.Diff_Algorithm = engine.algorithm;
+    benchmark.Run(std::string("diff_main/windows/") + engine.name,
+                  window_bytes, [&] {
+                    for (const auto &window : windows) {
+                      sink = dmp.diff_main(window.first, window.second, false)
+                                 .size();
+                    }
+                  });
+  }
+  dmp.Diff_Algorithm = MYERS;
+  benchmark.Run("diff_levenshtein/windows/diffs", window_bytes, [&] {
+    for (const auto &window : windows) {
+      sink = dmp.diff_levenshtein(
+          dmp.diff_main(window.first, window.second, false));
+    }
+  });
+  benchmark.Run("diff_levenshtein/windows/texts", window_bytes, [&] {
+    for (const auto &window : windows) {
+      sink = dmp.diff_levenshtein(window.first, window.second);
+    }
+  });
+
+  // Every operation on each corpus, at each size, lightly and heavily
+  // edited.
+  const struct {
+    const char *name;
+    std::wstring (*generate)(std::size_t, uint32_t);
+  } corpora[] = {{"prose", ProseText},
+                 {"code", CodeText},
+                 {"logs", LogText},
+                 {"cjk", CjkText}};
+  const struct {
+    const char *name;
+    std::size_t size;
+  } text_sizes[] = {
+      {"small", 1 << 10}, {"medium", 1 << 16}, {"large", 1 << 20}};
+  const struct {
+    const char *name;
+    std::size_t spacing;
+  } edits[] = {{"light", 200}, {"heavy", 10}};
+  uint32_t seed = 1;
+  for (const auto &corpus : corpora) {
+    for (const auto &text_size : text_sizes) {
+      const std::string prefix =
+          std::string(corpus.name) + "/" + text_size.name + "/";
+      const std::wstring text1 = corpus.generate(text_size.size, seed++);
+      for (const auto &edit : edits) {
+        const std::wstring text2 = Revise(text1, edit.spacing, seed++);
+        RunPair(benchmark, dmp, prefix + edit.name, text1, text2,
+                text_size.size < (1 << 20) || edit.spacing > 100);
+      }
+      RunMatch(benchmark, dmp, prefix + "light", text1,
+               Revise(text1, 200, seed++));
+    }
+  }
+
+  // About a thousand patches to a 5 MB text, which patch_apply used to copy
+  // once per patch.  Expensive workloads have fixed seeds, so that the texts
+  // don't depend on the filter.
+  if (benchmark.Selected("patch_apply/prose/5mb/dense")) {
+    const std::wstring text1 = ProseText(5 << 20, 100);
+    const std::list<Patch> patches =
+        dmp.patch_make(text1, Revise(text1, 25, 101));
+    benchmark.Run("patch_apply/prose/5mb/dense", text1.size() * sizeof(wchar_t),
+                  [&] { sink = dmp.patch_apply(patches, text1).first.size(); },
+                  std::to_string(patches.size()) + " patches");
+  }
+
+  // patch_make on ever larger texts, edited just as often.  Its throughput
+  // only holds steady if it takes time linear in the texts.
+  for (std::size_t megabytes = 1; megabytes <= 4; megabytes *= 2) {
+    const std::string name =
+        "patch_make/prose/" + std::to_string(megabytes) + "mb/dense";
+    if (!benchmark.Selected(name)) {
+      continue;
+    }
+    const uint32_t size_seed = 200 + 2 * static_cast<uint32_t>(megabytes);
+    const std::wstring text1 = ProseText(megabytes << 20, size_seed);
+    const std::wstring text2 = Revise(text1, 25, size_seed + 1);
+    const std::list<Diff> diffs = dmp.diff_main(text1, text2, true);
+    benchmark.Run(name, (text1.size() + text2.size()) * sizeof(wchar_t),
+                  [&] { sink = dmp.patch_make(text1, diffs).size(); },
+                  std::to_string(diffs.size()) + " diffs");
+  }
+
+  // Line mode diffs of code revisions, with each algorithm.
+  const std::wstring code = CodeText(1 << 18, 3);
+  RunAlgorithms(benchmark, dmp, "code/revision/light", code,
+                Revise(code, 40, 4));
+  RunAlgorithms(benchmark, dmp, "code/revision/heavy", code,
+                Revise(code, 3, 5));
+  if (options.files.size() == 2) {
+    RunAlgorithms(benchmark, dmp, "files", ReadFile(options.files[0]),
+                  ReadFile(options.files[1]));
+  }
+
+  if (options.json) {
+    benchmark.WriteJson(std::cout);
+  }
+  if (!options.json_path.empty()) {
+    std::ofstream out(options.json_path.c_str());
+    benchmark.WriteJson(out);
+    if (!out) {
+      std::cerr << "Cannot write " << options.json_path << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -21,6 +21,13 @@
  */
 #include "diff_match_patch.h"
 
+#include <chrono>
+#include <codecvt>
+#include <fstream>
+#include <locale>
+#include <thread>
+#include <type_traits>
+
 #include "gtest/gtest.h"
 
 class TestableDiffMatchPatch : public diff_match_patch {
@@ -42,6 +49,9 @@ class TestableDiffMatchPatch : public diff_match_patch {
 
 namespace {
 
+typedef std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t>
+    UnicodeEncoder;
+
 template <typename T>
 std::wstring AsString(T value) {
   std::wstringstream ss;
@@ -62,6 +72,52 @@ std::vector<std::wstring> diff_rebuildtexts(const std::list<Diff> &diffs) {
   return text;
 }
 
+// Small deterministic generator so that randomized cases are reproducible.
+class TextGenerator {
+ public:
+  explicit TextGenerator(uint32_t seed) : state_(seed) {}
+
+  uint32_t Next() {
+    state_ = state_ * 1103515245u + 12345u;
+    return (state_ >> 16) & 0x7fff;
+  }
+
+  std::wstring Text(const std::wstring &alphabet, std::size_t max_size) {
+    std::wstring text;
+    const std::size_t size = Next() % (max_size + 1);
+    for (std::size_t i = 0; i < size; i++) {
+      text += alphabet[Next() % alphabet.size()];
+    }
+    return text;
+  }
+
+  // Returns a copy of text with a few random edits.
+  std::wstring Mutate(const std::wstring &text, const std::wstring &alphabet) {
+    std::wstring result = text;
+    const int edits = 1 + Next() % 4;
+    for (int i = 0; i < edits; i++) {
+      const std::size_t pos = result.empty() ? 0 : Next() % result.size();
+      switch (Next() % 3) {
+        case 0:
+          result.insert(pos, Text(alphabet, 6));
+          break;
+        case 1:
+          result.erase(pos, Next() % 6);
+          break;
+        default:
+          if (!result.empty()) {
+            result[pos] = alphabet[Next() % alphabet.size()];
+          }
+          break;
+      }
+    }
+    return result;
+  }
+
+ private:
+  uint32_t state_;
+};
+
 class DiffMatchPatchTest : public testing::Test {
   void SetUp() { dmp_.reset(new TestableDiffMatchPatch); }
 
@@ -80,6 +136,17 @@ TEST_F(DiffMatchPatchTest, DiffCommonPrefix) {
 
   EXPECT_EQ(4, dmp_->diff_commonPrefix(L"1234", L"1234xyz"))
       << "diff_commonPrefix: Whole case.";
+
+  // Mismatches in every position of several vector blocks.
+  const std::wstring text1(150, L'a');
+  for (std::size_t i = 0; i < text1.size(); i++) {
+    std::wstring text2 = text1;
+    text2[i] = L'\u0161';  // Same low byte as 'a'.
+    EXPECT_EQ(i, dmp_->diff_commonPrefix(text1, text2))
+        << "diff_commonPrefix: Long case.";
+    EXPECT_EQ(i, dmp_->diff_commonPrefix(text1, text1.substr(0, i)))
+        << "diff_commonPrefix: Long whole case.";
+  }
 }
 
 TEST_F(DiffMatchPatchTest, DiffCommonSuffix) {
@@ -92,6 +159,17 @@ TEST_F(DiffMatchPatchTest, DiffCommonSuffix) {
 
   EXPECT_EQ(4, dmp_->diff_commonSuffix(L"1234", L"xyz1234"))
       << "diff_commonSuffix: Whole case.";
+
+  // Mismatches in every position of several vector blocks.
+  const std::wstring text1(150, L'a');
+  for (std::size_t i = 0; i < text1.size(); i++) {
+    std::wstring text2 = text1;
+    text2[text1.size() - 1 - i] = L'\u0161';  // Same low byte as 'a'.
+    EXPECT_EQ(i, dmp_->diff_commonSuffix(text1, text2))
+        << "diff_commonSuffix: Long case.";
+    EXPECT_EQ(i, dmp_->diff_commonSuffix(text1, text1.substr(0, i)))
+        << "diff_commonSuffix: Long whole case.";
+  }
 }
 
 TEST_F(DiffMatchPatchTest, DiffCommonOverlap) {
@@ -228,6 +306,20 @@ TEST_F(DiffMatchPatchTest, DiffLinesToChars) {
   expected = std::make_tuple(chars, L"", vect);
   EXPECT_EQ(expected, dmp_->diff_linesToChars(lines, L""))
       << "diff_linesToChars: More than 256.";
+
+  // More than 65536 to reveal any 16-bit limitations, where wchar_t can hold
+  // the tokens.
+  if (sizeof(wchar_t) >= 4) {
+    n = 70000;
+    lines.clear();
+    chars.clear();
+    for (int x = 1; x < n + 1; x++) {
+      lines += AsString(x) + L"\n";
+      chars += (wchar_t)x;
+    }
+    EXPECT_EQ(chars, std::get<0>(dmp_->diff_linesToChars(lines, L"")))
+        << "diff_linesToChars: More than 65536.";
+  }
 }
 
 TEST_F(DiffMatchPatchTest, DiffCharsToLines) {
@@ -260,6 +352,20 @@ TEST_F(DiffMatchPatchTest, DiffCharsToLines) {
   dmp_->diff_charsToLines(diffs, vect);
   EXPECT_EQ(std::list<Diff>({Diff(DELETE, lines)}), diffs)
       << "diff_charsToLines: More than 256.";
+
+  // More than 65536 to reveal any 16-bit limitations.
+  if (sizeof(wchar_t) >= 4) {
+    n = 70000;
+    for (int x = 301; x < n + 1; x++) {
+      vect.push_back(AsString(x) + L"\n");
+      lines += AsString(x) + L"\n";
+      chars += (wchar_t)x;
+    }
+    diffs = {Diff(DELETE, chars)};
+    dmp_->diff_charsToLines(diffs, vect);
+    EXPECT_EQ(std::list<Diff>({Diff(DELETE, lines)}), diffs)
+        << "diff_charsToLines: More than 65536.";
+  }
 }
 
 TEST_F(DiffMatchPatchTest, DiffCleanupMerge) {
@@ -653,6 +759,33 @@ TEST_F(DiffMatchPatchTest, DiffLevenshtein) {
   diffs = {Diff(DELETE, L"abc"), Diff(EQUAL, L"xyz"), Diff(INSERT, L"1234")};
   EXPECT_EQ(7, dmp_->diff_levenshtein(diffs))
       << "diff_levenshtein: Middle equality.";
+
+  // Straight from the texts.
+  EXPECT_EQ(3, dmp_->diff_levenshtein(L"kitten", L"sitting"))
+      << "diff_levenshtein: Texts.";
+  EXPECT_EQ(4, dmp_->diff_levenshtein(L"", L"abcd"))
+      << "diff_levenshtein: Empty text.";
+  // Dynamic programming on random texts, across words of bit vectors.
+  TextGenerator generator(97531);
+  const std::wstring alphabet = L"ab\u00e9\u4e2d";
+  for (int i = 0; i < 200; i++) {
+    const std::wstring text1 = generator.Text(alphabet, i % 4 == 0 ? 300 : 70);
+    const std::wstring text2 = generator.Text(alphabet, i % 4 == 0 ? 300 : 70);
+    std::vector<std::size_t> row(text2.size() + 1), previous(row);
+    for (std::size_t y = 0; y <= text2.size(); y++) {
+      previous[y] = y;
+    }
+    for (std::size_t x = 1; x <= text1.size(); x++) {
+      row[0] = x;
+      for (std::size_t y = 1; y <= text2.size(); y++) {
+        row[y] = std::min(std::min(previous[y], row[y - 1]) + 1,
+                          previous[y - 1] + (text1[x - 1] != text2[y - 1]));
+      }
+      row.swap(previous);
+    }
+    EXPECT_EQ(previous[text2.size()], dmp_->diff_levenshtein(text1, text2))
+        << "diff_levenshtein: Random texts " << i << ".";
+  }
 }
 
 TEST_F(DiffMatchPatchTest, DiffBisect) {
@@ -671,6 +804,16 @@ TEST_F(DiffMatchPatchTest, DiffBisect) {
   // Timeout.
   diffs = {Diff(DELETE, L"cat"), Diff(INSERT, L"map")};
   EXPECT_EQ(diffs, dmp_->diff_bisect(a, b, 0)) << "diff_bisect: Timeout.";
+
+  // Reused workspace, left dirty by a larger diff which timed out.
+  const std::wstring text1(5000, L'a');
+  const std::wstring text2(4000, L'b');
+  dmp_->diff_bisect(text1 + L"x" + text1, text2 + L"x" + text2,
+                    clock() + CLOCKS_PER_SEC / 100);
+  diffs = {Diff(DELETE, L"c"), Diff(INSERT, L"m"), Diff(EQUAL, L"a"),
+           Diff(DELETE, L"t"), Diff(INSERT, L"p")};
+  EXPECT_EQ(diffs, dmp_->diff_bisect(a, b, std::numeric_limits<clock_t>::max()))
+      << "diff_bisect: Reused workspace.";
 }
 
 TEST_F(DiffMatchPatchTest, DiffMain) {
@@ -757,20 +900,60 @@ TEST_F(DiffMatchPatchTest, DiffMain) {
     a = a + a;
     b = b + b;
   }
-  clock_t startTime = clock();
+  auto startTime = std::chrono::steady_clock::now();
   dmp_->diff_main(a, b);
-  clock_t endTime = clock();
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - startTime)
+                       .count();
   // Test that we took at least the timeout period.
-  EXPECT_TRUE(dmp_->Diff_Timeout * CLOCKS_PER_SEC <= endTime - startTime)
-      << "diff_main: Timeout min.";
+  EXPECT_TRUE(dmp_->Diff_Timeout <= elapsed) << "diff_main: Timeout min.";
   // Test that we didn't take forever (be forgiving).
   // Theoretically this test could fail very occasionally if the
   // OS task swaps or locks up for a second at the wrong moment.
   // Java seems to overrun by ~80% (compared with 10% for other languages).
   // Therefore use an upper limit of 0.5s instead of 0.2s.
-  EXPECT_TRUE(dmp_->Diff_Timeout * CLOCKS_PER_SEC * 2 > endTime - startTime)
-      << "diff_main: Timeout max.";
+  EXPECT_TRUE(dmp_->Diff_Timeout * 2 > elapsed) << "diff_main: Timeout max.";
+
+  // The timeout is wall-clock time, even when several threads use the CPU.
+  dmp_->Diff_Threads = 4;
+  dmp_->Diff_ParallelGrain = 64;
+  startTime = std::chrono::steady_clock::now();
+  dmp_->diff_main(a, b);
+  elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          startTime)
+                .count();
+  EXPECT_TRUE(dmp_->Diff_Timeout <= elapsed)
+      << "diff_main: Parallel timeout min.";
+  EXPECT_TRUE(dmp_->Diff_Timeout * 2 > elapsed)
+      << "diff_main: Parallel timeout max.";
+  dmp_->Diff_Threads = 1;
+
+  // A cancelled diff stops like one which reached its deadline.
   dmp_->Diff_Timeout = 0;
+  CancellationToken token;
+  dmp_->Diff_CancellationToken = &token;
+  token.cancel();
+  diffs = {Diff(DELETE, L"cat"), Diff(INSERT, L"map")};
+  EXPECT_EQ(diffs, dmp_->diff_main(L"cat", L"map", false))
+      << "diff_main: Cancelled.";
+
+  // Cancelling from another thread.
+  CancellationToken other_token;
+  dmp_->Diff_CancellationToken = &other_token;
+  std::thread canceller([&other_token] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    other_token.cancel();
+  });
+  startTime = std::chrono::steady_clock::now();
+  const std::list<Diff> cancelled = dmp_->diff_main(a, b);
+  elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                          startTime)
+                .count();
+  canceller.join();
+  EXPECT_TRUE(elapsed < 1.0) << "diff_main: Cancelled from another thread.";
+  EXPECT_EQ(std::vector<std::wstring>({a, b}), diff_rebuildtexts(cancelled))
+      << "diff_main: Cancelled diff is valid.";
+  dmp_->Diff_CancellationToken = NULL;
 
   // Test the linemode speedup.
   // Must be long to pass the 100 char cutoff.
@@ -806,6 +989,493 @@ TEST_F(DiffMatchPatchTest, DiffMain) {
   auto texts_textmode = diff_rebuildtexts(dmp_->diff_main(a, b, false));
   EXPECT_EQ(texts_textmode, texts_linemode)
       << "diff_main: Overlap line - mode.";
+
+  // More than 65536 unique lines, the token of b's only line coming right
+  // after those of a.
+  a.clear();
+  for (int x = 1; x <= 65537; x++) {
+    a += AsString(x) + L"\n";
+  }
+  b = std::wstring(120, L'x') + L"\n";
+  texts_linemode = diff_rebuildtexts(dmp_->diff_main(a, b, true));
+  EXPECT_EQ(std::vector<std::wstring>({a, b}), texts_linemode)
+      << "diff_main: More than 65536 lines.";
+}
+
+TEST_F(DiffMatchPatchTest, FlatDiffs) {
+  // Conversion to and from the legacy representation.
+  std::list<Diff> diffs = {Diff(EQUAL, L"a"), Diff(DELETE, L"b"),
+                           Diff(INSERT, L"c"), Diff(EQUAL, L"")};
+  FlatDiffs flat = FlatDiffs::fromList(diffs);
+  EXPECT_EQ(4, flat.size()) << "FlatDiffs: fromList size.";
+  EXPECT_EQ(L"b", flat.text(flat.ops[1])) << "FlatDiffs: Arena text.";
+  EXPECT_EQ(diffs, flat.toList()) << "FlatDiffs: Round trip.";
+
+  // Operations of diff_mainFlat point into the inputs.
+  const std::wstring text1 = L"The cat";
+  const std::wstring text2 = L"The big cat";
+  flat = dmp_->diff_mainFlat(text1, text2, false);
+  EXPECT_EQ(dmp_->diff_main(text1, text2, false), flat.toList())
+      << "diff_mainFlat: Same diff as diff_main.";
+  for (const auto &op : flat.ops) {
+    const std::wstring &source = op.operation == INSERT ? text2 : text1;
+    EXPECT_EQ(source.data() + op.offset, flat.data(op))
+        << "diff_mainFlat: Zero copy.";
+  }
+  EXPECT_EQ(9, dmp_->diff_xIndex(flat, 5)) << "diff_xIndex: Flat.";
+  EXPECT_EQ(text1, dmp_->diff_wideText1(flat)) << "diff_wideText1: Flat.";
+  EXPECT_EQ(text2, dmp_->diff_wideText2(flat)) << "diff_wideText2: Flat.";
+  EXPECT_EQ(4, dmp_->diff_levenshtein(flat)) << "diff_levenshtein: Flat.";
+
+  // Cleanup passes on a diff which was never attached to texts.
+  flat = FlatDiffs::fromList({Diff(DELETE, L"a"), Diff(INSERT, L"abc"),
+                              Diff(DELETE, L"dc")});
+  dmp_->diff_cleanupMerge(flat);
+  EXPECT_EQ(std::list<Diff>({Diff(EQUAL, L"a"), Diff(DELETE, L"d"),
+                             Diff(INSERT, L"b"), Diff(EQUAL, L"c")}),
+            flat.toList())
+      << "diff_cleanupMerge: Flat prefix and suffix detection.";
+}
+
+TEST_F(DiffMatchPatchTest, FlatDiffsCleanup) {
+  // The FlatDiffs passes must produce exactly what the list passes produce.
+  std::vector<std::list<Diff> > inputs = {
+      {Diff(EQUAL, L"a"), Diff(DELETE, L"b"), Diff(INSERT, L"c")},
+      {Diff(DELETE, L"a"), Diff(INSERT, L"b"), Diff(DELETE, L"c"),
+       Diff(INSERT, L"d"), Diff(EQUAL, L"e"), Diff(EQUAL, L"f")},
+      {Diff(EQUAL, L"x"), Diff(DELETE, L"a"), Diff(INSERT, L"abc"),
+       Diff(DELETE, L"dc"), Diff(EQUAL, L"y")},
+      {Diff(EQUAL, L"a"), Diff(DELETE, L"b"), Diff(EQUAL, L"c"),
+       Diff(DELETE, L"ac"), Diff(EQUAL, L"x")},
+      {Diff(EQUAL, L"x"), Diff(DELETE, L"ca"), Diff(EQUAL, L"c"),
+       Diff(DELETE, L"b"), Diff(EQUAL, L"a")},
+      {Diff(EQUAL, L"AAA\r\n\r\nBBB"), Diff(INSERT, L"\r\nDDD\r\n\r\nBBB"),
+       Diff(EQUAL, L"\r\nEEE")},
+      {Diff(EQUAL, L"The c"), Diff(INSERT, L"ow and the c"),
+       Diff(EQUAL, L"at.")},
+      {Diff(DELETE, L"a"), Diff(EQUAL, L"b"), Diff(DELETE, L"c")},
+      {Diff(DELETE, L"abcxxx"), Diff(INSERT, L"xxxdef")},
+      {Diff(DELETE, L"xxxabc"), Diff(INSERT, L"defxxx")},
+      {Diff(EQUAL, L"1"), Diff(DELETE, L"A"), Diff(EQUAL, L"B"),
+       Diff(INSERT, L"2"), Diff(EQUAL, L"_"), Diff(INSERT, L"1"),
+       Diff(EQUAL, L"A"), Diff(DELETE, L"B"), Diff(INSERT, L"2")},
+      {Diff(DELETE, L"ab"), Diff(INSERT, L"12"), Diff(EQUAL, L"xyz"),
+       Diff(DELETE, L"cd"), Diff(INSERT, L"34")},
+      {Diff(INSERT, L"12"), Diff(EQUAL, L"x"), Diff(DELETE, L"cd"),
+       Diff(INSERT, L"34")},
+  };
+  TextGenerator generator(1234);
+  const std::wstring alphabet = L"ab c.\n";
+  dmp_->Diff_Timeout = 0;
+  for (int i = 0; i < 300; i++) {
+    const std::wstring text1 = generator.Text(alphabet, 40);
+    inputs.push_back(
+        dmp_->diff_main(text1, generator.Mutate(text1, alphabet), false));
+  }
+
+  for (const auto &input : inputs) {
+    std::list<Diff> expected = input;
+    FlatDiffs flat = FlatDiffs::fromList(input);
+    dmp_->diff_cleanupMerge(expected);
+    dmp_->diff_cleanupMerge(flat);
+    EXPECT_EQ(expected, flat.toList()) << "diff_cleanupMerge: Flat.";
+
+    expected = input;
+    flat = FlatDiffs::fromList(input);
+    dmp_->diff_cleanupSemanticLossless(expected);
+    dmp_->diff_cleanupSemanticLossless(flat);
+    EXPECT_EQ(expected, flat.toList())
+        << "diff_cleanupSemanticLossless: Flat.";
+
+    expected = input;
+    flat = FlatDiffs::fromList(input);
+    dmp_->diff_cleanupSemantic(expected);
+    dmp_->diff_cleanupSemantic(flat);
+    EXPECT_EQ(expected, flat.toList()) << "diff_cleanupSemantic: Flat.";
+
+    expected = input;
+    flat = FlatDiffs::fromList(input);
+    dmp_->diff_cleanupEfficiency(expected);
+    dmp_->diff_cleanupEfficiency(flat);
+    EXPECT_EQ(expected, flat.toList()) << "diff_cleanupEfficiency: Flat.";
+
+    flat = FlatDiffs::fromList(input);
+    EXPECT_EQ(dmp_->diff_toWideDelta(input), dmp_->diff_toWideDelta(flat))
+        << "diff_toDelta: Flat.";
+    EXPECT_EQ(dmp_->patch_toWideText(dmp_->patch_make(input)),
+              dmp_->patch_toWideText(dmp_->patch_make(flat)))
+        << "patch_make: Flat.";
+  }
+}
+
+TEST_F(DiffMatchPatchTest, DiffParallel) {
+  // Threads must not change the result.
+  TextGenerator generator(4321);
+  const std::wstring alphabet = L"abcd efg.\n";
+  dmp_->Diff_Timeout = 1000;
+  for (int i = 0; i < 40; i++) {
+    std::wstring text1 = generator.Text(alphabet, 3000);
+    std::wstring text2 = text1;
+    for (int j = 0; j < 20; j++) {
+      text2 = generator.Mutate(text2, alphabet);
+    }
+    const bool checklines = i % 2 == 0;
+    dmp_->Diff_Threads = 1;
+    const std::list<Diff> serial = dmp_->diff_main(text1, text2, checklines);
+    dmp_->Diff_Threads = 4;
+    dmp_->Diff_ParallelGrain = 64;
+    EXPECT_EQ(serial, dmp_->diff_main(text1, text2, checklines))
+        << "diff_main: Parallel.";
+  }
+}
+
+TEST_F(DiffMatchPatchTest, DiffBatch) {
+  // Results come back in order, the same as one diff_main each.
+  TextGenerator generator(8642);
+  const std::wstring alphabet = L"abcd efg.\n";
+  dmp_->Diff_Timeout = 1000;
+  std::vector<std::pair<std::wstring, std::wstring> > pairs;
+  std::size_t characters = 0;
+  for (int i = 0; i < 60; i++) {
+    std::wstring text1 = generator.Text(alphabet, i % 10 == 0 ? 5000 : 300);
+    std::wstring text2 = text1;
+    for (int j = 0; j < 10; j++) {
+      text2 = generator.Mutate(text2, alphabet);
+    }
+    characters += text1.size() + text2.size();
+    pairs.push_back(std::make_pair(text1, text2));
+  }
+  for (const int threads : {1, 4}) {
+    dmp_->Diff_Threads = threads;
+    dmp_->Diff_ParallelGrain = 64;
+    DiffBatchStats stats;
+    const std::vector<FlatDiffs> batch =
+        dmp_->diff_mainBatch(pairs, true, &stats);
+    ASSERT_EQ(pairs.size(), batch.size()) << "diff_mainBatch: Size.";
+    for (std::size_t i = 0; i < pairs.size(); i++) {
+      EXPECT_EQ(dmp_->diff_main(pairs[i].first, pairs[i].second),
+                batch[i].toList())
+          << "diff_mainBatch: Pair " << i << ".";
+    }
+    EXPECT_EQ(pairs.size(), stats.pairs) << "diff_mainBatch: Stats pairs.";
+    EXPECT_EQ(characters, stats.characters)
+        << "diff_mainBatch: Stats characters.";
+    EXPECT_EQ(0u, stats.timeouts) << "diff_mainBatch: Stats timeouts.";
+  }
+
+  // UTF-8 pairs.
+  std::vector<std::pair<std::string, std::string> > utf8_pairs = {
+      std::make_pair("h\xC3\xA9llo", "h\xC3\xA8llo"),
+      std::make_pair("", "abc")};
+  const std::vector<Utf8Diffs> utf8_batch =
+      dmp_->diff_mainUtf8Batch(utf8_pairs);
+  std::list<Diff> diffs = {Diff(EQUAL, L"h"), Diff(DELETE, L"\u00e9"),
+                           Diff(INSERT, L"\u00e8"), Diff(EQUAL, L"llo")};
+  EXPECT_EQ(diffs, utf8_batch[0].toList()) << "diff_mainUtf8Batch: Align.";
+  diffs = {Diff(INSERT, L"abc")};
+  EXPECT_EQ(diffs, utf8_batch[1].toList()) << "diff_mainUtf8Batch: Insert.";
+
+  // Every pair which cannot finish counts as a timeout.
+  CancellationToken token;
+  token.cancel();
+  dmp_->Diff_CancellationToken = &token;
+  pairs = {std::make_pair(L"cat", L"map"), std::make_pair(L"abc", L"abc"),
+           std::make_pair(L"dog", L"fig")};
+  DiffBatchStats stats;
+  dmp_->diff_mainBatch(pairs, false, &stats);
+  EXPECT_EQ(2u, stats.timeouts) << "diff_mainBatch: Cancelled.";
+  dmp_->Diff_CancellationToken = NULL;
+  dmp_->Diff_Threads = 1;
+}
+
+TEST_F(DiffMatchPatchTest, DiffAlgorithms) {
+  dmp_->Diff_Timeout = 0;
+  // Patience diff: "c" is not unique in text2, so Myers splits the texts
+  // first and the parts are anchored on their unique characters.
+  dmp_->Diff_Algorithm = PATIENCE;
+  std::list<Diff> diffs = {Diff(DELETE, L"ab"), Diff(EQUAL, L"c"),
+                           Diff(INSERT, L"b"),  Diff(EQUAL, L"ab"),
+                           Diff(DELETE, L"b"),  Diff(EQUAL, L"a"),
+                           Diff(INSERT, L"c")};
+  EXPECT_EQ(diffs, dmp_->diff_main(L"abcabba", L"cbabac", false))
+      << "diff_main: Patience.";
+
+  // Histogram diff: "c" is the rarest character of text1, so the texts are
+  // split around it first.  Of the equally good runs in "abba" and "babac",
+  // the one nearest the middle of the new text is taken.
+  dmp_->Diff_Algorithm = HISTOGRAM;
+  diffs = {Diff(DELETE, L"ab"), Diff(EQUAL, L"c"),  Diff(DELETE, L"a"),
+           Diff(EQUAL, L"b"),   Diff(INSERT, L"a"), Diff(EQUAL, L"ba"),
+           Diff(INSERT, L"c")};
+  EXPECT_EQ(diffs, dmp_->diff_main(L"abcabba", L"cbabac", false))
+      << "diff_main: Histogram.";
+
+  // "aQ" holds the rarest character, so it is the anchor rather than the
+  // longer "bbba" found after it.
+  diffs = {Diff(DELETE, L"zz"), Diff(INSERT, L"w"),  Diff(EQUAL, L"z"),
+           Diff(DELETE, L"x"),  Diff(EQUAL, L"bbb"), Diff(DELETE, L"aybc"),
+           Diff(EQUAL, L"aQ"),  Diff(INSERT, L"w")};
+  EXPECT_EQ(diffs, dmp_->diff_main(L"zzzxbbbaybcaQ", L"wzbbbaQw", false))
+      << "diff_main: Histogram rarest anchor.";
+
+  // Characters occurring more than 64 times in text1 are not anchors, so the
+  // "aQ" run is kept over the longer run of "b"s only up to 64 times.
+  const std::wstring bs(200, L'b');
+  std::wstring aqs;
+  for (int i = 0; i < 64; i++) {
+    aqs += L"aQ";
+  }
+  diffs = {Diff(INSERT, bs), Diff(EQUAL, aqs), Diff(DELETE, bs)};
+  EXPECT_EQ(diffs, dmp_->diff_main(aqs + bs, bs + aqs, false))
+      << "diff_main: Histogram anchor at 64 occurrences.";
+  aqs += L"aQ";
+  diffs = {Diff(DELETE, aqs), Diff(EQUAL, bs), Diff(INSERT, aqs)};
+  EXPECT_EQ(diffs, dmp_->diff_main(aqs + bs, bs + aqs, false))
+      << "diff_main: Histogram no anchor at 65 occurrences.";
+
+  // Thousands of hunks, each an anchor, don't deepen the recursion.
+  std::wstring lines1, lines2;
+  for (int i = 0; i < 20000; i++) {
+    const std::wstring line = L"line " + std::to_wstring(i) + L"\n";
+    lines1 += line;
+    lines2 += i % 4 == 0 ? L"edited " + std::to_wstring(i) + L"\n" : line;
+  }
+  EXPECT_EQ(std::vector<std::wstring>({lines1, lines2}),
+            diff_rebuildtexts(dmp_->diff_main(lines1, lines2, true)))
+      << "diff_main: Histogram many line hunks.";
+  std::wstring pairs1, pairs2;
+  for (wchar_t c = 0x4e00; c < 0x4e00 + 10000; c += 2) {
+    pairs1 += std::wstring({c, static_cast<wchar_t>(c + 1)});
+    pairs2 += std::wstring({static_cast<wchar_t>(c + 1), c});
+  }
+  EXPECT_EQ(std::vector<std::wstring>({pairs1, pairs2}),
+            diff_rebuildtexts(dmp_->diff_main(pairs1, pairs2, false)))
+      << "diff_main: Histogram many character hunks.";
+
+  // Bit-parallel diff: as minimal as Myers, but traced back from the end,
+  // so equalities are matched as late as possible.
+  dmp_->Diff_Algorithm = BIT_PARALLEL;
+  diffs = {Diff(DELETE, L"a"),  Diff(INSERT, L"c"), Diff(EQUAL, L"b"),
+           Diff(DELETE, L"c"),  Diff(EQUAL, L"a"),  Diff(DELETE, L"b"),
+           Diff(EQUAL, L"ba"), Diff(INSERT, L"c")};
+  EXPECT_EQ(diffs, dmp_->diff_main(L"abcabba", L"cbabac", false))
+      << "diff_main: Bit-parallel.";
+
+  // Every algorithm must produce a valid diff, in char and line mode, with
+  // or without threads.
+  TextGenerator generator(2468);
+  const std::wstring alphabet = L"abcd {}\n";
+  for (const DiffAlgorithm algorithm : {PATIENCE, HISTOGRAM, BIT_PARALLEL}) {
+    dmp_->Diff_Algorithm = algorithm;
+    for (int i = 0; i < 40; i++) {
+      std::wstring text1 = generator.Text(alphabet, 2000);
+      std::wstring text2 = text1;
+      for (int j = 0; j < 10; j++) {
+        text2 = generator.Mutate(text2, alphabet);
+      }
+      const bool checklines = i % 2 == 0;
+      dmp_->Diff_Threads = 1;
+      const std::list<Diff> serial = dmp_->diff_main(text1, text2, checklines);
+      EXPECT_EQ(std::vector<std::wstring>({text1, text2}),
+                diff_rebuildtexts(serial))
+          << "diff_main: Algorithm " << algorithm << ".";
+      dmp_->Diff_Threads = 4;
+      dmp_->Diff_ParallelGrain = 64;
+      EXPECT_EQ(serial, dmp_->diff_main(text1, text2, checklines))
+          << "diff_main: Algorithm " << algorithm << " in parallel.";
+    }
+  }
+
+  // Bit-parallel diffs are minimal, within a word of bit vectors or across
+  // several.
+  dmp_->Diff_Threads = 1;
+  for (int i = 0; i < 40; i++) {
+    const std::wstring text1 = generator.Text(alphabet, i % 2 ? 60 : 500);
+    const std::wstring text2 = generator.Text(alphabet, i % 2 ? 60 : 500);
+    std::size_t edits[2];
+    for (const DiffAlgorithm algorithm : {MYERS, BIT_PARALLEL}) {
+      dmp_->Diff_Algorithm = algorithm;
+      const std::list<Diff> diffs = dmp_->diff_main(text1, text2, false);
+      EXPECT_EQ(std::vector<std::wstring>({text1, text2}),
+                diff_rebuildtexts(diffs))
+          << "diff_main: Bit-parallel valid.";
+      edits[algorithm == BIT_PARALLEL] = 0;
+      for (const Diff &diff : diffs) {
+        if (diff.operation != EQUAL) {
+          edits[algorithm == BIT_PARALLEL] += diff.text.size();
+        }
+      }
+    }
+    EXPECT_EQ(edits[0], edits[1]) << "diff_main: Bit-parallel minimal.";
+  }
+}
+
+TEST_F(DiffMatchPatchTest, DiffAnytime) {
+  // A deadline which has passed by the time the texts are bisected.
+  dmp_->Diff_Timeout = 1e-9f;
+  const std::wstring text1 = L"The quick brown fox jumps over the lazy dog.";
+  const std::wstring text2 = L"The quack brown fox jumped over a lazy dog!";
+  FlatDiffs flat = dmp_->diff_mainFlat(text1, text2, false);
+  std::list<Diff> diffs = {
+      Diff(EQUAL, L"The qu"),
+      Diff(DELETE, L"ick brown fox jumps over the lazy dog."),
+      Diff(INSERT, L"ack brown fox jumped over a lazy dog!")};
+  EXPECT_EQ(diffs, flat.toList()) << "diff_main: Timeout replaces.";
+  std::vector<DiffRegion> regions = {DiffRegion(6, 38, 6, 37)};
+  EXPECT_EQ(regions, flat.approximate) << "diff_main: Timeout region.";
+
+  // Unique runs of characters anchor equalities.
+  dmp_->Diff_Anytime = true;
+  flat = dmp_->diff_mainFlat(text1, text2, false);
+  diffs = {Diff(EQUAL, L"The qu"), Diff(DELETE, L"i"),
+           Diff(INSERT, L"a"), Diff(EQUAL, L"ck brown fox jump"),
+           Diff(DELETE, L"s"), Diff(INSERT, L"ed"),
+           Diff(EQUAL, L" over "), Diff(DELETE, L"the"),
+           Diff(INSERT, L"a"), Diff(EQUAL, L" lazy dog"),
+           Diff(DELETE, L"."), Diff(INSERT, L"!")};
+  EXPECT_EQ(diffs, flat.toList()) << "diff_main: Anytime characters.";
+  EXPECT_EQ(regions, flat.approximate) << "diff_main: Anytime region.";
+
+  // Equal lines are kept first.
+  diffs = {Diff(DELETE, L"O"), Diff(INSERT, L"o"),
+           Diff(EQUAL, L"ne\ntwo\nthree"), Diff(INSERT, L"!"),
+           Diff(EQUAL, L"\nfour\nfive"), Diff(INSERT, L".")};
+  EXPECT_EQ(diffs, dmp_->diff_main(L"One\ntwo\nthree\nfour\nfive",
+                                   L"one\ntwo\nthree!\nfour\nfive.", false))
+      << "diff_main: Anytime lines.";
+
+  // A cancelled diff is not approximated.
+  CancellationToken token;
+  token.cancel();
+  dmp_->Diff_CancellationToken = &token;
+  diffs = {Diff(EQUAL, L"The qu"),
+           Diff(DELETE, L"ick brown fox jumps over the lazy dog."),
+           Diff(INSERT, L"ack brown fox jumped over a lazy dog!")};
+  EXPECT_EQ(diffs, dmp_->diff_main(text1, text2, false))
+      << "diff_main: Anytime cancelled.";
+  dmp_->Diff_CancellationToken = NULL;
+
+  // Much less is replaced than without Diff_Anytime, and the diff is valid.
+  TextGenerator generator(1357);
+  const std::wstring alphabet = L"abcdefghijklmnopqrstuvwxyz \n";
+  std::wstring text3 = generator.Text(alphabet, 20000);
+  while (text3.size() < 10000) {
+    text3 += generator.Text(alphabet, 20000);
+  }
+  std::wstring text4 = text3;
+  for (int i = 0; i < 100; i++) {
+    text4 = generator.Mutate(text4, alphabet);
+  }
+  for (const bool checklines : {false, true}) {
+    std::size_t inserted[2];
+    for (const bool anytime : {false, true}) {
+      dmp_->Diff_Anytime = anytime;
+      flat = dmp_->diff_mainFlat(text3, text4, checklines);
+      EXPECT_EQ(std::vector<std::wstring>({text3, text4}),
+                diff_rebuildtexts(flat.toList()))
+          << "diff_main: Anytime valid.";
+      EXPECT_FALSE(flat.approximate.empty()) << "diff_main: Anytime regions.";
+      inserted[anytime] = 0;
+      for (const auto &op : flat.ops) {
+        inserted[anytime] += op.operation == INSERT ? op.length : 0;
+      }
+    }
+    EXPECT_TRUE(inserted[1] * 10 < inserted[0]) << "diff_main: Anytime size.";
+  }
+  dmp_->Diff_Anytime = false;
+}
+
+TEST_F(DiffMatchPatchTest, DiffStats) {
+  // Counters are kept only in builds with DIFF_MATCH_PATCH_STATS.
+  diff_match_patch::diff_resetStats();
+  std::wstring text1, text2;
+  for (int i = 0; i < 20; i++) {
+    text1 += L"The quick brown fox " + std::to_wstring(i) + L"\n";
+    text2 += L"The quack brown fox " + std::to_wstring(i * 3) + L"\n";
+  }
+  dmp_->diff_main(text1, text2, true);
+  dmp_->diff_mainUtf8("h\xC3\xA9llo", "h\xC3\xA8llo", false).toList();
+  CancellationToken token;
+  token.cancel();
+  dmp_->Diff_CancellationToken = &token;
+  dmp_->diff_main(L"cat", L"map", false);
+  dmp_->Diff_CancellationToken = NULL;
+
+  DiffStats stats = diff_match_patch::diff_stats();
+  const DiffStats::Phase *const phases[] = {
+      &stats.prefix, &stats.halfMatch, &stats.lineHash,
+      &stats.bisect, &stats.cleanup,   &stats.transcode};
+  for (const DiffStats::Phase *phase : phases) {
+    EXPECT_EQ(stats.enabled, phase->calls > 0) << "diff_stats: Calls.";
+  }
+  EXPECT_EQ(stats.enabled, stats.bisectDepth > 0) << "diff_stats: Depth.";
+  EXPECT_EQ(stats.enabled, stats.bisectSteps >= stats.bisectDepth &&
+                               stats.bisectSteps > 0)
+      << "diff_stats: Steps.";
+  EXPECT_EQ(stats.enabled ? 1u : 0u, stats.deadlineHits)
+      << "diff_stats: Deadline hits.";
+  EXPECT_EQ(stats.enabled, stats.bytesTranscoded >= 8)
+      << "diff_stats: Bytes transcoded.";
+
+  diff_match_patch::diff_resetStats();
+  stats = diff_match_patch::diff_stats();
+  EXPECT_EQ(0u, stats.bisect.calls + stats.cleanup.nanoseconds +
+                    stats.bisectSteps + stats.deadlineHits)
+      << "diff_resetStats: Zero.";
+}
+
+TEST_F(DiffMatchPatchTest, Utf8Diffs) {
+  UnicodeEncoder unicode_encoder;
+  // Offsets are in bytes and no operation splits a code point, even where
+  // the encodings of two characters share their first byte.
+  std::string text1 = "caf\xc3\xa9";
+  std::string text2 = "caf\xc3\xa8";
+  Utf8Diffs utf8 = dmp_->diff_mainUtf8(text1, text2, false);
+  EXPECT_EQ(std::list<Diff>({Diff(EQUAL, L"caf"), Diff(DELETE, L"\u00e9"),
+                             Diff(INSERT, L"\u00e8")}),
+            utf8.toList())
+      << "diff_mainUtf8: Shared lead byte.";
+  EXPECT_EQ(3, utf8.ops[1].offset) << "diff_mainUtf8: Byte offset.";
+  EXPECT_EQ(2, utf8.ops[1].length) << "diff_mainUtf8: Byte length.";
+
+  text1 = "\xe4\xb8\x80\xe4\xb8\x81";
+  text2 = "\xe4\xb8\x81\xe4\xb8\x80";
+  EXPECT_EQ(std::list<Diff>({Diff(DELETE, L"\u4e00\u4e01"),
+                             Diff(INSERT, L"\u4e01\u4e00")}),
+            dmp_->diff_mainUtf8(text1, text2, false).toList())
+      << "diff_mainUtf8: Equal bytes within different code points.";
+
+  // Random texts mixing one to four byte characters.
+  TextGenerator generator(2468);
+  const std::wstring alphabet = L"ab \n\u00e9\u00e8\u4e00\u4e01\U0001f600";
+  for (int i = 0; i < 200; i++) {
+    const std::wstring wide1 = generator.Text(alphabet, 150);
+    const std::wstring wide2 = generator.Mutate(wide1, alphabet);
+    text1 = unicode_encoder.to_bytes(wide1);
+    text2 = unicode_encoder.to_bytes(wide2);
+    utf8 = dmp_->diff_mainUtf8(text1, text2, i % 2 == 0);
+    std::vector<std::wstring> texts = diff_rebuildtexts(utf8.toList());
+    EXPECT_EQ(wide1, texts[0]) << "diff_mainUtf8: Random text1.";
+    EXPECT_EQ(wide2, texts[1]) << "diff_mainUtf8: Random text2.";
+
+    dmp_->diff_cleanupSemantic(utf8);
+    dmp_->diff_cleanupEfficiency(utf8);
+    texts = diff_rebuildtexts(utf8.toList());
+    EXPECT_EQ(wide1, texts[0]) << "diff_cleanupSemantic: Utf8 text1.";
+    EXPECT_EQ(wide2, texts[1]) << "diff_cleanupSemantic: Utf8 text2.";
+  }
+
+  // ASCII texts give the same diff as the wide engine.
+  const std::wstring ascii = L"abc d.\n";
+  for (int i = 0; i < 100; i++) {
+    const std::wstring wide1 = generator.Text(ascii, 200);
+    const std::wstring wide2 = generator.Mutate(wide1, ascii);
+    EXPECT_EQ(dmp_->diff_main(wide1, wide2, false),
+              dmp_->diff_mainUtf8(unicode_encoder.to_bytes(wide1),
+                                  unicode_encoder.to_bytes(wide2), false)
+                  .toList())
+        << "diff_mainUtf8: ASCII.";
+  }
 }
 
 // //  MATCH TEST FUNCTIONS
@@ -879,6 +1549,28 @@ TEST_F(DiffMatchPatchTest, MatchBitap) {
   dmp_->Match_Distance = 1000;  // Loose location.
   EXPECT_EQ(0, dmp_->match_bitap(L"abcdefghijklmnopqrstuvwxyz", L"abcdefg", 24))
       << "match_bitap: Distance test #3.";
+
+  // Patterns longer than a word of bits, up to Match_MaxBits.
+  std::wstring text;
+  for (int i = 0; i < 8; i++) {
+    text += L"The quick brown fox jumps over the lazy dog " +
+            std::to_wstring(i) + L". ";
+  }
+  std::wstring pattern = text.substr(100, 150);
+  pattern[20] = L'X';
+  pattern[90] = L'Y';
+  pattern.erase(130, 1);
+  EXPECT_THROW(dmp_->match_bitap(text, pattern, 90), const char *)
+      << "match_bitap: Pattern too long.";
+  dmp_->Match_MaxBits = 0;
+  EXPECT_EQ(100, dmp_->match_bitap(text, pattern, 90))
+      << "match_bitap: Multi-word pattern.";
+  EXPECT_EQ(100, dmp_->match_bitap(text, pattern.substr(0, 40), 90))
+      << "match_bitap: Pattern over 32 characters.";
+  pattern = text.substr(0, 64);
+  pattern[63] = L'Z';
+  EXPECT_EQ(0, dmp_->match_bitap(text, pattern, 10))
+      << "match_bitap: Error in the top bit.";
 }
 
 TEST_F(DiffMatchPatchTest, MatchMain) {
@@ -897,6 +1589,108 @@ TEST_F(DiffMatchPatchTest, MatchMain) {
                              L" that berry ", 5))
       << "match_main: Complex match.";
   dmp_->Match_Threshold = 0.5f;
+
+  EXPECT_EQ(9, dmp_->match_mainUtf8("caf\xc3\xa9 au lait", "lait", 0))
+      << "match_mainUtf8: Byte offset.";
+  EXPECT_EQ(5, dmp_->match_mainUtf8("\xc3\xa9\xc3\xa9 abcdef", "abxdef", 0))
+      << "match_mainUtf8: Fuzzy match.";
+  EXPECT_EQ(0, dmp_->match_mainUtf8("\xc3\xa9\xc3\xa9", "\xa9\xc3\xa9", 0))
+      << "match_mainUtf8: Start of code point.";
+}
+
+TEST_F(DiffMatchPatchTest, MatchIndex) {
+  const std::wstring text = L"I am the very model of a modern major general.";
+  const MatchIndex index(text);
+  EXPECT_EQ(3, index.q()) << "MatchIndex: Default gram length.";
+  EXPECT_EQ(5, dmp_->match_main(index, L"the", 3))
+      << "match_main: Indexed exact match.";
+  EXPECT_EQ(11, dmp_->match_main(index, L"ry model", 0))
+      << "match_main: Indexed exact match elsewhere.";
+  dmp_->Match_Threshold = 0.7f;
+  EXPECT_EQ(4, dmp_->match_main(index, L" that berry ", 5))
+      << "match_main: Indexed complex match.";
+  dmp_->Match_Threshold = 0.5f;
+  EXPECT_THROW(MatchIndex(text, 0), std::string)
+      << "MatchIndex: Empty grams.";
+  static_assert(!std::is_constructible<MatchIndex, std::wstring>::value,
+                "MatchIndex: No index of a temporary.");
+
+  // The same as match_main on the text, on random texts and patterns taken
+  // from them, for grams of several lengths.
+  TextGenerator generator(13579);
+  const std::wstring alphabet = L"abcdefgh\u00e9\u4e2d";
+  dmp_->Match_MaxBits = 0;
+  for (int i = 0; i < 60; i++) {
+    dmp_->Match_Distance = i % 4 == 0 ? 0 : 10 * (generator.Next() % 300);
+    dmp_->Match_Threshold = (generator.Next() % 10) / 10.0f;
+    const std::wstring text = generator.Text(
+        alphabet.substr(0, 2 + generator.Next() % (alphabet.size() - 1)),
+        3000);
+    const MatchIndex index(text, 1 + i % 5);
+    for (int k = 0; k < 20; k++) {
+      const std::size_t at = text.empty() ? 0 : generator.Next() % text.size();
+      std::wstring pattern = generator.Mutate(
+          text.substr(at, 1 + generator.Next() % (k % 4 == 0 ? 100 : 40)),
+          alphabet);
+      if (pattern.empty()) {
+        pattern = L"a";
+      }
+      const std::size_t loc = generator.Next() % (text.size() + 20);
+      EXPECT_EQ(dmp_->match_main(text, pattern, loc),
+                dmp_->match_main(index, pattern, loc))
+          << "match_main: Indexed random queries " << i << "." << k << ".";
+    }
+  }
+}
+
+TEST_F(DiffMatchPatchTest, MatchMainBatch) {
+  const std::vector<std::pair<std::wstring, std::size_t> > queries = {
+      {L"abcdef", 1000}, {L"de", 3}, {L"", 3}, {L"ccdef", 0}, {L"xyz", 5}};
+  const std::size_t npos = std::wstring::npos;
+  EXPECT_EQ(std::vector<std::size_t>({npos, npos, 0, npos, npos}),
+            dmp_->match_mainBatch(L"", queries))
+      << "match_mainBatch: Null text.";
+  EXPECT_EQ(std::vector<std::size_t>({0, 3, 3, 1, npos}),
+            dmp_->match_mainBatch(L"abcdef", queries))
+      << "match_mainBatch: Shortcuts and fuzzy matches.";
+  EXPECT_THROW(dmp_->match_mainBatch(L"abcdef", {{std::wstring(40, L'x'), 0}}),
+               const char *)
+      << "match_mainBatch: Over Match_MaxBits.";
+
+  // The same as one match_main per query, for queries overlapping in one
+  // window and others far apart, with patterns which fill the words of the
+  // lanes or take match_bitap's own words.
+  dmp_->Match_MaxBits = 0;
+  TextGenerator generator(24680);
+  const std::wstring alphabet = L"abc\u00e9\u4e2d";
+  for (int i = 0; i < 100; i++) {
+    dmp_->Match_Distance = i % 5 == 0 ? 0 : 10 * (generator.Next() % 200);
+    dmp_->Match_Threshold = (generator.Next() % 10) / 10.0f;
+    const std::wstring text = generator.Text(alphabet, 400);
+    std::vector<std::pair<std::wstring, std::size_t> > batch;
+    const std::size_t size = generator.Next() % 40;
+    for (std::size_t k = 0; k < size; k++) {
+      const std::size_t pattern_size =
+          1 + generator.Next() % (k % 8 == 0 ? 90 : 40);
+      const std::size_t at =
+          text.empty() ? 0 : generator.Next() % text.size();
+      std::wstring pattern = generator.Mutate(
+          text.substr(at, pattern_size), alphabet.substr(0, 2));
+      if (pattern.empty()) {
+        pattern = L"a";
+      }
+      batch.push_back(
+          std::make_pair(pattern, generator.Next() % (text.size() + 20)));
+    }
+    const std::vector<std::size_t> results =
+        dmp_->match_mainBatch(text, batch);
+    ASSERT_EQ(batch.size(), results.size());
+    for (std::size_t k = 0; k < batch.size(); k++) {
+      EXPECT_EQ(dmp_->match_main(text, batch[k].first, batch[k].second),
+                results[k])
+          << "match_mainBatch: Random queries " << i << "." << k << ".";
+    }
+  }
 }
 
 // //  PATCH TEST FUNCTIONS
@@ -1053,6 +1847,153 @@ TEST_F(DiffMatchPatchTest, PatchMake) {
       << "patch_make: Long string with repeats.";
 }
 
+TEST_F(DiffMatchPatchTest, PatchMakeUtf8) {
+  UnicodeEncoder unicode_encoder;
+  // Patches made on the bytes must match those made from the decoded diff,
+  // including the context grown around repeated patterns.
+  TextGenerator generator(1357);
+  const std::wstring alphabet = L"ab \n\u00e9\u4e00\U0001f600";
+  for (int i = 0; i < 200; i++) {
+    const std::wstring wide1 = generator.Text(alphabet, 300);
+    std::wstring wide2 = wide1;
+    for (int j = 0; j < 8; j++) {
+      wide2 = generator.Mutate(wide2, alphabet);
+    }
+    const std::string text1 = unicode_encoder.to_bytes(wide1);
+    const std::string text2 = unicode_encoder.to_bytes(wide2);
+    Utf8Diffs diffs = dmp_->diff_mainUtf8(text1, text2, false);
+    dmp_->diff_cleanupSemantic(diffs);
+    EXPECT_EQ(dmp_->patch_toWideText(dmp_->patch_make(wide1, diffs.toList())),
+              dmp_->patch_toWideText(dmp_->patch_make(diffs)))
+        << "patch_make: Utf8Diffs.";
+  }
+}
+
+TEST_F(DiffMatchPatchTest, PatchMakeRollingContext) {
+  UnicodeEncoder unicode_encoder;
+  // Context taken from the texts, through their indexes once there are
+  // enough patches, must match context taken from the old text rebuilt with
+  // each diff.
+  TextGenerator generator(8642);
+  const std::wstring alphabet = L"ab \n\u00e9";
+  for (int i = 0; i < 20; i++) {
+    std::wstring text1;
+    while (text1.size() < 4000) {
+      text1 += generator.Text(alphabet, 100);
+    }
+    std::wstring text2 = text1;
+    for (int j = 0; j < 12; j++) {
+      text2 = generator.Mutate(text2, alphabet);
+    }
+    const std::list<Diff> diffs = dmp_->diff_main(text1, text2, false);
+
+    std::list<Patch> expected;
+    Patch patch;
+    std::size_t char_count2 = 0;
+    std::wstring prepatch_text = text1;
+    std::wstring postpatch_text = text1;
+    for (const auto &aDiff : diffs) {
+      if (patch.diffs.empty() && aDiff.operation != EQUAL) {
+        patch.start1 = patch.start2 = char_count2;
+      }
+      if (aDiff.operation == INSERT) {
+        patch.diffs.push_back(aDiff);
+        patch.size2 += aDiff.text.size();
+        postpatch_text.insert(char_count2, aDiff.text);
+      } else if (aDiff.operation == DELETE) {
+        patch.diffs.push_back(aDiff);
+        patch.size1 += aDiff.text.size();
+        postpatch_text.erase(char_count2, aDiff.text.size());
+      } else {
+        if (aDiff.text.size() <= 2 * dmp_->Patch_Margin &&
+            !patch.diffs.empty() && !(aDiff == diffs.back())) {
+          patch.diffs.push_back(aDiff);
+          patch.size1 += aDiff.text.size();
+          patch.size2 += aDiff.text.size();
+        }
+        if (aDiff.text.size() >= 2 * dmp_->Patch_Margin &&
+            !patch.diffs.empty()) {
+          dmp_->patch_addContext(patch, prepatch_text);
+          expected.push_back(patch);
+          patch = Patch();
+          prepatch_text = postpatch_text;
+        }
+      }
+      if (aDiff.operation != DELETE) {
+        char_count2 += aDiff.text.size();
+      }
+    }
+    if (!patch.diffs.empty()) {
+      dmp_->patch_addContext(patch, prepatch_text);
+      expected.push_back(patch);
+    }
+
+    EXPECT_LE(16u, expected.size()) << "patch_make: Indexed.";
+    EXPECT_EQ(dmp_->patch_toWideText(expected),
+              dmp_->patch_toWideText(dmp_->patch_make(text1, diffs)))
+        << "patch_make: Diffs.";
+    EXPECT_EQ(dmp_->patch_toWideText(expected),
+              dmp_->patch_toWideText(
+                  dmp_->patch_make(text1, FlatDiffs::fromList(diffs))))
+        << "patch_make: FlatDiffs.";
+    EXPECT_EQ(dmp_->patch_toWideText(expected),
+              dmp_->patch_toWideText(dmp_->patch_make(
+                  Utf8Diffs::fromList(diffs))))
+        << "patch_make: Utf8Diffs.";
+  }
+}
+
+TEST_F(DiffMatchPatchTest, PatchMakeFiles) {
+  const std::string path1 = testing::TempDir() + "dmp_old.txt";
+  const std::string path2 = testing::TempDir() + "dmp_new.txt";
+  std::string text1, text2;
+  for (int x = 0; x < 500; x++) {
+    text1 += "line " + std::to_string(x) + " caf\xc3\xa9\n";
+    text2 += "line " + std::to_string(x % 7 == 0 ? x * 2 : x) +
+             (x % 11 == 0 ? " \xe4\xb8\x80\n" : " caf\xc3\xa9\n");
+  }
+  std::ofstream(path1.c_str(), std::ios::binary) << text1;
+  std::ofstream(path2.c_str(), std::ios::binary) << text2;
+  {
+    const MappedFile file1(path1);
+    const MappedFile file2(path2);
+    EXPECT_EQ(text1.size(), file1.size()) << "MappedFile: Size.";
+    EXPECT_EQ(text1, std::string(file1.data(), file1.size()))
+        << "MappedFile: Contents.";
+    EXPECT_EQ(dmp_->diff_mainUtf8(text1, text2).toList(),
+              dmp_->diff_mainFiles(file1, file2).toList())
+        << "diff_mainFiles: Same as diff_mainUtf8.";
+    const std::list<Patch> patches = dmp_->patch_makeFiles(file1, file2);
+    EXPECT_EQ(dmp_->patch_toText(dmp_->patch_make(text1, text2)),
+              dmp_->patch_toText(patches))
+        << "patch_makeFiles: Same as patch_make.";
+    EXPECT_EQ(text2, dmp_->patch_apply(patches, text1).first)
+        << "patch_makeFiles: Apply.";
+  }
+  std::ofstream(path2.c_str(), std::ios::binary | std::ios::trunc);
+  {
+    const MappedFile file1(path1);
+    const MappedFile empty(path2);
+    EXPECT_EQ(0, empty.size()) << "MappedFile: Empty file.";
+    EXPECT_EQ(std::list<Diff>({Diff(DELETE, dmp_->diff_mainUtf8(text1, "")
+                                                .toList()
+                                                .front()
+                                                .text)}),
+              dmp_->diff_mainFiles(file1, empty).toList())
+        << "diff_mainFiles: Empty file.";
+  }
+  std::remove(path1.c_str());
+  std::remove(path2.c_str());
+
+  bool thrown = false;
+  try {
+    MappedFile missing(path1);
+  } catch (const std::string &) {
+    thrown = true;
+  }
+  EXPECT_TRUE(thrown) << "MappedFile: Missing file.";
+}
+
 TEST_F(DiffMatchPatchTest, PatchSplitMax) {
   // Assumes that Match_MaxBits is 32.
   auto patches = dmp_->patch_make(
@@ -1269,6 +2210,81 @@ TEST_F(DiffMatchPatchTest, PatchApply) {
   boolArray = results.second;
   resultStr = results.first + L"\t" + (boolArray[0] ? L"true" : L"false");
   EXPECT_EQ(L"x123\ttrue", resultStr) << "patch_apply: Edge partial match.";
+
+  // With patterns up to 128 characters, patches keep more context and are
+  // split into fewer pieces.
+  std::wstring text1, text2, text3;
+  for (int i = 0; i < 40; i++) {
+    const std::wstring line =
+        L"Line " + std::to_wstring(i) + L" of the text.\n";
+    text1 += line;
+    text2 += i / 4 == 2 ? L"Rewritten " + std::to_wstring(i) + L".\n" : line;
+    text3 += i == 20 ? L"Line twenty of the text.\n" : line;
+  }
+  patches = dmp_->patch_make(text1, text2);
+  const std::size_t split32 = dmp_->patch_apply(patches, text3).second.size();
+  dmp_->Match_MaxBits = 128;
+  patches = dmp_->patch_make(text1, text2);
+  results = dmp_->patch_apply(patches, text3);
+  EXPECT_TRUE(results.second.size() < split32)
+      << "patch_apply: Fewer patches.";
+  EXPECT_EQ(std::vector<bool>(results.second.size(), true), results.second)
+      << "patch_apply: Long patterns applied.";
+  std::wstring expected = text2;
+  expected.replace(expected.find(L"Line 20 "), 7, L"Line twenty");
+  EXPECT_EQ(expected, results.first) << "patch_apply: Long patterns result.";
+
+  // Without a limit on the pattern size, patches still find their place in a
+  // shifted text, and long ones are not split.
+  dmp_->Match_MaxBits = 0;
+  patches = dmp_->patch_make(L"The quick brown fox jumps over the lazy dog.",
+                             L"The quick brown fox jumped over the lazy dog.");
+  results = dmp_->patch_apply(
+      patches, L"xyzThe quick brown fox jumps over the lazy dog.");
+  boolArray = results.second;
+  resultStr = results.first + L"\t" + (boolArray[0] ? L"true" : L"false");
+  EXPECT_EQ(L"xyzThe quick brown fox jumped over the lazy dog.\ttrue",
+            resultStr)
+      << "patch_apply: Unlimited pattern size.";
+
+  patches = dmp_->patch_make(text1, text2);
+  results = dmp_->patch_apply(patches, text3);
+  EXPECT_EQ(std::vector<bool>(patches.size(), true), results.second)
+      << "patch_apply: Unlimited patterns not split.";
+  EXPECT_EQ(expected, results.first)
+      << "patch_apply: Unlimited patterns result.";
+}
+
+TEST_F(DiffMatchPatchTest, PatchApplyParallel) {
+  // Threads must not change the result, whether the patches lie far apart,
+  // drift, or read text which those before them changed.
+  TextGenerator generator(2468);
+  const std::wstring alphabet = L"abcdef";
+  const int distances[] = {0, 10, 100, 1000};
+  dmp_->Diff_Timeout = 1000;
+  for (int i = 0; i < 60; i++) {
+    std::wstring text1 = generator.Text(alphabet, 3000);
+    std::wstring text2 = text1;
+    for (int j = 0; j < 30; j++) {
+      text2 = generator.Mutate(text2, alphabet);
+    }
+    std::wstring text3 = text1;
+    for (int j = 0; j < i % 5 * 4; j++) {
+      text3 = generator.Mutate(text3, alphabet);
+    }
+    dmp_->Match_Distance = distances[i % 4];
+    dmp_->Match_Threshold = i % 3 == 0 ? 0.8f : 0.5f;
+    const std::list<Patch> patches = dmp_->patch_make(text1, text2);
+    dmp_->Patch_Threads = 1;
+    dmp_->Diff_ParallelGrain = 1 << 16;
+    const auto serial = dmp_->patch_apply(patches, text3);
+    dmp_->Patch_Threads = 4;
+    dmp_->Diff_ParallelGrain = 64;
+    const auto parallel = dmp_->patch_apply(patches, text3);
+    EXPECT_EQ(serial.first, parallel.first) << "patch_apply: Parallel text.";
+    EXPECT_EQ(serial.second, parallel.second)
+        << "patch_apply: Parallel results.";
+  }
 }
 
 }  // namespace